@@ -0,0 +1,301 @@
+## blockcyclic.jl - matrices distributed block-cyclically over a process grid
+##
+## BlockCyclicMatrix{T} -
+##     a matrix cut into mb x nb blocks, where block (I,J) lives on process
+##     grid[(I-1)%pr+1, (J-1)%pc+1] of a pr x pc grid of processes. each
+##     process keeps its blocks packed in one local matrix, laid out as in
+##     ScaLAPACK. every process holds part of every block row and column,
+##     so work on the whole matrix stays balanced as the grid grows.
+##
+## bcmatrix(init, T, (m,n), (mb,nb)[, grid]) -
+##     init(T, local_size, B) makes each process's local matrix. grid is a
+##     matrix of process ids, by default procgrid(procs()).
+##
+## bczeros(T, (m,n), (mb,nb)[, grid]), bcrand((m,n), (mb,nb)[, grid])
+##
+## bcdistribute(a, (mb,nb)[, grid]) - distribute an Array or DArray
+##
+## procgrid(pids) - arrange the processes pids in the squarest grid
+##
+## A*B for two such matrices on the same grid, where A's column blocks
+## match B's row blocks, is computed with SUMMA. for each block column k of
+## A, every process fetches the part of A's column panel k in its grid row
+## and of B's row panel k in its grid column, and adds their product to its
+## part of the result with one gemm. the panels for step k+1 are requested
+## before the product for step k is computed, so they are sent while it
+## runs.
+
+type BlockCyclicMatrix{T} <: AbstractArray{T,2}
+    go::GlobalObject
+    dims::(Int,Int)
+    blk::(Int,Int)
+    grid::Array{Int,2}
+    # my row and column in grid, or 0
+    myrow::Int
+    mycol::Int
+    locl::Array{T,2}
+
+    function BlockCyclicMatrix(go, initializer, dims, blk, grid)
+        (r, c) = _jl_bc_place(grid, myid())
+        B = new(go, dims, blk, grid, r, c)
+        lsz = r==0 ? (0, 0) : (_jl_bc_numroc(B, 1, r), _jl_bc_numroc(B, 2, c))
+        B.locl = r==0 ? Array(T, lsz) : initializer(T, lsz, B)
+        B
+    end
+
+    # don't use BlockCyclicMatrix() directly; use bcmatrix() below instead
+    function BlockCyclicMatrix(initializer, dims, blk, grid)
+        go = GlobalObject(grid[:],
+                          g->BlockCyclicMatrix{T}(g,initializer,dims,blk,grid))
+        go.local_identity
+    end
+end
+
+function serialize{T}(s, B::BlockCyclicMatrix{T})
+    i = worker_id_from_socket(s)
+    if is(is_go_member(B.go,i), false)
+        invoke(serialize, (Any, Any),
+               s,
+               ccall(:jl_new_structt, Any, (Any, Any),
+                     BlockCyclicMatrix{T},
+                     (B.go, B.dims, B.blk, B.grid, 0, 0, Array(T, 0, 0))))
+    else
+        serialize(s, B.go)
+    end
+end
+
+function procgrid(pids)
+    np = length(pids)
+    pr = int(floor(sqrt(np)))
+    while np % pr != 0
+        pr -= 1
+    end
+    reshape([pids], pr, div(np, pr))
+end
+
+function _jl_bc_place(grid, p)
+    for j=1:size(grid,2)
+        for i=1:size(grid,1)
+            if grid[i,j] == p
+                return (i, j)
+            end
+        end
+    end
+    (0, 0)
+end
+
+# number of indexes in dimension d held by grid row or column i
+function _jl_bc_numroc(B::BlockCyclicMatrix, d, i)
+    n = B.dims[d]
+    b = B.blk[d]
+    np = size(B.grid, d)
+    nblocks = div(n, b)
+    num = div(nblocks, np)*b
+    extra = nblocks % np
+    if i-1 < extra
+        num += b
+    elseif i-1 == extra
+        num += n % b
+    end
+    num
+end
+
+# the indexes in dimension d held by grid row or column i, in local order
+function _jl_bc_indexes(B::BlockCyclicMatrix, d, i)
+    n = B.dims[d]
+    b = B.blk[d]
+    np = size(B.grid, d)
+    I = Array(Int, _jl_bc_numroc(B, d, i))
+    k = 0
+    for lo = ((i-1)*b+1):(np*b):n
+        for g = lo:min(lo+b-1, n)
+            k += 1
+            I[k] = g
+        end
+    end
+    I
+end
+
+_jl_bc_myindexes(B::BlockCyclicMatrix, d) =
+    _jl_bc_indexes(B, d, d==1 ? B.myrow : B.mycol)
+
+# grid row or column holding index i of dimension d, and its local index
+function _jl_bc_locate(B::BlockCyclicMatrix, d, i)
+    b = B.blk[d]
+    np = size(B.grid, d)
+    I = div(i-1, b)
+    (I%np + 1, div(I, np)*b + (i-1)%b + 1)
+end
+
+size(B::BlockCyclicMatrix) = B.dims
+procs(B::BlockCyclicMatrix) = B.grid[:]
+localize(B::BlockCyclicMatrix) = B.locl
+
+## Constructors ##
+
+bcmatrix(init, T::Type, dims::Dims, blk::Dims, grid::Array{Int,2}) =
+    BlockCyclicMatrix{T}(init, dims, blk, grid)
+bcmatrix(init, T::Type, dims::Dims, blk::Dims) =
+    bcmatrix(init, T, dims, blk, procgrid(procs()))
+
+bczeros(T::Type, args...) = bcmatrix((T,lsz,B)->zeros(T,lsz), T, args...)
+bcrand(args...) = bcmatrix((T,lsz,B)->rand(lsz), Float64, args...)
+
+similar(B::BlockCyclicMatrix, T, dims::Dims) =
+    bcmatrix((T,lsz,B)->Array(T,lsz), T, dims, B.blk, B.grid)
+
+function bcdistribute{T}(a::Array{T,2}, blk::Dims, grid::Array{Int,2})
+    # create a remotely-visible reference to the array
+    rr = RemoteRef()
+    put(rr, a)
+    bcmatrix((T,lsz,B)->_jl_bc_distribute_one(T,lsz,B,rr), T, size(a), blk,
+             grid)
+end
+
+bcdistribute{T}(d::DArray{T,2}, blk::Dims, grid::Array{Int,2}) =
+    bcmatrix((T,lsz,B)->_jl_bc_distribute_one(T,lsz,B,d), T, size(d), blk,
+             grid)
+
+bcdistribute(a, blk::Dims) = bcdistribute(a, blk, procgrid(procs()))
+
+# fetch one processor's blocks of a matrix being distributed
+function _jl_bc_distribute_one(T, lsz, B, src)
+    if prod(lsz)==0
+        return Array(T, lsz)
+    end
+    src[_jl_bc_myindexes(B, 1), _jl_bc_myindexes(B, 2)]
+end
+
+convert{T}(::Type{Array}, B::BlockCyclicMatrix{T}) = convert(Array{T,2}, B)
+
+function convert{S,T}(::Type{Array{S,2}}, B::BlockCyclicMatrix{T})
+    a = Array(S, size(B))
+    parts = {}
+    for j=1:size(B.grid,2)
+        for i=1:size(B.grid,1)
+            I = _jl_bc_indexes(B, 1, i)
+            J = _jl_bc_indexes(B, 2, j)
+            if !isempty(I) && !isempty(J)
+                push(parts, (I, J, remote_call(B.grid[i,j], localize, B)))
+            end
+        end
+    end
+    for (I, J, r) in parts
+        a[I, J] = fetch(r)
+    end
+    a
+end
+
+show(io, B::BlockCyclicMatrix) = show(io, convert(Array, B))
+
+## Indexing ##
+
+function ref{T}(B::BlockCyclicMatrix{T}, i::Int, j::Int)
+    (gi, li) = _jl_bc_locate(B, 1, i)
+    (gj, lj) = _jl_bc_locate(B, 2, j)
+    if gi == B.myrow && gj == B.mycol
+        return B.locl[li, lj]
+    end
+    return remote_call_fetch(B.grid[gi, gj], ref, B, i, j)::T
+end
+
+ref(B::BlockCyclicMatrix, i::Int) = ref(B, ind2sub(B.dims, i)...)
+
+function assign(B::BlockCyclicMatrix, v, i::Int, j::Int)
+    (gi, li) = _jl_bc_locate(B, 1, i)
+    (gj, lj) = _jl_bc_locate(B, 2, j)
+    if gi == B.myrow && gj == B.mycol
+        B.locl[li, lj] = v
+    else
+        sync_add(remote_call(B.grid[gi, gj], assign, B, v, i, j))
+    end
+    B
+end
+
+assign(B::BlockCyclicMatrix, v, i::Int) = assign(B, v, ind2sub(B.dims, i)...)
+
+## matrix multiply ##
+
+# the local part of panel K of B: a block column if d is 2, a block row if
+# d is 1
+function _jl_bc_panel_range(B::BlockCyclicMatrix, d, K)
+    b = B.blk[d]
+    lo = div(K-1, size(B.grid, d))*b
+    (lo+1):(lo + min(K*b, B.dims[d]) - (K-1)*b)
+end
+
+function _jl_bc_local_panel(B::BlockCyclicMatrix, d, K)
+    R = _jl_bc_panel_range(B, d, K)
+    L = B.locl
+    d==1 ? sub(L, R, 1:size(L,2)) : sub(L, 1:size(L,1), R)
+end
+
+function _jl_bc_copy_panel(B::BlockCyclicMatrix, d, K)
+    R = _jl_bc_panel_range(B, d, K)
+    L = B.locl
+    d==1 ? L[R, 1:size(L,2)] : L[1:size(L,1), R]
+end
+
+# panel K of the local part of grid process (i,j), or a request for it
+function _jl_bc_panel(B::BlockCyclicMatrix, i, j, d, K)
+    p = B.grid[i, j]
+    if p == myid()
+        return _jl_bc_local_panel(B, d, K)
+    end
+    remote_call(p, _jl_bc_copy_panel, B, d, K)
+end
+
+# C += A*B
+function _jl_bc_gemm(C, A, B)
+    P = A*B
+    for i=1:numel(C)
+        C[i] += P[i]
+    end
+    C
+end
+
+function _jl_bc_gemm{T<:Union(Float64,Float32,Complex128,Complex64)}(
+    C::StridedMatrix{T}, A::StridedMatrix{T}, B::StridedMatrix{T})
+    _jl_blas_gemm('N', 'N', size(C,1), size(C,2), size(A,2),
+                  one(T), A, stride(A,2),
+                  B, stride(B,2),
+                  one(T), C, stride(C,2))
+    C
+end
+
+function _jl_bc_summa(C, A, B)
+    Cl = localize(C)
+    if isempty(Cl)
+        return
+    end
+    (pr, pc) = size(C.grid)
+    r = C.myrow
+    c = C.mycol
+    nk = div(size(A,2) + A.blk[2]-1, A.blk[2])
+    panels(K) = (_jl_bc_panel(A, r, (K-1)%pc+1, 2, K),
+                 _jl_bc_panel(B, (K-1)%pr+1, c, 1, K))
+    next = panels(1)
+    for K = 1:nk
+        (a, b) = next
+        if K < nk
+            next = panels(K+1)
+        end
+        _jl_bc_gemm(Cl, fetch(a), fetch(b))
+    end
+end
+
+function (*){T}(A::BlockCyclicMatrix{T}, B::BlockCyclicMatrix{T})
+    if size(A,2) != size(B,1)
+        error("*: argument shapes do not match")
+    end
+    if !isequal(A.grid, B.grid) || A.blk[2] != B.blk[1]
+        error("*: block sizes and process grids must match")
+    end
+    C = bczeros(T, (size(A,1), size(B,2)), (A.blk[1], B.blk[2]), A.grid)
+    @sync begin
+        for p = procs(C)
+            @spawnat p _jl_bc_summa(C, A, B)
+        end
+    end
+    C
+end
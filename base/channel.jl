@@ -0,0 +1,151 @@
+## channel.jl - bounded multi-producer multi-consumer queues
+##
+## Channel{T}(n) - a queue of up to n items of type T (n is rounded up to a
+##     power of 2). Channel(n) holds items of any type.
+##
+## put(c, v) - add v to the end, waiting while the channel is full
+##
+## take(c) - remove the oldest item, waiting while the channel is empty
+##
+## take(c, t) - ...throwing a TimeoutException after t seconds
+##
+## take_n(c, n) - remove up to n items, waiting only for the first
+##
+## isready(c) - whether take(c) would return without waiting
+##
+## items live in a preallocated ring, so put and take do not allocate.
+## slots are claimed with atomic operations (see jl_mpmc_* in threading.c),
+## so native code on other threads can share the ring of a Channel of a
+## bits type. waiting tasks are suspended through the Scheduler like tasks
+## waiting on a RemoteRef.
+
+const _jl_mpmc_head = 9   # index of the take position in Channel.pos
+# passed to deliver_result to wake waiters, so a wakeup allocates no closure
+const _jl_nothing_thunk = ()->nothing
+
+_jl_channel_id = 0
+
+type Channel{T}
+    data::Array{T,1}
+    seq::Array{Uint,1}
+    pos::Array{Uint,1}
+    mask::Uint
+    oid::(Int,Int)
+    nputwait::Int
+    ntakewait::Int
+
+    function Channel(n::Integer)
+        global _jl_channel_id
+        if n < 1
+            error("Channel: capacity must be positive")
+        end
+        n = nextpow2(n)
+        seq = Array(Uint, n)
+        for i = 1:n
+            seq[i] = i-1
+        end
+        _jl_channel_id += 1
+        new(Array(T, n), seq, zeros(Uint, 2*_jl_mpmc_head), uint(n-1),
+            (0, _jl_channel_id), 0, 0)
+    end
+end
+Channel(n::Integer) = Channel{Any}(n)
+
+rr2id(c::Channel) = c.oid
+
+length(c::Channel) = int(ccall(:jl_mpmc_length, Uint, (Ptr{Uint},), c.pos))
+isempty(c::Channel) = length(c) == 0
+isready(c::Channel) = !isempty(c)
+capacity(c::Channel) = length(c.data)
+
+function wait_channel(c::Channel, verb::Symbol, timeout::Real)
+    if is(verb,:put)
+        c.nputwait += 1
+    else
+        c.ntakewait += 1
+    end
+    timedout = false
+    try
+        wait_for(verb, c, timeout)
+    catch e
+        if !isa(e,TimeoutException)
+            throw(e)
+        end
+        timedout = true
+    end
+    if is(verb,:put)
+        c.nputwait -= 1
+    else
+        c.ntakewait -= 1
+    end
+    if timedout
+        throw(TimeoutException())
+    end
+end
+wait_channel(c::Channel, verb::Symbol) = wait_channel(c, verb, -1)
+
+function put{T}(c::Channel{T}, v)
+    v = convert(T, v)
+    while true
+        p = ccall(:jl_mpmc_reserve_put, Int64, (Ptr{Uint}, Ptr{Uint}, Uint),
+                  c.pos, c.seq, c.mask)
+        if p >= 0
+            c.data[int(p & c.mask) + 1] = v
+            ccall(:jl_mpmc_commit_put, Void, (Ptr{Uint}, Int64, Uint),
+                  c.seq, p, c.mask)
+            if c.ntakewait > 0
+                deliver_result((), :take, c.oid, _jl_nothing_thunk)
+            end
+            return v
+        end
+        wait_channel(c, :put)
+    end
+end
+
+# take an item if there is one, otherwise return the channel itself
+function take_nowait{T}(c::Channel{T})
+    p = ccall(:jl_mpmc_reserve_take, Int64, (Ptr{Uint}, Ptr{Uint}, Uint),
+              c.pos, c.seq, c.mask)
+    if p < 0
+        return c
+    end
+    i = int(p & c.mask) + 1
+    v = c.data[i]
+    if !isa(T, BitsKind)
+        # don't keep the item alive from the buffer
+        ccall(:jl_arrayunset, Void, (Any, Uint), c.data, i-1)
+    end
+    ccall(:jl_mpmc_commit_take, Void, (Ptr{Uint}, Int64, Uint),
+          c.seq, p, c.mask)
+    if c.nputwait > 0
+        deliver_result((), :put, c.oid, _jl_nothing_thunk)
+    end
+    v
+end
+
+function take{T}(c::Channel{T}, timeout::Real)
+    deadline = time() + timeout
+    while true
+        v = take_nowait(c)
+        if !is(v, c)
+            return v::T
+        end
+        wait_channel(c, :take, timeout < 0 ? -1 : max(deadline-time(), 0))
+    end
+end
+take(c::Channel) = take(c, -1)
+
+function take_n{T}(c::Channel{T}, n::Integer)
+    a = Array(T, 0)
+    push(a, take(c))
+    while length(a) < n
+        v = take_nowait(c)
+        if is(v, c)
+            break
+        end
+        push(a, v::T)
+    end
+    a
+end
+
+show(io, c::Channel) = print(io, typeof(c), "(", length(c), "/", capacity(c), ")")
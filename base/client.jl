@@ -204,6 +204,7 @@ function _start()
     try
         ccall(:jl_register_toplevel_eh, Void, ())
         ccall(:jl_start_io_thread, Void, ())
+        _jl_init_msg_serializer()
         global const Workqueue = WorkItem[]
         global const Waiting = Dict(64)
 
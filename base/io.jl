@@ -55,6 +55,13 @@ position(s::IOStream) = ccall(:ios_pos, FileOffset, (Ptr{Void},), s.ios)
 
 eof(s::IOStream) = bool(ccall(:jl_ios_eof, Int32, (Ptr{Void},), s.ios))
 
+# in non-blocking mode, a read or write that would block suspends the
+# calling task until the descriptor is ready, so other tasks can run
+set_nonblocking(s::IOStream, on::Bool) =
+    system_error(:set_nonblocking,
+                 ccall(:ios_set_nonblocking, Int32, (Ptr{Void}, Int32),
+                       s.ios, on) != 0)
+
 ## constructing and opening streams ##
 
 # "own" means the descriptor will be closed with the IOStream
@@ -1,8 +1,5 @@
 ## time-related functions ##
 
-# TODO: check for usleep errors?
-sleep(s::Real) = ccall(:usleep, Void, (Uint32,), uint32(iround(s*1e6)))
-
 strftime(t) = strftime("%c", t)
 function strftime(fmt::ByteString, t)
     tmstruct = Array(Int32, 14)
@@ -15,6 +15,8 @@
 ##
 ## fetch(rr) - wait for and get the value of a RemoteRef
 ##
+## wait(rr, t), fetch(rr, t) - ...giving up after t seconds
+##
 ## remote_call_fetch(w, func, args...) - faster fetch(remote_call(...))
 ##
 ## pmap(func, lst) -
@@ -49,7 +51,7 @@
 # - more dynamic scheduling
 # * fetch/wait latency seems to be excessive
 # * message aggregation
-# - timer events
+# * timer events
 # - send pings at some interval to detect failed/hung machines
 # - integrate event loop with other kinds of i/o (non-messages)
 # ? method_missing for waiting (ref/assign/localdata seems to cover a lot)
@@ -92,8 +94,9 @@ type Worker
     fd::Int32
     socket::IOStream
     sendbuf::IOStream
-    del_msgs::Array{Any,1}
-    add_msgs::Array{Any,1}
+    # reference changes for refs w owns: whence, id, client for each
+    del_msgs::Array{Int,1}
+    add_msgs::Array{Int,1}
     id::Int
     gcflag::Bool
     
@@ -102,10 +105,18 @@ type Worker
         if fd == -1
             error("could not connect to $host:$port, errno=$(errno())\n")
         end
-        Worker(host, port, fd, fdio(fd, true))
+        _jl_heartbeat(fd)
+        link = ccall(:jl_shm_connect, Ptr{Void}, (Int32, Int32),
+                     fd, _jl_shm_local(host) ? 1 : 0)
+        Worker(host, port, fd, _jl_shm_stream(fd, link))
     end
 
-    Worker(host,port,fd,sock,id) = new(host, port, fd, sock, memio(), {}, {}, id, false)
+    function Worker(host,port,fd,sock,id)
+        w = new(host, port, fd, sock, memio(), Array(Int,0), Array(Int,0),
+                id, false)
+        _jl_open_ser_session(w.sendbuf)
+        w
+    end
     Worker(host,port,fd,sock) = Worker(host,port,fd,sock,0)
 end
 
@@ -117,40 +128,59 @@ function send_msg(w::Worker, kind, args...)
     send_msg_(w, kind, args, false)
 end
 
+# reference changes go out in one message per worker, adds first, at the
+# latest gc_flush_interval seconds after the first of them, or as soon as
+# _jl_gc_batch are waiting
 function flush_gc_msgs(w::Worker)
     w.gcflag = false
-    msgs = w.add_msgs
-    if !isempty(msgs)
-        del_all(w.add_msgs)
-        remote_do(w, add_clients, msgs...)
-    end
-
-    msgs = w.del_msgs
-    if !isempty(msgs)
-        del_all(w.del_msgs)
-        #print("sending delete of $msgs\n")
-        remote_do(w, del_clients, msgs...)
+    if !isempty(w.add_msgs) || !isempty(w.del_msgs)
+        #print("sending delete of $(w.del_msgs)\n")
+        # the arrays may still be referenced by a queued message, so new
+        # entries go into fresh ones rather than clearing these
+        adds = w.add_msgs; dels = w.del_msgs
+        w.add_msgs = Array(Int,0)
+        w.del_msgs = Array(Int,0)
+        remote_do(w, gc_msgs, adds, dels)
     end
 end
 
 function send_msg_(w::Worker, kind, args, now::Bool)
+    if has(_jl_shm_links, w.fd)
+        args = map(_jl_shm_wrap, args)
+        _jl_shm_track(w.fd, args)
+    end
     buf = w.sendbuf
     ccall(:jl_buf_mutex_lock, Void, (Ptr{Void},), buf.ios)
-    serialize(buf, kind)
+    _jl_msg_serialize(buf, kind)
     for arg in args
-        serialize(buf, arg)
+        _jl_msg_serialize(buf, arg)
     end
     ccall(:jl_buf_mutex_unlock, Void, (Ptr{Void},), buf.ios)
 
     if !now && w.gcflag
         flush_gc_msgs(w)
     else
-        ccall(:jl_enq_send_req, Void, (Ptr{Void}, Ptr{Void}, Int32),
-              w.socket.ios, w.sendbuf.ios, now ? int32(1) : int32(0))
+        ccall(:jl_enq_send_req, Void, (Int32, Ptr{Void}, Int32),
+              w.fd, w.sendbuf.ios, now ? int32(1) : int32(0))
     end
 end
 
+# non-urgent messages to an idle worker are sent at once; in a burst they
+# wait up to max_delay seconds for more, or until flush_bytes are buffered
+set_send_policy(w::Worker, max_delay::Real, flush_bytes::Integer) =
+    ccall(:jl_set_send_policy, Void, (Int32, Float64, Uint),
+          w.fd, max_delay, flush_bytes)
+
+# (messages, write calls, bytes) sent to w so far
+function send_stats(w::Worker)
+    a = zeros(Int64, 3)
+    ccall(:jl_send_stats, Void, (Int32, Ptr{Int64}), w.fd, a)
+    (a[1], a[2], a[3])
+end
+
 function flush_gc_msgs()
+    global _jl_gc_flush_due
+    _jl_gc_flush_due = Inf
     for w = (PGRP::ProcessGroup).workers
         if isa(w,Worker)
             k = w::Worker
@@ -161,6 +191,120 @@ function flush_gc_msgs()
     end
 end
 
+## shared-memory transport ##
+
+# a connection to a process on the same host gets a shared-memory link
+# (see jl_shm_connect in sys.c): messages travel through rings in a shared
+# segment, and the socket only carries wakeups. messages are moved out of
+# the ring into a memory stream, which takes the socket's place as the
+# worker's stream. set JULIA_NO_SHM to use sockets only.
+
+const _jl_shm_links = Dict()   # fd => link
+
+_jl_shm_local(host) = !has(ENV, "JULIA_NO_SHM") &&
+    (host == "localhost" || host == "127.0.0.1" || host == getipaddr())
+
+function _jl_shm_stream(fd, link::Ptr{Void})
+    if link == C_NULL
+        return fdio(fd, true)
+    end
+    _jl_shm_links[fd] = link
+    memio()
+end
+
+# move the messages waiting in fd's link to sock, waiting for some if wait
+# is true. returns false if the connection is closed.
+function _jl_shm_pull(fd, sock::IOStream, wait::Bool)
+    ccall(:jl_shm_pull, Int64, (Ptr{Void}, Ptr{Void}, Int32),
+          _jl_shm_links[fd], sock.ios, wait ? 1 : 0) >= 0
+end
+
+function _jl_shm_close(fd)
+    if has(_jl_shm_links, fd)
+        ccall(:jl_shm_close, Void, (Ptr{Void},), _jl_shm_links[fd])
+        del(_jl_shm_links, fd)
+    end
+    _jl_shm_unlink_sent(fd)
+end
+
+# bits arrays of at least this many bytes, sent to a process on this host
+# as a message argument or result, go in a file in shared memory of their
+# own. the receiver maps it, so the data is copied once instead of into
+# the message, the ring, and out again.
+const _jl_shm_array_min = 1<<18
+
+_jl_shm_nseg = 0
+
+# a new file name in shared memory
+function _jl_shm_path()
+    global _jl_shm_nseg
+    _jl_shm_nseg += 1
+    dir = isdir("/dev/shm") ? "/dev/shm/julia-" : "/tmp/julia-shm-"
+    "$dir$(getpid())-$(_jl_shm_nseg)"
+end
+
+type ShmArrayRef
+    path::ByteString
+    eltype::Type
+    dims::Dims
+end
+
+_jl_shm_wrap(x) = x
+_jl_shm_wrap(a::Array) = _jl_shm_wrap_array(a)
+_jl_shm_wrap(t::Tuple) = map(_jl_shm_wrap_array, t)
+
+_jl_shm_wrap_array(x) = x
+function _jl_shm_wrap_array(a::Array)
+    T = eltype(a)
+    if !isa(T,BitsKind) || numel(a)*sizeof(T) < _jl_shm_array_min
+        return a
+    end
+    path = _jl_shm_path()
+    f = open(path, "w")
+    write(f, a)
+    close(f)
+    ShmArrayRef(path, T, size(a))
+end
+
+# files of arrays sent on each link. the peer unlinks a file once it has
+# mapped it; the rest are removed when the connection closes.
+const _jl_shm_sent = Dict()   # fd => paths
+
+function _jl_shm_track(fd, args)
+    for a in args, r in (isa(a,Tuple) ? a : (a,))
+        if isa(r, ShmArrayRef)
+            if !has(_jl_shm_sent, fd)
+                _jl_shm_sent[fd] = Array(ByteString, 0)
+            end
+            paths = _jl_shm_sent[fd]
+            if length(paths) >= 64
+                # forget the ones the peer has taken
+                paths = _jl_shm_sent[fd] = filter(isfile, paths)
+            end
+            push(paths, r.path)
+        end
+    end
+end
+
+function _jl_shm_unlink_sent(fd)
+    if has(_jl_shm_sent, fd)
+        for path in _jl_shm_sent[fd]
+            ccall(:unlink, Int32, (Ptr{Uint8},), path)
+        end
+        del(_jl_shm_sent, fd)
+    end
+end
+
+function deserialize(s, t::Type{ShmArrayRef})
+    r = force(invoke(deserialize, (Any, CompositeKind), s, t))
+    f = open(r.path, "r+")
+    a = mmap_array(r.eltype, r.dims, f, convert(FileOffset,0))
+    close(f)
+    # the mapping keeps the memory until a is freed
+    ccall(:unlink, Int32, (Ptr{Uint8},), r.path)
+    a
+end
+
 ## process group creation ##
 
 type LocalProcess
@@ -198,7 +342,7 @@ function add_workers(PGRP::ProcessGroup, w::Array{Any,1})
         push(PGRP.workers, w[i])
         w[i].id = PGRP.np+i
         send_msg_now(w[i], w[i].id, newlocs)
-        sockets[w[i].fd] = w[i].socket
+        sockets[w[i].fd] = _jl_open_ser_session(w[i].socket)
         add_fd_handler(w[i].fd, handler)
     end
     PGRP.locs = newlocs
@@ -215,7 +359,7 @@ function _jl_join_pgroup(myid, locs, sockets)
     for i = 2:(myid-1)
         w[i] = Worker(locs[i].host, locs[i].port)
         w[i].id = i
-        sockets[w[i].fd] = w[i].socket
+        sockets[w[i].fd] = _jl_open_ser_session(w[i].socket)
         add_fd_handler(w[i].fd, handler)
         send_msg_now(w[i], :identify_socket, myid)
     end
@@ -339,7 +483,7 @@ function lookup_ref(id)
         wi = WorkItem(bottom_func)
         # this WorkItem is just for storing the result value
         GRP.refs[id] = wi
-        add(wi.clientset, id[1])
+        add_client(wi, id[1])
     end
     wi
 end
@@ -372,45 +516,157 @@ function del_client(id, client)
     nothing
 end
 
-function del_clients(pairs::(Any,Any)...)
-    for p in pairs
-        del_client(p[1], p[2])
-    end
-end
-
 function send_del_client(rr::RemoteRef)
+    del(_jl_idempotent_calls, rr2id(rr))
     if rr.where == myid()
         del_client(rr2id(rr), myid())
-    else
+    elseif isa(worker_from_id(rr.where), Worker)
         w = worker_from_id(rr.where)
-        push(w.del_msgs, (rr2id(rr), myid()))
-        w.gcflag = true
+        push(w.del_msgs, rr.whence)
+        push(w.del_msgs, rr.id)
+        push(w.del_msgs, myid())
+        gc_msg_queued(w)
     end
 end
 
-function add_client(id, client)
-    wi = lookup_ref(id)
+function add_client(wi::WorkItem, client)
     add(wi.clientset, client)
+    if _jl_ref_lease < Inf && client != myid() && !has(_jl_leases, client)
+        _jl_leases[client] = time() + _jl_ref_lease
+    end
+end
+
+function add_client(id, client)
+    add_client(lookup_ref(id), client)
     nothing
 end
 
-function add_clients(pairs::(Any,Any)...)
-    for p in pairs
-        add_client(p[1], p[2])
+# apply a batch of reference changes from flush_gc_msgs
+function gc_msgs(adds::Array{Int,1}, dels::Array{Int,1})
+    for i = 1:3:length(adds)
+        add_client((adds[i], adds[i+1]), adds[i+2])
+    end
+    for i = 1:3:length(dels)
+        del_client((dels[i], dels[i+1]), dels[i+2])
     end
 end
 
 function send_add_client(rr::RemoteRef, i)
     if rr.where == myid()
         add_client(rr2id(rr), i)
-    elseif i != rr.where
+    elseif i != rr.where && isa(worker_from_id(rr.where), Worker)
         # don't need to send add_client if the message is already going
         # to the processor that owns the remote ref. it will add_client
         # itself inside deserialize().
         w = worker_from_id(rr.where)
-        push(w.add_msgs, (rr2id(rr), i))
-        w.gcflag = true
+        push(w.add_msgs, rr.whence)
+        push(w.add_msgs, rr.id)
+        push(w.add_msgs, i)
+        gc_msg_queued(w)
+    end
+end
+
+gc_flush_interval = 0.1
+const _jl_gc_batch = 1024
+_jl_gc_flush_due = Inf
+
+# called from finalizers, so it only arranges for the event loop to send
+function gc_msg_queued(w::Worker)
+    global _jl_gc_flush_due
+    w.gcflag = true
+    if length(w.add_msgs)+length(w.del_msgs) >= 3*_jl_gc_batch
+        _jl_gc_flush_due = 0.0
+    elseif _jl_gc_flush_due == Inf
+        _jl_gc_flush_due = time() + gc_flush_interval
+    end
+end
+
+# leases. with a lease time set, every process tells all others it is alive
+# every third of it, and a process that has not heard from a client for the
+# lease time drops it from the clients of all refs stored here, as if it had
+# deleted its refs. this frees what is held for clients that died or whose
+# reference changes were lost. clients that run tasks longer than the lease
+# time without returning to the event loop would lose their refs, so leases
+# are off by default.
+
+_jl_ref_lease = Inf
+const _jl_leases = Dict()   # client => when its lease runs out
+_jl_lease_due = Inf         # when to renew ours and expire others'
+
+function set_ref_lease(secs::Real)
+    for p in procs()
+        remote_call_wait(p, _jl_set_ref_lease, float64(secs))
+    end
+end
+
+function _jl_set_ref_lease(secs::Float64)
+    global _jl_ref_lease, _jl_lease_due
+    _jl_ref_lease = secs
+    del_all(_jl_leases)
+    _jl_lease_due = secs < Inf ? time() : Inf
+    if secs < Inf
+        for (id, wi) in (PGRP::ProcessGroup).refs
+            for c in wi.clientset
+                if c != myid()
+                    _jl_leases[c] = time() + secs
+                end
+            end
+        end
+    end
+    nothing
+end
+
+_jl_renew_lease(client) =
+    (_jl_leases[client] = time() + _jl_ref_lease; nothing)
+
+function _jl_service_leases()
+    global _jl_lease_due
+    t = time()
+    _jl_lease_due = t + _jl_ref_lease/3
+    for w in (PGRP::ProcessGroup).workers
+        if isa(w,Worker)
+            remote_do(w, _jl_renew_lease, myid())
+        end
+    end
+    expired = {}
+    for (c, until) in _jl_leases
+        if until < t
+            push(expired, c)
+        end
+    end
+    for c in expired
+        del(_jl_leases, c)
+        ids = {}
+        for (id, wi) in (PGRP::ProcessGroup).refs
+            if has(wi.clientset, c)
+                push(ids, id)
+            end
+        end
+        for id in ids
+            del_client(id, c)
+        end
+    end
+end
+
+# for each process: the refs stored here it is a client of, and the
+# reference changes waiting to go to it
+function remote_ref_stats()
+    np = nprocs()
+    held = zeros(Int, np)
+    for (id, wi) in (PGRP::ProcessGroup).refs
+        for c in wi.clientset
+            if c <= np
+                held[c] += 1
+            end
+        end
+    end
+    res = cell(np)
+    for p = 1:np
+        w = worker_from_id(p)
+        waiting = isa(w,Worker) ? div(length(w.add_msgs)+length(w.del_msgs), 3) : 0
+        res[p] = (p, held[p], waiting)
     end
+    res
 end
 
 function serialize(s, rr::RemoteRef)
@@ -505,7 +761,7 @@ function schedule_call(rid, thunk)
     global PGRP
     wi = WorkItem(thunk)
     (PGRP::ProcessGroup).refs[rid] = wi
-    add(wi.clientset, rid[1])
+    add_client(wi, rid[1])
     enq_work(wi)
     wi
 end
@@ -588,7 +844,8 @@ function remote_call_wait(w::Worker, f, args...)
     rr = RemoteRef(w)
     oid = rr2id(rr)
     send_msg(w, :call_wait, oid, f, args)
-    yieldto(Scheduler, WaitFor(:wait, rr))
+    force(yieldto(Scheduler, WaitFor(:wait, rr)))
+    rr
 end
 
 remote_call_wait(id::Integer, f, args...) =
@@ -609,7 +866,7 @@ end
 
 remote_do(id::Integer, f, args...) = remote_do(worker_from_id(id), f, args...)
 
-function sync_msg(verb::Symbol, r::RemoteRef)
+function sync_msg(verb::Symbol, r::RemoteRef, timeout::Real)
     pg = (PGRP::ProcessGroup)
     oid = rr2id(r)
     if r.where==myid() || isa(pg.workers[r.where], LocalProcess)
@@ -628,12 +885,15 @@ function sync_msg(verb::Symbol, r::RemoteRef)
         send_msg(pg.workers[r.where], verb, oid)
     end
     # yield to event loop, return here when answer arrives
-    v = yieldto(Scheduler, WaitFor(verb, r))
-    return is(verb,:fetch) ? force(v) : r
+    v = force(wait_for(verb, r, timeout))
+    return is(verb,:fetch) ? v : r
 end
 
-wait(r::RemoteRef) = sync_msg(:wait, r)
-fetch(r::RemoteRef) = sync_msg(:fetch, r)
+wait(r::RemoteRef) = sync_msg(:wait, r, -1)
+fetch(r::RemoteRef) = sync_msg(:fetch, r, -1)
+# give up with a TimeoutException after timeout seconds
+wait(r::RemoteRef, timeout::Real) = sync_msg(:wait, r, timeout)
+fetch(r::RemoteRef, timeout::Real) = sync_msg(:fetch, r, timeout)
 fetch(x::ANY) = x
 
 # writing to an uninitialized ref
@@ -724,17 +984,19 @@ function perform_work()
 end
 
 function perform_work(job::WorkItem)
-    global Waiting, Workqueue
+    global Waiting, Workqueue, _jl_running_task
     local result
     try
         if isa(job.task,Task)
             # continuing interrupted work item
             arg = job.argument
             job.argument = ()
+            _jl_running_task = job.task
             result = is(arg,()) ? yieldto(job.task) : yieldto(job.task, arg)
         else
             job.task = Task(job.thunk)
             job.task.tls = nothing
+            _jl_running_task = job.task
             result = yieldto(job.task)
         end
     catch e
@@ -744,6 +1006,7 @@ function perform_work(job::WorkItem)
         println()
         result = e
     end
+    _jl_running_task = ()
     if istaskdone(job.task)
         # job done
         job.done = true
@@ -852,12 +1115,17 @@ function accept_handler(accept_fd, sockets)
         print("accept error: ", strerror(), "\n")
     else
         first = isempty(sockets)
-        sock = fdio(connectfd, true)
-        sockets[connectfd] = sock
+        _jl_heartbeat(connectfd)
+        link = ccall(:jl_shm_accept, Ptr{Void}, (Int32,), connectfd)
+        sock = _jl_shm_stream(connectfd, link)
+        sockets[connectfd] = _jl_open_ser_session(sock)
         if first
             # first connection; get process group info from client
-            _myid = force(deserialize(sock))
-            locs = force(deserialize(sock))
+            if link != C_NULL
+                _jl_shm_pull(connectfd, sock, true)
+            end
+            _myid = force(_jl_msg_deserialize(sock))
+            locs = force(_jl_msg_deserialize(sock))
             PGRP = _jl_join_pgroup(_myid, locs, sockets)
             PGRP.workers[1] = Worker("", 0, connectfd, sock, 1)
         end
@@ -867,22 +1135,223 @@ end
 
 type DisconnectException <: Exception end
 
+# a connection closed. on a worker, losing the master means exiting; other
+# processes are removed from the group.
+function _jl_disconnect(fd, sock)
+    del_fd_handler(fd)
+    _jl_close_ser_session(sock)
+    shm = has(_jl_shm_links, fd)
+    _jl_shm_close(fd)
+    pid = _jl_worker_id_from_fd(fd)
+    if pid != -1
+        _jl_close_ser_session(((PGRP::ProcessGroup).workers[pid]::Worker).sendbuf)
+    end
+    # the I/O thread must be done with fd before its number can be reused
+    ccall(:jl_close_sendq, Void, (Int32,), fd)
+    if shm
+        ccall(:close, Int32, (Int32,), fd)
+    else
+        close(sock)
+    end
+    if pid == 1 || pid == -1
+        throw(DisconnectException())
+    end
+    _jl_worker_failed(pid)
+end
+
+function _jl_worker_id_from_fd(fd)
+    pg = PGRP::ProcessGroup
+    for i=1:length(pg.workers)
+        w = pg.workers[i]
+        if isa(w,Worker) && (w::Worker).fd == fd
+            return i
+        end
+    end
+    -1
+end
+
+## failures ##
+
+# connections check that their peer is alive with TCP keepalive probes,
+# sent by the kernel, so a worker busy in a long computation still
+# answers them. a peer is taken as failed after heartbeat_misses probes
+# go unanswered, the first sent after heartbeat_interval seconds of
+# silence. a process that exits is noticed at once, when its connections
+# close.
+#
+# a failed worker stays in the group as a DeadWorker, so ids keep their
+# meaning. messages to it throw ProcessFailedException, tasks waiting on
+# its refs get the exception when they resume, and refs it was a client
+# of are released. calls made with remote_call_idempotent are instead
+# run again on a surviving process.
+
+heartbeat_interval = 5
+heartbeat_misses = 3
+
+_jl_heartbeat(fd) =
+    ccall(:set_tcp_keepalive, Int32, (Int32, Int32, Int32, Int32),
+          fd, heartbeat_interval, heartbeat_interval, heartbeat_misses)
+
+function set_heartbeat(interval::Integer, misses::Integer)
+    for p in procs()
+        remote_call_wait(p, _jl_set_heartbeat, interval, misses)
+    end
+end
+
+function _jl_set_heartbeat(interval, misses)
+    global heartbeat_interval, heartbeat_misses
+    heartbeat_interval = interval
+    heartbeat_misses = misses
+    for w in (PGRP::ProcessGroup).workers
+        if isa(w,Worker)
+            _jl_heartbeat((w::Worker).fd)
+        end
+    end
+    nothing
+end
+
+type ProcessFailedException <: Exception
+    pid::Int
+end
+
+type DeadWorker
+    id::Int
+end
+
+send_msg(w::DeadWorker, kind, args...) = throw(ProcessFailedException(w.id))
+send_msg_now(w::DeadWorker, kind, args...) = throw(ProcessFailedException(w.id))
+remote_call(w::DeadWorker, f, args...) = throw(ProcessFailedException(w.id))
+remote_call_fetch(w::DeadWorker, f, args...) =
+    throw(ProcessFailedException(w.id))
+remote_call_wait(w::DeadWorker, f, args...) =
+    throw(ProcessFailedException(w.id))
+remote_do(w::DeadWorker, f, args...) = throw(ProcessFailedException(w.id))
+
+# ids of the processes that have not failed
+function procs()
+    pg = PGRP::ProcessGroup
+    ids = Array(Int, 0)
+    for i=1:pg.np
+        if !isa(pg.workers[i], DeadWorker)
+            push(ids, i)
+        end
+    end
+    ids
+end
+
+# calls that can be run again: oid => (WeakRef to the caller's ref, f, args)
+const _jl_idempotent_calls = Dict()
+
+# remote_call for a call that may be run more than once: if worker id fails
+# before the result is fetched, the call is made again on another process
+function remote_call_idempotent(id::Integer, f, args...)
+    rr = remote_call(id, f, args...)
+    if rr.where != myid()
+        _jl_idempotent_calls[rr2id(rr)] = (WeakRef(rr), f, args)
+    end
+    rr
+end
+
+function _jl_worker_failed(pid)
+    global Waiting
+    pg = PGRP::ProcessGroup
+    w = pg.workers[pid]
+    if !isa(w, Worker)
+        return
+    end
+    pg.workers[pid] = DeadWorker(pid)
+    print("worker ", pid, " failed\n")
+
+    # drop it as a client, and as a process to send results to
+    del(_jl_leases, pid)
+    ids = {}
+    for (id, wi) in pg.refs
+        if has(wi.clientset, pid)
+            push(ids, id)
+        end
+        newnot = ()
+        n = wi.notify
+        while !is(n, ())
+            if !is(n[1], w.socket)
+                newnot = (n[1], n[2], n[3], newnot)
+            end
+            n = n[4]
+        end
+        wi.notify = newnot
+    end
+    for id in ids
+        del_client(id, pid)
+    end
+
+    # run its idempotent calls elsewhere; tasks waiting on them ask the new
+    # owner instead
+    live = procs()
+    moved = Set()
+    calls = {}
+    for (oid, c) in _jl_idempotent_calls
+        push(calls, (oid, c))
+    end
+    for (oid, c) in calls
+        rr = c[1].value
+        if is(rr, nothing)
+            del(_jl_idempotent_calls, oid)
+        elseif rr.where == pid
+            q = live[oid[2] % length(live) + 1]
+            rr.where = q
+            if q == myid()
+                schedule_call(oid, local_remote_call_thunk(c[2], c[3]))
+            else
+                send_msg(pg.workers[q], :call, oid, c[2], c[3])
+            end
+            add(moved, oid)
+        end
+    end
+    failed = {}
+    for (oid, jobs) in Waiting
+        for j in jobs
+            rr = j[3]
+            if isa(rr,RemoteRef) && rr.where == pid
+                push(failed, (j[1], oid))
+            elseif isa(rr,RemoteRef) && has(moved, oid) && !is(j[1], :take)
+                if rr.where == myid()
+                    wi = lookup_ref(oid)
+                    wi.notify = ((), j[1], oid, wi.notify)
+                else
+                    send_msg(pg.workers[rr.where], j[1], oid)
+                end
+            end
+        end
+    end
+    e = ProcessFailedException(pid)
+    for (msg, oid) in failed
+        deliver_result((), msg, oid, ()->throw(e))
+    end
+end
+
 # activity on message socket
 function message_handler(fd, sockets)
     global PGRP
     refs = (PGRP::ProcessGroup).refs
     sock = sockets[fd]
     first = true
+    if has(_jl_shm_links, fd)
+        # a wakeup; what arrived is all there is to handle
+        if !_jl_shm_pull(fd, sock, false)
+            _jl_disconnect(fd, sock)
+            return
+        end
+        first = false
+    end
     while first || nb_available(sock)>0
         first = false
         try
-            msg = force(deserialize(sock))
+            msg = force(_jl_msg_deserialize(sock))
             #print("$(myid()) got $msg\n")
             # handle message
             if is(msg, :call) || is(msg, :call_fetch) || is(msg, :call_wait)
-                id = force(deserialize(sock))
-                f = deserialize(sock)
-                args = deserialize(sock)
+                id = force(_jl_msg_deserialize(sock))
+                f = _jl_msg_deserialize(sock)
+                args = _jl_msg_deserialize(sock)
                 #print("$(myid()) got call $id\n")
                 wi = schedule_call(id, f, args)
                 if is(msg, :call_fetch)
@@ -891,24 +1360,24 @@ function message_handler(fd, sockets)
                     wi.notify = (sock, :wait, id, wi.notify)
                 end
             elseif is(msg, :do)
-                f = deserialize(sock)
-                args = deserialize(sock)
+                f = _jl_msg_deserialize(sock)
+                args = _jl_msg_deserialize(sock)
                 #print("$(myid()) got $args\n")
                 let func=f, ar=args
                     enq_work(WorkItem(()->apply(force(func),force(ar))))
                 end
             elseif is(msg, :result)
                 # used to deliver result of wait or fetch
-                mkind = force(deserialize(sock))
-                oid = force(deserialize(sock))
-                val = deserialize(sock)
+                mkind = force(_jl_msg_deserialize(sock))
+                oid = force(_jl_msg_deserialize(sock))
+                val = _jl_msg_deserialize(sock)
                 deliver_result((), mkind, oid, val)
             elseif is(msg, :identify_socket)
-                otherid = force(deserialize(sock))
+                otherid = force(_jl_msg_deserialize(sock))
                 _jl_identify_socket(otherid, fd, sock)
             else
                 # the synchronization messages
-                oid = force(deserialize(sock))::(Int,Int)
+                oid = force(_jl_msg_deserialize(sock))::(Int,Int)
                 wi = lookup_ref(oid)
                 if wi.done
                     deliver_result(sock, msg, oid, work_result(wi))
@@ -922,9 +1391,8 @@ function message_handler(fd, sockets)
         catch e
             if isa(e,EOFError)
                 #print("eof. $(myid()) exiting\n")
-                del_fd_handler(fd)
-                # TODO: remove machine from group
-                throw(DisconnectException())
+                _jl_disconnect(fd, sock)
+                return
             else
                 print("deserialization error: ", e, "\n")
                 read(sock, Uint8, nb_available(sock))
@@ -1191,12 +1659,12 @@ type GlobalObject
     end
 
     function GlobalObject(initializer::Function)
-        GlobalObject(1:nprocs(), initializer)
+        GlobalObject(procs(), initializer)
     end
     GlobalObject() = GlobalObject(identity)
 end
 
-show(g::GlobalObject) = (r = g.refs[myid()];
+show(g::GlobalObject) = (r = is_go_member(g, myid());
                          print("GlobalObject($(r.whence),$(r.id))"))
 
 function is_go_member(g::GlobalObject, p::Integer)
@@ -1310,7 +1778,7 @@ let lastp = 1
                 end
             end
         end
-        if p == -1
+        while p == -1 || isa(worker_from_id(p), DeadWorker)
             p = lastp; lastp += 1
             if lastp > nprocs()
                 lastp = 1
@@ -1375,7 +1843,7 @@ macro spawnat(p, expr)
 end
 
 function at_each(f, args...)
-    for i=1:nprocs()
+    for i in procs()
         sync_add(remote_call(i, f, args...))
     end
 end
@@ -1389,9 +1857,10 @@ macro everywhere(ex)
 end
 
 function pmap_static(f, lsts...)
-    np = nprocs()
+    ps = procs()
+    np = length(ps)
     n = length(lsts[1])
-    { remote_call((i-1)%np+1, f, map(L->L[i], lsts)...) for i = 1:n }
+    { remote_call(ps[(i-1)%np+1], f, map(L->L[i], lsts)...) for i = 1:n }
 end
 
 pmap(f) = f()
@@ -1403,7 +1872,6 @@ pmap(f) = f()
 # L = {rsym(200),rsym(1000),rsym(200),rsym(1000),rsym(200),rsym(1000),rsym(200),rsym(1000)};
 # pmap(eig, L);
 function pmap(f, lsts...)
-    np = nprocs()
     n = length(lsts[1])
     results = cell(n)
     i = 1
@@ -1411,7 +1879,7 @@ function pmap(f, lsts...)
     # in this case it's just an index.
     next_idx() = (idx=i; i+=1; idx)
     @sync begin
-        for p=1:np
+        for p in procs()
             @spawnat myid() begin
                 while true
                     idx = next_idx()
@@ -1427,8 +1895,121 @@ function pmap(f, lsts...)
     results
 end
 
+# load-balanced pmap. items are sent in batches, several requests are kept
+# outstanding on each worker so it does not sit idle waiting for the next
+# one, and each worker starts with a contiguous share of the items, taking
+# batches from its front; a worker whose share is used up takes the back
+# half of the largest share left.
+
+type PmapSchedule
+    batch::Int   # items per request; 0 sizes batches from measured speed
+    depth::Int   # requests kept outstanding on each worker
+    steal::Bool  # whether idle workers take items from busy ones
+end
+PmapSchedule() = PmapSchedule(0, 2, true)
+
+# with batch 0, batches aim at this many seconds of work
+const _jl_pmap_batch_secs = 0.01
+
+# for each worker of the last pmap_balanced: (pid, items, requests,
+# seconds spent waiting for results)
+_jl_pmap_stats = {}
+pmap_stats() = _jl_pmap_stats
+
+function _jl_pmap_batch(f, args)
+    res = cell(length(args))
+    for i = 1:length(args)
+        res[i] = f(args[i]...)
+    end
+    res
+end
+
+function pmap_balanced(s::PmapSchedule, f, lsts...)
+    global _jl_pmap_stats
+    if s.batch < 0 || s.depth < 1
+        error("pmap_balanced: invalid schedule")
+    end
+    ps = procs()
+    np = length(ps)
+    n = length(lsts[1])
+    results = cell(n)
+    lo = [ div((p-1)*n, np)+1 for p=1:np ]
+    hi = [ div(p*n, np) for p=1:np ]
+    items = zeros(Int, np)
+    reqs = zeros(Int, np)
+    secs = zeros(np)
+    # estimated seconds per item on each worker
+    cost = zeros(np)
+
+    function next_batch(p)
+        if lo[p] > hi[p] && s.steal
+            v = 0
+            most = 0
+            for q = 1:np
+                if hi[q]-lo[q]+1 > most
+                    v = q
+                    most = hi[q]-lo[q]+1
+                end
+            end
+            if most > 0
+                k = div(most+1, 2)
+                lo[p] = hi[v]-k+1
+                hi[p] = hi[v]
+                hi[v] -= k
+            end
+        end
+        left = hi[p]-lo[p]+1
+        if left <= 0
+            return 1:0
+        end
+        b = s.batch
+        if b == 0
+            b = cost[p] > 0 ? iceil(_jl_pmap_batch_secs/cost[p]) : 1
+            # leave something for each outstanding request
+            b = max(1, min(b, div(left, s.depth)))
+        end
+        b = min(b, left)
+        r = lo[p]:(lo[p]+b-1)
+        lo[p] += b
+        r
+    end
+
+    @sync begin
+        for p=1:np
+            for d=1:s.depth
+                @spawnat myid() begin
+                    while true
+                        r = next_batch(p)
+                        if isempty(r)
+                            break
+                        end
+                        args = { map(L->L[i], lsts) for i=r }
+                        t = time()
+                        res = remote_call_fetch(ps[p], _jl_pmap_batch, f, args)
+                        t = time()-t
+                        if isa(res, Exception)
+                            throw(res)
+                        end
+                        results[r] = res
+                        items[p] += length(r)
+                        reqs[p] += 1
+                        secs[p] += t
+                        # the worker had about depth batches of this size to
+                        # do in the time the request took
+                        c = t/(length(r)*s.depth)
+                        cost[p] = cost[p] == 0 ? c : (3*cost[p]+c)/4
+                    end
+                end
+            end
+        end
+    end
+    _jl_pmap_stats = { (ps[p], items[p], reqs[p], secs[p]) for p=1:np }
+    results
+end
+pmap_balanced(f, lsts...) = pmap_balanced(PmapSchedule(), f, lsts...)
+
 function preduce(reducer, f, r::Range1{Int})
-    np = nprocs()
+    np = length(procs())
     N = length(r)
     each = div(N,np)
     rest = rem(N,np)
@@ -1448,7 +2029,7 @@ function preduce(reducer, f, r::Range1{Int})
 end
 
 function pfor(f, r::Range1{Int})
-    np = nprocs()
+    np = length(procs())
     N = length(r)
     each = div(N,np)
     rest = rem(N,np)
@@ -1551,13 +2132,203 @@ end
 
 yield() = yieldto(Scheduler)
 
+## preemption ##
+
+# the task the scheduler most recently switched to for a work item
+_jl_running_task = ()
+
+# called from safepoints in compiled code when the preemption timer fires.
+# only a task resumed by perform_work can be put back on the queue; other
+# tasks (e.g. generators being consumed) are left alone.
+function _jl_preempt()
+    if is(current_task(), _jl_running_task)
+        yield()
+    end
+end
+
+# ask running work items to yield every `seconds` (0 disables). only has
+# an effect on code compiled after julia was started with --preempt.
+preempt_interval(seconds::Real) =
+    ccall(:jl_set_preempt_interval, Void, (Float64,), float64(seconds))
+
+macro nopreempt(ex)
+    quote
+        ccall(:jl_preempt_disable, Void, ())
+        try
+            v = $esc(ex)
+            ccall(:jl_preempt_enable, Void, ())
+            v
+        catch e
+            ccall(:jl_preempt_enable, Void, ())
+            throw(e)
+        end
+    end
+end
+
 const _jl_fd_handlers = Dict()
 
-add_fd_handler(fd::Int32, H) = (_jl_fd_handlers[fd]=H)
-del_fd_handler(fd::Int32) = del(_jl_fd_handlers, fd)
+function add_fd_handler(fd::Int32, H)
+    _jl_fd_handlers[fd] = H
+    ccall(:jl_poll_fd, Void, (Int32,), fd)
+end
+
+function del_fd_handler(fd::Int32)
+    ccall(:jl_unpoll_fd, Void, (Int32,), fd)
+    del(_jl_fd_handlers, fd)
+end
+
+## timers ##
+
+# Timer(cb) - a timer that calls cb(timer) from the event loop each time it
+#     fires. start_timer(t, delay, repeat) fires it after delay seconds,
+#     then every repeat seconds if repeat > 0; stop_timer(t) cancels it.
+#     callbacks must not block; they can start work with enq_work.
+
+_jl_timer_id = 0
+const _jl_timers = Dict()   # id => pending Timer
+
+type Timer
+    handle::Ptr{Void}
+    id::Int
+    cb::Function
+
+    function Timer(cb::Function)
+        global _jl_timer_id
+        _jl_timer_id += 1
+        h = ccall(:jl_timer_new, Ptr{Void}, (Int64,), _jl_timer_id)
+        t = new(h, _jl_timer_id, cb)
+        finalizer(t, t->ccall(:jl_timer_free, Void, (Ptr{Void},), t.handle))
+        t
+    end
+end
+
+rr2id(t::Timer) = (-2, t.id)
+
+function start_timer(t::Timer, delay::Real, repeat::Real)
+    ccall(:jl_timer_start, Void, (Ptr{Void}, Float64, Float64),
+          t.handle, delay, repeat)
+    _jl_timers[t.id] = t
+    t
+end
+start_timer(t::Timer, delay::Real) = start_timer(t, delay, 0)
+
+function stop_timer(t::Timer)
+    ccall(:jl_timer_stop, Void, (Ptr{Void},), t.handle)
+    del(_jl_timers, t.id)
+    t
+end
+
+# suspend the current task for sec seconds, letting other tasks run. if
+# the current task is not one the scheduler can resume, block the process.
+function sleep(sec::Real)
+    if !is(current_task(), _jl_running_task)
+        # TODO: check for usleep errors?
+        ccall(:usleep, Void, (Uint32,), uint32(iround(sec*1e6)))
+        return
+    end
+    t = start_timer(Timer(t->deliver_result((), :sleep, rr2id(t), ()->nothing)),
+                    sec)
+    yieldto(Scheduler, WaitFor(:sleep, t))
+    nothing
+end
+
+type TimeoutException <: Exception end
+
+const _jl_wait_timed_out = TimeoutException()
+
+# like yieldto(Scheduler, WaitFor(verb, obj)), but throw a TimeoutException
+# if the wait is not over in timeout seconds. waits forever if timeout < 0.
+function wait_for(verb::Symbol, obj, timeout::Real)
+    if timeout < 0
+        return yieldto(Scheduler, WaitFor(verb, obj))
+    end
+    task = current_task()
+    oid = rr2id(obj)
+    t = start_timer(Timer(t->cancel_wait(task, verb, oid)), timeout)
+    v = yieldto(Scheduler, WaitFor(verb, obj))
+    stop_timer(t)
+    if is(v, _jl_wait_timed_out)
+        throw(TimeoutException())
+    end
+    v
+end
+
+# restart task, which is waiting for verb on oid, with _jl_wait_timed_out
+function cancel_wait(task::Task, verb, oid)
+    global Waiting
+    jobs = get(Waiting, oid, _jl_empty_cell_)
+    for i = 1:length(jobs)
+        j = jobs[i]
+        if is(j[2].task, task) && is(j[1], verb)
+            job = j[2]
+            job.argument = _jl_wait_timed_out
+            enq_work(job)
+            del(jobs, i)
+            if isempty(jobs)
+                del(Waiting, oid)
+            end
+            return
+        end
+    end
+end
+
+# run one pass of the libuv event loop, waiting at most timeout seconds,
+# call the callbacks of timers that fired and the handlers of the
+# descriptors that became readable
+function process_events(timeout::Float64)
+    nready = ccall(:jl_process_events, Int32, (Float64,), timeout)
+    for i = int32(0):ccall(:jl_n_fired_timers, Int32, ())-int32(1)
+        id = int(ccall(:jl_fired_timer, Int64, (Int32,), i))
+        t = get(_jl_timers, id, nothing)
+        if !is(t, nothing)
+            if ccall(:jl_timer_pending, Int32, (Ptr{Void},), t.handle) == 0
+                del(_jl_timers, id)
+            end
+            t.cb(t)
+        end
+    end
+    # restart tasks parked on descriptors that became ready
+    for i = int32(0):ccall(:jl_n_woken_fds, Int32, ())-int32(1)
+        fd = int(ccall(:jl_woken_fd, Int32, (Int32,), i))
+        ev = ccall(:jl_woken_events, Int32, (Int32,), i)
+        if (ev & 1) != 0
+            deliver_result((), :readable, (-1, fd), ()->nothing)
+        end
+        if (ev & 2) != 0
+            deliver_result((), :writable, (-1, fd), ()->nothing)
+        end
+    end
+    for i = int32(0):nready-int32(1)
+        fd = ccall(:jl_ready_fd, Int32, (Int32,), i)
+        if fd >= 0
+            h = get(_jl_fd_handlers, fd, nothing)
+            if !is(h, nothing)
+                h(fd)
+            end
+        end
+    end
+    nready
+end
+
+type FDWait
+    fd::Int32
+end
+rr2id(w::FDWait) = (-1, int(w.fd))
+
+# called through ios_wait_hook when a read or write on a non-blocking
+# stream would block. parks the current task until the event loop sees the
+# descriptor ready, letting other tasks run. returns false if the current
+# task cannot be parked, in which case the caller blocks.
+function _jl_wait_fd(fd::Int32, writable::Bool)
+    if !is(current_task(), _jl_running_task)
+        return false
+    end
+    ccall(:jl_wait_fd_once, Void, (Int32, Int32), fd, writable)
+    yieldto(Scheduler, WaitFor(writable ? :writable : :readable, FDWait(fd)))
+    true
+end
 
 function event_loop(isclient)
-    fdset = FDSet()
     iserr, lasterr = false, ()
 
     while true
@@ -1567,32 +2338,23 @@ function event_loop(isclient)
                 iserr, lasterr = false, ()
             end
             while true
-                del_all(fdset)
-                for (fd,_) = _jl_fd_handlers
-                    add(fdset, fd)
-                end
-
                 bored = isempty(Workqueue)
-                if bored
+                if bored ||
+                    (_jl_gc_flush_due < Inf && time() >= _jl_gc_flush_due)
                     flush_gc_msgs()
                 end
-                nselect = select_read(fdset, bored ? 10.0 : 0.0)
-                if nselect == 0
+                if _jl_lease_due < Inf && time() >= _jl_lease_due
+                    _jl_service_leases()
+                end
+                nready = process_events(bored ? 10.0 : 0.0)
+                if nready == 0
                     if !isempty(Workqueue)
                         perform_work()
                     end
-                else
-                    for fd=int32(0):int32(fdset.nfds-1)
-                        if has(fdset,fd)
-                            h = _jl_fd_handlers[fd]
-                            h(fd)
-                        end
-                    end
                 end
             end
         catch e
             if isa(e,DisconnectException)
-                # TODO: wake up tasks waiting for failed process
                 if !isclient
                     return
                 end
@@ -483,7 +483,9 @@ run(cmds::Cmds) = success(cmds) ? nothing : pipeline_error(cmds)
 function _readall(ports::Ports, cmds::Cmds)
     r = read_from(ports)
     spawn(cmds)
-    o = readall(fdio(r.fd, false))
+    s = fdio(r.fd, false)
+    set_nonblocking(s, true)
+    o = readall(s)
     if !wait(cmds)
         close(r)
         pipeline_error(cmds)
@@ -499,6 +501,7 @@ function _each_line(ports::Ports, cmds::Cmds)
     r = read_from(ports)
     spawn(cmds)
     fh = fdio(r.fd, true)
+    set_nonblocking(fh, true)
     EachLine(fh)
 end
 
@@ -5,20 +5,28 @@ abstract LongSymbol
 abstract LongTuple
 abstract LongExpr
 
-const _jl_ser_version = 1 # do not make changes without bumping the version #!
+# dummy types for the per-connection tables and packed encodings
+abstract NewSymbol    # symbol sent in full, gets the next symbol id
+abstract SymbolRef    # symbol sent as its id
+abstract NewType      # type sent in full, gets the next type id
+abstract TypeRef      # type sent as its id
+abstract NewTypeObj   # like NewType, followed by an instance of the type
+abstract TypeObjRef   # like TypeRef, followed by an instance of the type
+abstract PackedArray  # array of a bits type: type, dims, raw data
+abstract PackedTuple  # tuple of one bits type: length, type, raw data
+
+const _jl_ser_version = 2 # do not make changes without bumping the version #!
 const _jl_ser_tag = ObjectIdDict()
 const _jl_deser_tag = ObjectIdDict()
-let i = 2
-    global _jl_ser_tag, _jl_deser_tag
-    for t = {Symbol, Int8, Uint8, Int16, Uint16, Int32, Uint32,
+const _jl_ser_tag_list = {Symbol, Int8, Uint8, Int16, Uint16, Int32, Uint32,
              Int64, Uint64, Int128, Uint128, Float32, Float64, Char, Ptr,
              AbstractKind, UnionKind, BitsKind, CompositeKind, Function,
              Tuple, Array, Expr, LongSymbol, LongTuple, LongExpr,
              LineNumberNode, SymbolNode, LabelNode, GotoNode,
              QuoteNode, TopNode, TypeVar, Box, LambdaStaticData,
-             Module, :reserved2, :reserved3, :reserved4,
-             :reserved5, :reserved6, :reserved7, :reserved8,
-             :reserved9, :reserved10, :reserved11, :reserved12,
+             Module, NewSymbol, SymbolRef, NewType,
+             TypeRef, NewTypeObj, TypeObjRef, PackedArray,
+             PackedTuple, :reserved10, :reserved11, :reserved12,
              
              (), Bool, Any, :Any, None, Top, Undef, Type,
              :Array, :TypeVar, :Box,
@@ -35,6 +43,9 @@ let i = 2
              false, true, nothing, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11,
              12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27,
              28, 29, 30, 31, 32}
+let i = 2
+    global _jl_ser_tag, _jl_deser_tag
+    for t = _jl_ser_tag_list
         _jl_ser_tag[t] = int32(i)
         _jl_deser_tag[int32(i)] = t
         i += 1
@@ -54,11 +65,84 @@ function write_as_tag(s, x)
     write(s, uint8(t))
 end
 
+function write_varint(s, n::Integer)
+    while n >= 0x80
+        write(s, uint8((n & 0x7f) | 0x80))
+        n = n >>> 7
+    end
+    write(s, uint8(n))
+end
+
+function read_varint(s)
+    n = 0
+    shift = 0
+    while true
+        b = read(s, Uint8)
+        n |= int(b & 0x7f) << shift
+        if b < 0x80
+            return n
+        end
+        shift += 7
+    end
+end
+
+## per-connection type and symbol tables ##
+
+# a stream with a session sends each non-tagged symbol and type in full
+# only the first time; after that it is referred to by a small integer.
+# ids are assigned in the order definitions are written, so the reader
+# rebuilds the same tables as it reads. sessions exist for the buffers and
+# sockets of Worker connections, other streams use the plain encoding.
+
+type SerializationSession
+    types::ObjectIdDict     # writing: type => id
+    syms::ObjectIdDict      # writing: symbol => id
+    ntypes::Int
+    nsyms::Int
+    rtypes::Array{Any,1}    # reading: id => type
+    rsyms::Array{Any,1}     # reading: id => symbol
+
+    SerializationSession() = new(ObjectIdDict(), ObjectIdDict(), 0, 0, {}, {})
+end
+
+const _jl_ser_sessions = ObjectIdDict()
+
+_jl_open_ser_session(s) = (_jl_ser_sessions[s] = SerializationSession(); s)
+_jl_close_ser_session(s) = (del(_jl_ser_sessions, s); s)
+_jl_ser_session(s) = get(_jl_ser_sessions, s, nothing)
+
 serialize(s, x::Bool) = write_as_tag(s, x)
 
 serialize(s, ::()) = write_as_tag(s, ())
 
+# short tuples of small integers are smaller with per-element tags
+function serialize_packed_tuple(s, t::Tuple)
+    l = length(t)
+    if l < 4 || l > 255
+        return false
+    end
+    T = typeof(t[1])
+    if !isa(T,BitsKind)
+        return false
+    end
+    for i = 2:l
+        if !is(typeof(t[i]),T)
+            return false
+        end
+    end
+    writetag(s, PackedTuple)
+    write(s, uint8(l))
+    serialize(s, T)
+    for i = 1:l
+        write(s, t[i])
+    end
+    true
+end
+
 function serialize(s, t::Tuple)
+    if serialize_packed_tuple(s, t)
+        return
+    end
     l = length(t)
     if l <= 255
         writetag(s, Tuple)
@@ -76,6 +160,22 @@ function serialize(s, x::Symbol)
     if has(_jl_ser_tag, x)
         return write_as_tag(s, x)
     end
+    ss = _jl_ser_session(s)
+    if !is(ss,nothing)
+        id = get(ss.syms, x, 0)
+        if id > 0
+            writetag(s, SymbolRef)
+            write_varint(s, id)
+            return
+        end
+        ss.nsyms += 1
+        ss.syms[x] = ss.nsyms
+        name = string(x)
+        writetag(s, NewSymbol)
+        write_varint(s, length(name.data))
+        write(s, name)
+        return
+    end
     name = string(x)
     ln = length(name)
     if ln <= 255
@@ -88,18 +188,28 @@ function serialize(s, x::Symbol)
     write(s, name)
 end
 
+function serialize_packed_array(s, elty, a)
+    writetag(s, PackedArray)
+    serialize(s, elty)
+    dims = size(a)
+    write(s, uint8(length(dims)))
+    for d in dims
+        write_varint(s, d)
+    end
+    write(s, a)
+end
+
 function serialize(s, a::Array)
-    writetag(s, Array)
     elty = eltype(a)
+    if isa(elty,BitsKind)
+        return serialize_packed_array(s, elty, a)
+    end
+    writetag(s, Array)
     serialize(s, elty)
     serialize(s, size(a))
-    if isa(elty,BitsKind)
-        write(s, a)
-    else
-        # TODO: handle uninitialized elements
-        for i = 1:numel(a)
-            serialize(s, a[i])
-        end
+    # TODO: handle uninitialized elements
+    for i = 1:numel(a)
+        serialize(s, a[i])
     end
 end
 
@@ -107,10 +217,7 @@ function serialize{T,N}(s, a::SubArray{T,N,Array})
     if !isa(T,BitsKind) || stride(a,1)!=1
         return serialize(s, copy(a))
     end
-    writetag(s, Array)
-    serialize(s, T)
-    serialize(s, size(a))
-    write(s, a)
+    serialize_packed_array(s, T, a)
 end
 
 function serialize(s, e::Expr)
@@ -193,10 +300,30 @@ function serialize_type_data(s, t)
     end
 end
 
+# write t through the session's type table, using tag def if t is new
+# and ref otherwise. returns false if s has no session.
+function serialize_session_type(s, t, def, ref)
+    ss = _jl_ser_session(s)
+    if is(ss,nothing)
+        return false
+    end
+    id = get(ss.types, t, 0)
+    if id > 0
+        writetag(s, ref)
+        write_varint(s, id)
+    else
+        writetag(s, def)
+        serialize_type_data(s, t)
+        ss.ntypes += 1
+        ss.types[t] = ss.ntypes
+    end
+    true
+end
+
 function serialize(s, t::Union(AbstractKind,BitsKind,CompositeKind))
     if has(_jl_ser_tag,t)
         write_as_tag(s, t)
-    else
+    elseif !serialize_session_type(s, t, NewType, TypeRef)
         writetag(s, AbstractKind)
         serialize_type_data(s, t)
     end
@@ -205,12 +332,22 @@ end
 function serialize_type(s, t::Union(CompositeKind,BitsKind))
     if has(_jl_ser_tag,t)
         writetag(s, t)
-    else
+    elseif !serialize_session_type(s, t, NewTypeObj, TypeObjRef)
         writetag(s, typeof(t))
         serialize_type_data(s, t)
     end
 end
 
+# structs whose fields are all bits types are written as raw field data
+function _jl_bits_fields(t::CompositeKind)
+    for ft in t.types
+        if !isa(ft,BitsKind)
+            return false
+        end
+    end
+    length(t.types) > 0
+end
+
 function serialize(s, x)
     if has(_jl_ser_tag,x)
         return write_as_tag(s, x)
@@ -221,9 +358,14 @@ function serialize(s, x)
         write(s, x)
     elseif isa(t,CompositeKind)
         serialize_type(s, t)
-        serialize(s, length(t.names))
-        for n = t.names
-            serialize(s, getfield(x, n))
+        if _jl_bits_fields(t)
+            for n = t.names
+                write(s, getfield(x, n))
+            end
+        else
+            for n = t.names
+                serialize(s, getfield(x, n))
+            end
         end
     else
         error(x," is not serializable")
@@ -265,6 +407,36 @@ deserialize_tuple(s, len) = (a = ntuple(len, i->deserialize(s));
 deserialize(s, ::Type{Symbol}) = symbol(read(s, Uint8, int32(read(s, Uint8))))
 deserialize(s, ::Type{LongSymbol}) = symbol(read(s, Uint8, read(s, Int32)))
 
+function deserialize(s, ::Type{NewSymbol})
+    ss = _jl_ser_session(s)::SerializationSession
+    sym = symbol(read(s, Uint8, read_varint(s)))
+    push(ss.rsyms, sym)
+    sym
+end
+
+deserialize(s, ::Type{SymbolRef}) =
+    (_jl_ser_session(s)::SerializationSession).rsyms[read_varint(s)]
+
+function deserialize_session_type(s)
+    ss = _jl_ser_session(s)::SerializationSession
+    t = deserialize(s, AbstractKind)
+    push(ss.rtypes, t)
+    t
+end
+
+session_type(s) = (_jl_ser_session(s)::SerializationSession).rtypes[read_varint(s)]
+
+deserialize(s, ::Type{NewType})    = deserialize_session_type(s)
+deserialize(s, ::Type{TypeRef})    = session_type(s)
+deserialize(s, ::Type{NewTypeObj}) = deserialize(s, deserialize_session_type(s))
+deserialize(s, ::Type{TypeObjRef}) = deserialize(s, session_type(s))
+
+function deserialize(s, ::Type{PackedTuple})
+    l = int32(read(s, Uint8))
+    T = force(deserialize(s))
+    ntuple(l, i->read(s, T))
+end
+
 function deserialize(s, ::Type{Module})
     path = force(deserialize(s))
     m = Root
@@ -329,6 +501,12 @@ function deserialize(s, ::Type{Array})
     end
 end
 
+function deserialize(s, ::Type{PackedArray})
+    elty = force(deserialize(s))
+    dims = ntuple(int32(read(s, Uint8)), i->read_varint(s))
+    read(s, elty, dims)
+end
+
 deserialize(s, ::Type{Expr})     = deserialize_expr(s, int32(read(s, Uint8)))
 deserialize(s, ::Type{LongExpr}) = deserialize_expr(s, read(s, Int32))
 
@@ -344,7 +522,6 @@ function deserialize_expr(s, len)
 end
 
 function deserialize(s, ::Type{TypeVar})
-    nf_expected = deserialize(s)
     name = force(deserialize(s))
     lb = force(deserialize(s))
     ub = force(deserialize(s))
@@ -352,7 +529,6 @@ function deserialize(s, ::Type{TypeVar})
 end
 
 function deserialize(s, ::Type{UnionKind})
-    nf_expected = deserialize(s)
     types = deserialize(s)
     ()->Union(force(types)...)
 end
@@ -378,10 +554,12 @@ deserialize(s, t::BitsKind) = read(s, t)
 
 # default structure deserializer
 function deserialize(s, t::CompositeKind)
-    nf_expected = deserialize(s)
     nf = length(t.names)
     if nf == 0
         return ccall(:jl_new_struct, Any, (Any,Any...), t)
+    elseif _jl_bits_fields(t)
+        f = ntuple(nf, i->read(s, t.types[i]))
+        return ccall(:jl_new_structt, Any, (Any,Any), t, f)
     elseif nf == 1
         f1 = deserialize(s)
         ()->ccall(:jl_new_struct, Any, (Any,Any...), t, force(f1))
@@ -407,3 +585,55 @@ function deserialize(s, t::CompositeKind)
         ()->ccall(:jl_new_structt, Any, (Any,Any), t, map(force, f))
     end
 end
+
+## native message serializer ##
+
+# jl_msg_serialize and jl_msg_deserialize in dump.c implement the format
+# above for worker messages. they call back into julia for values whose
+# serialize or deserialize method is not the default one.
+
+_jl_read_packed_tuple(s, T, l) = ntuple(l, i->read(s, T))
+
+# thunks for containers read by the native deserializer that hold thunks
+_jl_deferred(t::Tuple) = ()->map(force, t)
+
+function _jl_deferred(e::Expr)
+    function ()
+        e.typ = force(e.typ)
+        for i = 1:length(e.args)
+            e.args[i] = force(e.args[i])
+        end
+        e
+    end
+end
+
+function _jl_deferred(elty, temp::Array)
+    function ()
+        A = Array(elty, size(temp))
+        for i = 1:numel(A)
+            A[i] = force(temp[i])
+        end
+        return A
+    end
+end
+
+_jl_deferred(t::CompositeKind, f::Tuple) =
+    ()->ccall(:jl_new_structt, Any, (Any,Any), t, map(force, f))
+
+const _jl_msg_dummy_tags = (LongSymbol, LongTuple, LongExpr, NewSymbol,
+                            SymbolRef, NewType, TypeRef, NewTypeObj,
+                            TypeObjRef, PackedArray, PackedTuple)
+const _jl_msg_hooks = (serialize, deserialize, read, _jl_read_packed_tuple,
+                       _jl_deferred, EOFError())
+
+_jl_init_msg_serializer() =
+    ccall(:jl_init_msg_serializer, Void, (Any, Any, Any),
+          _jl_ser_tag_list, _jl_msg_dummy_tags, _jl_msg_hooks)
+
+_jl_msg_serialize(s::IOStream, x) =
+    ccall(:jl_msg_serialize, Void, (Any, Ptr{Void}, Any, Any),
+          s, s.ios, _jl_ser_session(s), x)
+
+_jl_msg_deserialize(s::IOStream) =
+    ccall(:jl_msg_deserialize, Any, (Any, Ptr{Void}, Any),
+          s, s.ios, _jl_ser_session(s))
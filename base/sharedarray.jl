@@ -0,0 +1,122 @@
+## sharedarray.jl - arrays in memory shared by the processes on one host
+##
+## SharedArray(T, dims[, pids[, init]]) -
+##     an array of the bits type T held in a file in shared memory, which
+##     every process it is sent to maps. sending it passes only the name of
+##     the file, and all processes see each other's writes. pids are the
+##     processes expected to work on it (by default all), which must be on
+##     this host. init(S), if given, is called on each of them, typically
+##     to fill in localindexes(S).
+##
+## sdata(S) - the local mapping of S, an Array
+##
+## localindexes(S) - the range of linear indexes of S assigned to this
+##     process, one of length(pids) nearly equal parts
+##
+## the process that created S keeps the file; it is removed when that
+## SharedArray is freed, while processes that mapped it keep their memory.
+## for example, with S = SharedArray(Float64, (n,)),
+##     @parallel for i=1:n
+##         S[i] = f(i)
+##     end
+## fills S in place, each worker writing its own part of 1:n.
+
+type SharedArray{T,N} <: AbstractArray{T,N}
+    dims::NTuple{N,Int}
+    pids::Array{Int,1}
+    path::ByteString
+    s::Array{T,N}
+
+    function SharedArray(dims::NTuple{N,Int}, pids::Array{Int,1})
+        if !isa(T,BitsKind)
+            error("SharedArray: element type must be a bits type")
+        end
+        if prod(dims) == 0
+            return new(dims, pids, "", Array(T, dims))
+        end
+        path = _jl_shm_path()
+        f = open(path, "w+")
+        s = mmap_array(T, dims, f, convert(FileOffset,0))
+        close(f)
+        _jl_shared_maps[path] = WeakRef(s)
+        S = new(dims, pids, path, s)
+        finalizer(S, _jl_shared_unlink)
+        S
+    end
+end
+
+SharedArray(T::Type, dims::Dims, pids::Array{Int,1}) =
+    SharedArray{T,length(dims)}(dims, pids)
+SharedArray(T::Type, dims::Dims) = SharedArray(T, dims, procs())
+SharedArray(T::Type, dims::Integer...) = SharedArray(T, dims)
+
+function SharedArray(T::Type, dims::Dims, pids::Array{Int,1}, init::Function)
+    S = SharedArray(T, dims, pids)
+    @sync begin
+        for p in pids
+            @spawnat p init(S)
+        end
+    end
+    S
+end
+
+# path => WeakRef to this process's mapping of it
+const _jl_shared_maps = Dict()
+
+function _jl_shared_unlink(S::SharedArray)
+    del(_jl_shared_maps, S.path)
+    ccall(:unlink, Int32, (Ptr{Uint8},), S.path)
+end
+
+function _jl_shared_map(T, dims, path)
+    w = get(_jl_shared_maps, path, nothing)
+    if !is(w, nothing) && !is(w.value, nothing)
+        return w.value
+    end
+    f = open(path, "r+")
+    a = mmap_array(T, dims, f, convert(FileOffset,0))
+    close(f)
+    _jl_shared_maps[path] = WeakRef(a)
+    a
+end
+
+# send everything but the mapping
+function serialize{T,N}(s, S::SharedArray{T,N})
+    invoke(serialize, (Any, Any), s,
+           ccall(:jl_new_structt, Any, (Any, Any), SharedArray{T,N},
+                 (S.dims, S.pids, S.path, Array(T, ntuple(N, i->0)))))
+end
+
+function deserialize{T,N}(s, t::Type{SharedArray{T,N}})
+    S = force(invoke(deserialize, (Any, CompositeKind), s, t))
+    if !isempty(S.path)
+        S.s = _jl_shared_map(T, S.dims, S.path)
+    end
+    S
+end
+
+size(S::SharedArray) = S.dims
+numel(S::SharedArray) = numel(S.s)
+sdata(S::SharedArray) = S.s
+procs(S::SharedArray) = S.pids
+
+function localindexes(S::SharedArray)
+    i = findfirst(S.pids, myid())
+    if i == 0
+        return 1:0
+    end
+    n = numel(S)
+    np = length(S.pids)
+    (div((i-1)*n, np)+1):div(i*n, np)
+end
+
+ref(S::SharedArray, i::Real) = S.s[i]
+ref(S::SharedArray, I...) = S.s[I...]
+assign(S::SharedArray, x, i::Real) = (S.s[i] = x; S)
+assign(S::SharedArray, x, I...) = (S.s[I...] = x; S)
+
+fill!(S::SharedArray, x) = (fill!(S.s, x); S)
+similar(S::SharedArray, T, dims::Dims) = Array(T, dims)
+convert{T}(::Type{Array}, S::SharedArray{T}) = copy(S.s)
+
+show(io, S::SharedArray) = show(io, S.s)
@@ -4,21 +4,24 @@ export
     # Module
     Base, PCRE,
     # Types
-    AbstractMatrix,AbstractVector,Array,Associative,CharString,Chars,Cmd,Cmds,
-    Colon,Complex,Complex128,Complex64,ComplexPair,DArray,Dict,Dims,EachLine,
+    AbstractMatrix,AbstractVector,Array,Associative,BlockCyclicMatrix,Channel,
+    CharString,Chars,Cmd,
+    Cmds,Colon,Complex,Complex128,Complex64,ComplexPair,DArray,Dict,Dims,EachLine,
     EachSearch,Enumerate,EnvHash,Executable,FDSet,FileDes,FileOffset,Filter,
     GORef,GenericString,GlobalObject,IO,IOStream,IOTally,ImaginaryUnit,Indices,
     IntSet,LocalProcess,Location,Matrix,ObjectIdDict,Pipe,PipeEnd,PipeIn,
-    PipeOut,Port,Ports,ProcessExited,ProcessGroup,ProcessNotRun,ProcessRunning,
-    ProcessSignaled,ProcessStatus,ProcessStopped,Range,Range1,RangeIndex,Ranges,
-    Rational,Regex,RegexMatch,RegexMatchIterator,Region,RemoteRef,RepString,
-    RevString,Reverse,RopeString,Set,StridedArray,StridedMatrix,StridedVecOrMat,
-    StridedVector,SubArray,SubDArray,SubOrDArray,SubString,TransformedString,
-    VecOrMat,Vector,VersionNumber,WeakKeyDict,Zip,
+    PipeOut,PmapSchedule,Port,Ports,ProcessExited,ProcessGroup,ProcessNotRun,
+    ProcessRunning,ProcessSignaled,ProcessStatus,ProcessStopped,Range,Range1,
+    RangeIndex,Ranges,Rational,Regex,RegexMatch,RegexMatchIterator,Region,
+    RemoteRef,RepString,RevString,Reverse,RopeString,Set,SharedArray,
+    StridedArray,StridedMatrix,StridedVecOrMat,StridedVector,SubArray,
+    SubDArray,SubOrDArray,SubString,ThreadWork,Timer,
+    TransformedString,VecOrMat,Vector,VersionNumber,WeakKeyDict,Zip,
     Stat, Factorization, Cholesky, LU, QR, QRP,
     # Exceptions
     ArgumentError,BackTrace,DisconnectException,ErrorException,KeyError,
-    LoadError,MethodError,ParseError,SystemError,TypeError,
+    LoadError,MethodError,ParseError,ProcessFailedException,SystemError,
+    TimeoutException,TypeError,
     # Global constants and variables
     ARGS,C_NULL,CPU_CORES,CURRENT_OS,ENDIAN_BOM,ENV,Inf,Inf32,LOAD_PATH,
     MS_ASYNC,MS_INVALIDATE,MS_SYNC,NaN,NaN32,OUTPUT_STREAM,RANDOM_SEED,STDERR,
@@ -52,8 +55,9 @@ export
     addprocs_local,addprocs_sge,addprocs_ssh,all,allp,
     amap,and!,angle,ans,any,anyp,append,append!,apropos,areduce,
     ascii,asec,asecd,asech,asin,asind,asinh,assert,assign,at_each,atan,atan2,
-    atand,atanh,basename,begins_with,betarnd,bfft,bfftn,bin,binomial,bitmix,bits,bool,
-    brfft,brfftn,broadcast,bswap,bsxfun,byte_string_classify,cartesian_map,cat,
+    atand,atanh,basename,bcdistribute,bcmatrix,bcrand,bczeros,begins_with,
+    betarnd,bfft,bfftn,bin,binomial,bitmix,bits,bool,
+    brfft,brfftn,broadcast,bswap,bsxfun,byte_string_classify,capacity,cartesian_map,cat,
     cbrt,cd,ceil,cell,cell_1d,cell_2d,changedist,char,chars,charwidth,
     check_ascii,check_utf8,chi2rnd,chol,chol!,chomp,choose,chop,chr2ind,
     circshift,cis,clamp,close,cmd_stdin_stream,cmd_stdout_stream,cmds,cmp,
@@ -94,45 +98,49 @@ export
     istaskdone,istril,istriu,isvalid,iswalnum,iswalpha,iswascii,iswblank,
     iswcntrl,iswdigit,iswgraph,iswlower,iswprint,iswpunct,iswspace,iswupper,
     iswxdigit,itrunc,join,key,keys,kron,last,lc,lcfirst,lcm,ldexp,leading_ones,
-    leading_zeros,length,less,lfact,lgamma,linreg,linspace,load,localize,
-    localize_copy,locate,log,log10,log1p,log2,logb,logspace,lowercase,lpad,ls,
-    lstrip,ltoh,lu,lu!,mad,make_pipe,make_scheduled,map,map_to,map_to2,
+    leading_zeros,length,less,lfact,lgamma,linreg,linspace,load,localindexes,
+    localize,localize_copy,locate,log,log10,log1p,log2,logb,logspace,lowercase,
+    lpad,ls,lstrip,ltoh,lu,lu!,mad,make_pipe,make_scheduled,map,map_to,map_to2,
     map_vectorized,mapreduce,match,matches,matmul2x2,matmul3x3,max,maxdim,
     maxintfloat,mean,median,memcat,memchr,memio,merge,merge!,method_missing,min,
     mmap,mmap_array,mmap_grow,mmap_stream_settings,mod,mod1,modf,msync,munmap,
     myid,myindexes,nCr,nPr,names,nan,nb_available,ndigits,ndigits0z,ndims,next,
     nextfloat,nextind,nextpow2,nnz,nonzeros,norm,not!,nprocs,nthbyte,nthperm,
-    nthperm!,ntoh,ntuple,num,num2hex,numel,object_id,oct,oftype,one,ones,open,
+    nthperm!,nthreads,ntoh,ntuple,num,num2hex,numel,object_id,oct,oftype,one,ones,open,
     or!,order,
     other,out,output,owner,pairs,parse,parse_bin,parse_float,parse_hex,
     parse_input_line,parse_int,parse_oct,parseatom,partitions,pascal,
     peakflops,permute,pfor,pieceindex,pieceindexes,pipeline_error,pmap,
-    pointer,pointer_to_array,pop,position,pow,power_by_squaring,
-    powermod,preduce,prevfloat,prevind,print,print_escaped,print_joined,
+    pmap_balanced,pmap_stats,pointer,pointer_to_array,pop,position,pow,power_by_squaring,
+    powermod,preduce,preempt_interval,prevfloat,prevind,print,print_escaped,print_joined,
     print_matrix,print_quoted,print_quoted_literal,print_shortest,
     print_unescaped,print_unescaped_chars,printf,println,process_exit_status,
     process_exited,process_options,process_running,process_signaled,
     process_status,process_stop_signal,process_stopped,process_term_signal,
-    procs,prod,produce,promote,promote_rule,promote_shape,promote_type,
+    procgrid,procs,prod,produce,promote,promote_rule,promote_shape,promote_type,
     ptr_arg_convert,push,put,qr,quantile,quartile,quintile,quit,quote_string,
     radians2degrees,rand,rand!,randbeta,randbeta!,randbit,randbit!,randbool,
     randbool!,randchi2,randchi2!,randcycle,randexp,randexp!,randg,randg!,randg2,
     randi,randi!,randival,randival!,randn,randn!,randperm,randsym,rank,rational,
     read,read_from,readall,readchomp,readline,readlines,readuntil,real,
     real_valued,realmax,realmin,reduce,ref,rehash,reim,reinterpret,rem,
-    remote_call,remote_call_fetch,remote_call_wait,remote_do,repeat,
-    repl_show,replace,repmat,reshape,reverse,reverse!,rfft,rfftn,rot180,rot90,
-    rotl90,rotr90,round,rpad,rr2id,rref,rstrip,run,safe_char,scan,search,
-    searchsorted,sec,secd,sech,seek,select,select!,select_read,serialize,
-    setenv,setfield,setsuccess,shift,show,showall,showcompact,shuffle,shuffle!,
+    remote_call,remote_call_fetch,remote_call_idempotent,remote_call_wait,
+    remote_do,remote_ref_stats,
+    repeat,repl_show,replace,repmat,reshape,reverse,reverse!,rfft,rfftn,rot180,
+    rot90,rotl90,rotr90,round,rpad,rr2id,rref,rstrip,run,safe_char,scan,search,
+    sdata,searchsorted,sec,secd,sech,seek,select,select!,select_read,serialize,
+    setenv,setfield,set_nonblocking,set_ref_lease,setsuccess,shift,show,showall,
+    set_heartbeat,showcompact,shuffle,shuffle!,
     sign,signbit,signed,significand,similar,sin,sinc,sind,sinh,size,sizeof,skip,
     sleep,slice,slicedim,sort,sort!,sort_by,sort_by!,sortperm,sortr,sortr!,
     spawn,spawnat,spawnlocal,split,sprint,sprintf,sqrt,square,squeeze,srand,
     sshow,start,std,stderr,stderr_stream,stdin,stdin_stream,stdout,
-    stdout_stream,step,strcat,strchr,strerror,strftime,stride,strides,string,
+    stdout_stream,start_timer,step,stop_timer,strcat,strchr,strerror,strftime,
+    stride,strides,string,
     strip,strlen,strptime,strwidth,sub,sub2ind,success,successful,sum,summary,
-    super,svd,svdvals,symbol,system,system_error,take,takebuf_string,tan,tand,
-    tanh,thisind,tic,tiedrank,time,times,time_ns,tintersect,tls,tmpnam,toc,toggle,
+    super,svd,svdvals,symbol,system,system_error,take,take_n,takebuf_string,tan,tand,
+    tanh,thisind,threadcall,threadfor,threadreduce,tic,tiedrank,time,times,
+    time_ns,tintersect,tls,tmpnam,toc,toggle,
     toggle_each,toq,trace,trailing_ones,trailing_zeros,transform_to_utf8,transpose,trideig,
     tril,triu,trues,trunc,truncate,tty_cols,tty_rows,typemax,typemin,uc,ucfirst,
     uint,uint128,uint16,uint32,uint64,uint8,
@@ -154,7 +162,7 @@ export
     # Macros
     @v_str, @unexpected, @assert, @r_str, @str, @S_str, @I_str, @E_str,
     @B_str, @b_str, @cmd, @time, @elapsed, @windows_only, @unix_only,
-    @sync, @spawn, @spawnlocal, @spawnat, @everywhere, @parallel,
+    @sync, @spawn, @spawnlocal, @spawnat, @everywhere, @parallel, @nopreempt,
     @gensym, @eval, @task, @f_str, @thunk, @L_str, @vectorize_1arg,
     @vectorize_2arg, @printf
 
@@ -245,6 +253,8 @@ include("task.jl")
 include("process.jl")
 include("serialize.jl")
 include("multi.jl")
+include("threading.jl")
+include("channel.jl")
 
 # system & environment
 include("osutils.jl")
@@ -269,9 +279,11 @@ include("statistics.jl")
 # random number generation
 include("random.jl")
 
-# distributed arrays and memory-mapped arrays
+# distributed arrays, memory-mapped and shared arrays
 include("darray.jl")
+include("blockcyclic.jl")
 include("mmap.jl")
+include("sharedarray.jl")
 
 # utilities - version, timing, help, edit
 include("version.jl")
@@ -298,7 +310,7 @@ include("signal_fftw.jl")
 compile_hint(cwd, ())
 compile_hint(fdio, (Int32,))
 compile_hint(ProcessGroup, (Int, Array{Any,1}, Array{Any,1}))
-compile_hint(select_read, (FDSet, Float64))
+compile_hint(process_events, (Float64,))
 compile_hint(next, (Dict{Any,Any}, Int))
 compile_hint(start, (Dict{Any,Any},))
 compile_hint(perform_work, ())
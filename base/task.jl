@@ -17,6 +17,13 @@ function tls(key, val)
     tls()[key] = val
 end
 
+# (mapped, reused, unmapped, trimmed, pooled, pooled_bytes) for task stacks
+function stack_pool_stats()
+    a = Array(Uint, 6)
+    ccall(:jl_stack_pool_stats, Void, (Ptr{Uint},), a)
+    tuple(a...)
+end
+
 let _generator_stack = {}
     global produce, consume
     function produce(v)
@@ -0,0 +1,120 @@
+## threading.jl - native thread pool
+##
+## the pool has nthreads() OS threads with per-thread work queues; idle
+## threads steal work from busy ones. only native code runs on the pool,
+## since the julia runtime itself is single threaded: functions run there
+## must not allocate julia objects, call back into julia, or raise errors.
+##
+## threadcall(fptr, arg) -
+##     run the C function void fptr(void*) on arg in the thread pool.
+##     returns a ThreadWork handle. arg is kept alive until the call is
+##     done; arrays are passed as a pointer to their data.
+##
+## wait(w) - wait for a ThreadWork to finish, helping with other work
+##
+## isready(w) - whether a ThreadWork has finished
+##
+## threadfor(fptr, arg, r[, schedule[, chunk]]) -
+##     run a loop over the range r in the thread pool, calling the C function
+##     void fptr(void *arg, int64_t lo, int64_t hi, void *acc) on pieces
+##     lo:hi-1 of r, and wait for it. schedule is :static (the default;
+##     contiguous blocks, or round-robin blocks of chunk iterations),
+##     :dynamic (threads take chunk iterations at a time) or :guided
+##     (threads take shrinking shares of what is left, at least chunk).
+##     like any pool work, the body must be native code that does not use
+##     the julia runtime.
+##
+## threadreduce(op, v0, fptr, arg, r[, schedule[, chunk]]) -
+##     like threadfor, with acc pointing to an accumulator of the bits type
+##     of v0, initially v0; each thread has its own. the results are
+##     combined with op.
+
+type ThreadWork
+    handle::Ptr{Void}
+
+    function ThreadWork(handle::Ptr{Void})
+        w = new(handle)
+        finalizer(w, release_work)
+        w
+    end
+end
+
+# the pool keeps an array argument alive until the call is done and
+# released, so the handle can be dropped while the call is running
+function release_work(w::ThreadWork)
+    if w.handle != C_NULL
+        ccall(:jl_work_release, Void, (Ptr{Void},), w.handle)
+        w.handle = C_NULL
+    end
+end
+
+nthreads() = int(ccall(:jl_threadpool_size, Int32, ()))
+
+function threadcall(fptr::Ptr{Void}, arg::Ptr{Void})
+    h = ccall(:jl_threadpool_spawn, Ptr{Void}, (Ptr{Void}, Ptr{Void}), fptr, arg)
+    ThreadWork(h)
+end
+
+function threadcall(fptr::Ptr{Void}, arg::Array)
+    h = ccall(:jl_threadcall, Ptr{Void}, (Ptr{Void}, Ptr{Void}, Any),
+              fptr, pointer(arg), arg)
+    ThreadWork(h)
+end
+
+isready(w::ThreadWork) =
+    ccall(:jl_work_done, Int32, (Ptr{Void},), w.handle) != 0
+
+function wait(w::ThreadWork)
+    ccall(:jl_threadpool_wait, Void, (Ptr{Void},), w.handle)
+    w
+end
+
+const _jl_schedules = {:static => int32(0), :dynamic => int32(1),
+                       :guided => int32(2)}
+
+function _threadfor(fptr::Ptr{Void}, arg::Ptr{Void}, r::Range1, schedule::Symbol,
+                    chunk::Integer, acc::Ptr{Void}, accsize::Integer)
+    sched = get(_jl_schedules, schedule, int32(-1))
+    if sched < 0
+        error("threadfor: unknown schedule ", schedule)
+    end
+    ccall(:jl_threadpool_for, Void,
+          (Ptr{Void}, Ptr{Void}, Int64, Int64, Int32, Int64, Ptr{Void}, Uint),
+          fptr, arg, first(r), first(r)+length(r), sched, chunk, acc, accsize)
+end
+
+threadfor(fptr::Ptr{Void}, arg::Ptr{Void}, r::Range1, schedule::Symbol,
+          chunk::Integer) =
+    (_threadfor(fptr, arg, r, schedule, chunk, C_NULL, 0); nothing)
+threadfor(fptr::Ptr{Void}, arg::Array, r::Range1, schedule::Symbol,
+          chunk::Integer) =
+    threadfor(fptr, convert(Ptr{Void}, pointer(arg)), r, schedule, chunk)
+threadfor(fptr::Ptr{Void}, arg, r::Range1, schedule::Symbol) =
+    threadfor(fptr, arg, r, schedule, 0)
+threadfor(fptr::Ptr{Void}, arg, r::Range1) = threadfor(fptr, arg, r, :static, 0)
+
+function threadreduce(op::Function, v0, fptr::Ptr{Void}, arg::Ptr{Void},
+                      r::Range1, schedule::Symbol, chunk::Integer)
+    T = typeof(v0)
+    if !isa(T, BitsKind)
+        error("threadreduce: accumulator must be a bits type")
+    end
+    acc = Array(T, nthreads())
+    fill!(acc, v0)
+    _threadfor(fptr, arg, r, schedule, chunk,
+               convert(Ptr{Void}, pointer(acc)), sizeof(T))
+    v = acc[1]
+    for i = 2:length(acc)
+        v = op(v, acc[i])
+    end
+    v
+end
+threadreduce(op::Function, v0, fptr::Ptr{Void}, arg::Array, r::Range1,
+             schedule::Symbol, chunk::Integer) =
+    threadreduce(op, v0, fptr, convert(Ptr{Void}, pointer(arg)), r,
+                 schedule, chunk)
+threadreduce(op::Function, v0, fptr::Ptr{Void}, arg, r::Range1,
+             schedule::Symbol) =
+    threadreduce(op, v0, fptr, arg, r, schedule, 0)
+threadreduce(op::Function, v0, fptr::Ptr{Void}, arg, r::Range1) =
+    threadreduce(op, v0, fptr, arg, r, :static, 0)
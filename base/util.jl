@@ -240,7 +240,7 @@ function load(fname::ByteString)
         iserr, err = false, ()
         try
             load(fname)
-            for p = 1:nprocs()
+            for p in procs()
                 if p != myid()
                     remote_do(p, remote_load, load_dict)
                 end
@@ -275,6 +275,7 @@ jl_lambda_info_t *jl_new_lambda_info(jl_value_t *ast, jl_tuple_t *sparams)
     li->fptr = &jl_trampoline;
     li->roots = NULL;
     li->functionObject = NULL;
+    li->specFunctionObject = NULL;
     li->specTypes = NULL;
     li->inferred = jl_false;
     li->inInference = 0;
@@ -388,6 +388,15 @@ void jl_arrayset(jl_array_t *a, size_t i, jl_value_t *rhs)
     }
 }
 
+// clear an element of a pointer array, so it no longer keeps the object alive
+DLLEXPORT void jl_arrayunset(jl_array_t *a, size_t i)
+{
+    if (i >= a->length)
+        jl_errorf("unset array[%lu]: index out of range", (unsigned long)(i+1));
+    if (!jl_is_bits_type(jl_tparam0(jl_typeof(a))))
+        ((jl_value_t**)a->data)[i] = NULL;
+}
+
 JL_CALLABLE(jl_f_arrayset)
 {
     JL_NARGS(arrayset, 3, 3);
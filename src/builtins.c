@@ -93,6 +93,7 @@ void jl_enter_handler(jl_savestate_t *ss, jmp_buf *handlr)
 #ifdef JL_GC_MARKSWEEP
     ss->gcstack = jl_pgcstack;
 #endif
+    ss->argloc = jl_arg_area_loc();
 
     jl_current_task->state.prev = ss;
     jl_current_task->state.eh_task = jl_current_task;
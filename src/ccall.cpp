@@ -2,48 +2,101 @@
 
 static Function *value_to_pointer_func;
 
-// TODO: per-thread
-static char *temp_arg_area;
-static const uint32_t arg_area_sz = 4196;
-static uint32_t arg_area_loc;
-#define N_TEMP_ARG_BLOCKS 1024
-static void *temp_arg_blocks[N_TEMP_ARG_BLOCKS];
-static uint32_t arg_block_n = 0;
+// temporary space for arguments converted by jl_value_to_pointer.
+// space is used stack-like between save_arg_area_loc and
+// restore_arg_area_loc around each ccall. a task holds an area only while
+// it is inside a ccall, so a callback that switches tasks cannot clobber
+// another task's arguments. blocks are kept for reuse rather than freed;
+// the list of free areas is per thread so no lock is needed to take one.
+#define N_TEMP_ARG_BLOCKS 32
+#define TEMP_ARG_BLOCK_SZ 4096
+typedef struct _jl_argarea_t {
+    char *blocks[N_TEMP_ARG_BLOCKS];
+    uint32_t sizes[N_TEMP_ARG_BLOCKS];
+    uint32_t block;
+    uint32_t loc;
+    struct _jl_argarea_t *next;
+} jl_argarea_t;
+static JL_THREAD jl_argarea_t *free_arg_areas = NULL;
 static Function *save_arg_area_loc_func;
 static Function *restore_arg_area_loc_func;
 
-static uint64_t save_arg_area_loc()
+static jl_argarea_t *current_arg_area()
 {
-    return (((uint64_t)arg_block_n)<<32) | ((uint64_t)arg_area_loc);
+    jl_argarea_t *a = jl_current_task->argarea;
+    if (a == NULL) {
+        a = free_arg_areas;
+        if (a != NULL) {
+            free_arg_areas = a->next;
+        }
+        else {
+            a = (jl_argarea_t*)calloc(1, sizeof(jl_argarea_t));
+            if (a == NULL)
+                jl_error("ccall: out of temporary argument space");
+        }
+        a->block = 0;
+        a->loc = 0;
+        jl_current_task->argarea = a;
+    }
+    return a;
+}
+
+extern "C" DLLEXPORT uint64_t save_arg_area_loc()
+{
+    jl_argarea_t *a = current_arg_area();
+    return (((uint64_t)a->block)<<32) | ((uint64_t)a->loc);
+}
+
+// position to restore after an exception; does not claim an area
+extern "C" DLLEXPORT uint64_t jl_arg_area_loc()
+{
+    jl_argarea_t *a = jl_current_task->argarea;
+    if (a == NULL)
+        return 0;
+    return (((uint64_t)a->block)<<32) | ((uint64_t)a->loc);
 }
 
-static void restore_arg_area_loc(uint64_t l)
+extern "C" DLLEXPORT void restore_arg_area_loc(uint64_t l)
 {
-    arg_area_loc = l&0xffffffff;
-    uint32_t ab = l>>32;
-    while (arg_block_n > ab) {
-        arg_block_n--;
-        free(temp_arg_blocks[arg_block_n]);
+    jl_argarea_t *a = jl_current_task->argarea;
+    if (a == NULL)
+        return;
+    if (l == 0) {
+        // outermost ccall finished; give the area back
+        a->next = free_arg_areas;
+        free_arg_areas = a;
+        jl_current_task->argarea = NULL;
+        return;
     }
+    a->block = l>>32;
+    a->loc = l&0xffffffff;
 }
 
 static void *alloc_temp_arg_space(uint32_t sz)
 {
-    void *p;
-    if (arg_area_loc+sz > arg_area_sz) {
-#ifdef JL_GC_MARKSWEEP
-        if (arg_block_n >= N_TEMP_ARG_BLOCKS)
+    jl_argarea_t *a = current_arg_area();
+    // keep 16-byte alignment
+    sz = (sz+15)&~15;
+    if (a->blocks[a->block] == NULL || a->loc+sz > a->sizes[a->block]) {
+        uint32_t b = (a->blocks[a->block] == NULL) ? a->block : a->block+1;
+        if (b >= N_TEMP_ARG_BLOCKS)
             jl_error("ccall: out of temporary argument space");
-        p = malloc(sz);
-        temp_arg_blocks[arg_block_n++] = p;
-#else
-#error "fixme"
-#endif
-    }
-    else {
-        p = &temp_arg_area[arg_area_loc];
-        arg_area_loc += sz;
+        if (a->sizes[b] < sz) {
+            uint32_t bsz = TEMP_ARG_BLOCK_SZ<<(b < 12 ? b : 12);
+            if (bsz < sz) bsz = sz;
+            free(a->blocks[b]);
+            a->blocks[b] = (char*)malloc(bsz);
+            if (a->blocks[b] == NULL) {
+                a->sizes[b] = 0;
+                jl_error("ccall: out of temporary argument space");
+            }
+            a->sizes[b] = bsz;
+        }
+        a->block = b;
+        a->loc = 0;
     }
+    void *p = &a->blocks[a->block][a->loc];
+    a->loc += sz;
     return p;
 }
 
@@ -99,6 +152,28 @@ extern "C" void *jl_value_to_pointer(jl_value_t *jt, jl_value_t *v, int argn)
     return (jl_value_t*)jl_null;
 }
 
+// whether &argument, with static type aty, passed as jt needs space from
+// the temporary argument area. arrays of the right element type are passed
+// directly, and bits values of known type are copied to the stack.
+static bool addressof_needs_temp(jl_value_t *jt, jl_value_t *aty)
+{
+    if (!jl_is_cpointer_type(jt))
+        return false;
+    jl_value_t *et = jl_tparam0(jt);
+    if (jl_is_array_type(aty) &&
+        (jl_tparam0(aty) == et || et == (jl_value_t*)jl_bottom_type))
+        return false;
+    return !(aty == et && jl_is_bits_type(aty) && jl_is_leaf_type(aty));
+}
+
+// stack slot for a &x argument. allocated in the entry block, so that a
+// ccall inside a loop does not grow the stack on every iteration.
+static Value *emit_static_alloca(Type *vt, jl_codectx_t *ctx)
+{
+    BasicBlock &entry = ctx->f->getEntryBlock();
+    return new AllocaInst(vt, "", &*entry.getFirstNonPHI());
+}
+
 static Value *julia_to_native(Type *ty, jl_value_t *jt, Value *jv,
                               jl_value_t *argex, bool addressOf,
                               int argn, jl_codectx_t *ctx)
@@ -116,7 +191,7 @@ static Value *julia_to_native(Type *ty, jl_value_t *jt, Value *jv,
             if (ty->isPointerTy() && ty->getContainedType(0)==vt) {
                 // pass the address of an alloca'd thing, not a box
                 // since those are immutable.
-                Value *slot = builder.CreateAlloca(vt);
+                Value *slot = emit_static_alloca(vt, ctx);
                 builder.CreateStore(jv, slot);
                 return builder.CreateBitCast(slot, ty);
             }
@@ -140,6 +215,17 @@ static Value *julia_to_native(Type *ty, jl_value_t *jt, Value *jv,
             // array to pointer
             return builder.CreateBitCast(emit_arrayptr(jv), ty);
         }
+        if (!addressof_needs_temp(jt, aty)) {
+            // copy a value of known bits type to the stack
+            Type *vty = julia_type_to_llvm(aty, ctx);
+            assert(ty->isPointerTy());
+            if (vty != NULL && vty != T_void) {
+                Value *slot = emit_static_alloca(vty, ctx);
+                builder.CreateStore(emit_unbox(vty, PointerType::get(vty,0), jv),
+                                    slot);
+                return builder.CreateBitCast(slot, ty);
+            }
+        }
         Value *p = builder.CreateCall3(value_to_pointer_func,
                                        literal_pointer_val(jl_tparam0(jt)), jv,
                                        ConstantInt::get(T_int32, argn));
@@ -269,28 +355,60 @@ static Value *emit_ccall(jl_value_t **args, size_t nargs, jl_codectx_t *ctx)
                                rt);
     }
 
-    // see if there are & arguments
+    // see if there are & arguments, and whether any of them need
+    // temporary space at run time
+    bool needtemp = false;
     for(i=4; i < nargs+1; i+=2) {
         jl_value_t *argi = args[i];
         if (jl_is_expr(argi) && ((jl_expr_t*)argi)->head == amp_sym) {
             haspointers = true;
-            break;
+            int ai = (i-4)/2;
+            jl_value_t *jargty = (isVa && ai >= (int)jl_tuple_len(tt)-1) ?
+                jl_tparam0(jl_tupleref(tt,jl_tuple_len(tt)-1)) :
+                jl_tupleref(tt,ai);
+            if (addressof_needs_temp(jargty,
+                                     expr_type(jl_exprarg(argi,0), ctx))) {
+                needtemp = true;
+                break;
+            }
         }
     }
 
     // make LLVM function object for the target
-    Function *llvmf =
-        Function::Create(FunctionType::get(lrt, fargt_sig, isVa),
-                         Function::ExternalLinkage,
-                         "ccall_", jl_Module);
-    jl_ExecutionEngine->addGlobalMapping(llvmf, fptr);
+    FunctionType *functype = FunctionType::get(lrt, fargt_sig, isVa);
+    Function *llvmf = NULL;
+    if (imaging_mode) {
+        // refer to the target by name so that native code in the system
+        // image can be linked against it
+        GlobalValue *prev = NULL;
+        if (jl_is_symbol(ptr))
+            prev = jl_Module->getNamedValue(((jl_sym_t*)ptr)->name);
+        if (!jl_is_symbol(ptr) ||
+            (prev != NULL && (!isa<Function>(prev) ||
+                              ((Function*)prev)->getFunctionType() != functype))) {
+            nonrelocatable.insert(ctx->f);
+        }
+        else if (prev != NULL) {
+            llvmf = (Function*)prev;
+        }
+        else {
+            llvmf = Function::Create(functype, Function::ExternalLinkage,
+                                     ((jl_sym_t*)ptr)->name, jl_Module);
+            jl_ExecutionEngine->addGlobalMapping(llvmf, fptr);
+        }
+    }
+    if (llvmf == NULL) {
+        llvmf = Function::Create(functype, Function::ExternalLinkage,
+                                 "ccall_", jl_Module);
+        jl_ExecutionEngine->addGlobalMapping(llvmf, fptr);
+    }
 
     // save temp argument area stack pointer
     Value *saveloc=NULL;
     Value *stacksave=NULL;
     if (haspointers) {
-        // TODO: inline this
-        saveloc = builder.CreateCall(save_arg_area_loc_func);
+        if (needtemp)
+            saveloc = builder.CreateCall(save_arg_area_loc_func);
         stacksave =
             builder.CreateCall(Intrinsic::getDeclaration(jl_Module,
                                                          Intrinsic::stacksave));
@@ -323,18 +441,16 @@ static Value *emit_ccall(jl_value_t **args, size_t nargs, jl_codectx_t *ctx)
             arg = emit_expr(argi, ctx, true);
         else
             arg = emit_unboxed(argi, ctx);
-        /*
-#ifdef JL_GC_MARKSWEEP
-        // make sure args are rooted
-        if (largty->isPointerTy() &&
-            (largty == jl_pvalue_llvmt ||
-             !jl_is_bits_type(expr_type(args[i], ctx)))) {
-            make_gcroot(boxed(arg), ctx);
-        }
-#endif
-        */
         argvals[ai] = julia_to_native(largty, jargty, arg, argi, addressOf,
                                       ai+1, ctx);
+        // pointers into arrays and strings are passed without copying, so
+        // pin the object they came from until the call returns.
+        jl_value_t *rooti = args[i+1];
+        if (largty->isPointerTy() && largty != jl_pvalue_llvmt &&
+            (jl_is_symbol(rooti) || jl_is_symbolnode(rooti)) &&
+            !jl_is_bits_type(expr_type(rooti, ctx))) {
+            make_gcroot(boxed(emit_expr(rooti, ctx, true)), ctx);
+        }
     }
     // the actual call
     Value *result = builder.CreateCall(llvmf,
@@ -344,8 +460,8 @@ static Value *emit_ccall(jl_value_t **args, size_t nargs, jl_codectx_t *ctx)
 
     // restore temp argument area stack pointer
     if (haspointers) {
-        assert(saveloc != NULL);
-        builder.CreateCall(restore_arg_area_loc_func, saveloc);
+        if (needtemp)
+            builder.CreateCall(restore_arg_area_loc_func, saveloc);
         assert(stacksave != NULL);
         builder.CreateCall(Intrinsic::getDeclaration(jl_Module,
                                                      Intrinsic::stackrestore),
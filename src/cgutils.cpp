@@ -48,13 +48,66 @@ static Value *literal_pointer_val(void *p, Type *t)
 #endif
 }
 
+// in imaging mode a pointer is loaded from a slot instead, which is filled in
+// when the system image is restored in another process.
+static GlobalVariable *new_imaging_slot(void *p, Type *t)
+{
+    GlobalVariable *gv =
+        new GlobalVariable(*jl_Module, t, true, GlobalVariable::ExternalLinkage,
+                           NULL, "jl_slot");
+    void **addr = (void**)malloc(sizeof(void*));
+    *addr = p;
+    jl_ExecutionEngine->addGlobalMapping(gv, addr);
+    return gv;
+}
+
 static Value *literal_pointer_val(jl_value_t *p)
 {
+    if (imaging_mode && p != NULL) {
+        GlobalVariable *&gv = imaging_gvars[p];
+        if (gv == NULL) {
+            gv = new_imaging_slot(p, jl_pvalue_llvmt);
+            gvar_slots.push_back(gv);
+            jl_cell_1d_push(jl_sysimg_gvals, p);
+        }
+        return builder.CreateLoad(gv, false);
+    }
     return literal_pointer_val(p, jl_pvalue_llvmt);
 }
 
+static Value *literal_pointer_val(jl_binding_t *b)
+{
+    if (imaging_mode) {
+        GlobalVariable *&gv = imaging_bvars[b];
+        if (gv == NULL) {
+            gv = new_imaging_slot(b, T_pint8);
+            bvar_slots.push_back(gv);
+            // a binding is found again by its owner and name
+            jl_cell_1d_push(jl_sysimg_bvals, (jl_value_t*)b->owner);
+            jl_cell_1d_push(jl_sysimg_bvals, (jl_value_t*)b->name);
+        }
+        return builder.CreateLoad(gv, false);
+    }
+    return literal_pointer_val((void*)b, T_pint8);
+}
+
+// pointer to the value field of a binding
+static Value *binding_value_pointer(jl_binding_t *b)
+{
+    if (imaging_mode) {
+        Value *bp = builder.CreateGEP(literal_pointer_val(b),
+                                      ConstantInt::get(T_size,
+                                                       offsetof(jl_binding_t,value)));
+        return builder.CreateBitCast(bp, jl_ppvalue_llvmt);
+    }
+    return literal_pointer_val(&b->value, jl_ppvalue_llvmt);
+}
+
 static Value *literal_pointer_val(void *p)
 {
+    // an arbitrary address cannot be found again in another process
+    if (imaging_mode)
+        nonrelocatable.insert(builder.GetInsertBlock()->getParent());
     return literal_pointer_val(p, T_pint8);
 }
 
@@ -16,6 +16,7 @@
 #include "llvm/Target/TargetData.h"
 #include "llvm/Target/TargetOptions.h"
 #include "llvm/Transforms/Scalar.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 #if defined(LLVM_VERSION_MAJOR) && LLVM_VERSION_MAJOR == 3 && LLVM_VERSION_MINOR >= 1
 #include "llvm/Transforms/Vectorize.h"
 #endif
@@ -23,11 +24,17 @@
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Config/llvm-config.h"
+#if defined(LLVM_VERSION_MAJOR) && LLVM_VERSION_MAJOR == 3 && LLVM_VERSION_MINOR >= 1
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Support/FormattedStream.h"
+#endif
 #include <setjmp.h>
 #include <string>
 #include <sstream>
 #include <map>
+#include <set>
 #include <vector>
+#include <algorithm>
 #ifdef DEBUG
 #undef NDEBUG
 #endif
@@ -54,6 +61,26 @@ static DIBuilder *dbuilder;
 static std::map<int, std::string> argNumberStrings;
 static FunctionPassManager *FPM;
 
+// imaging mode: generated code avoids embedding addresses from this process
+// so that it can also be written to an object file for the system image
+static bool imaging_mode = false;
+static bool native_image_prepared = false;
+static std::map<jl_value_t*, GlobalVariable*> imaging_gvars;
+static std::map<jl_binding_t*, GlobalVariable*> imaging_bvars;
+static std::vector<GlobalVariable*> gvar_slots;
+static std::vector<GlobalVariable*> bvar_slots;
+static std::set<Function*> julia_functions;
+static std::set<Function*> nonrelocatable;
+static std::set<Function*> relocatable;
+static std::map<Function*, int32_t> function_ids;
+static std::vector<Function*> imaged_functions;
+// functions with native signatures, and which of them to inline
+static std::map<Function*, jl_value_t*> specsig_rettypes;
+static std::set<Function*> inlinable_functions;
+// values and bindings referenced by slots, in slot order
+jl_array_t *jl_sysimg_gvals = NULL;
+jl_array_t *jl_sysimg_bvals = NULL;
+
 // types
 static Type *jl_value_llvmt;
 static Type *jl_pvalue_llvmt;
@@ -93,15 +120,12 @@ static GlobalVariable *jltrue_var;
 static GlobalVariable *jlfalse_var;
 static GlobalVariable *jlnull_var;
 static GlobalVariable *jlfloat32temp_var;
-#ifdef JL_GC_MARKSWEEP
-static GlobalVariable *jlpgcstack_var;
-#endif
-static GlobalVariable *jlexc_var;
 static GlobalVariable *jldiverr_var;
 static GlobalVariable *jlundeferr_var;
 static GlobalVariable *jldomerr_var;
 static GlobalVariable *jlovferr_var;
 static GlobalVariable *jlinexacterr_var;
+static GlobalVariable *jlyieldpending_var;
 
 // important functions
 static Function *jlnew_func;
@@ -119,6 +143,8 @@ static Function *jlclosure_func;
 static Function *jlmethod_func;
 static Function *jlenter_func;
 static Function *jlleave_func;
+static Function *jlsafepoint_func;
+static Function *jlgetptls_func;
 static Function *jlegal_func;
 static Function *jlallocobj_func;
 static Function *jlalloc2w_func;
@@ -152,13 +178,37 @@ static Function *box64_func;
 
 // --- entry point ---
 
-static void emit_function(jl_lambda_info_t *lam, Function *f);
+static Function *emit_function(jl_lambda_info_t *lam, Function *f);
+
+// functions with native signatures this small are inlined into callers
+static const size_t inline_threshold = 40;
+
+static bool should_inline(Function *f)
+{
+    size_t n = 0;
+    for (Function::iterator bb = f->begin(); bb != f->end(); ++bb) {
+        for (BasicBlock::iterator i = bb->begin(); i != bb->end(); ++i) {
+            CallInst *call = dyn_cast<CallInst>(&*i);
+            // code after a setjmp cannot be moved into another frame
+            if (call != NULL && call->getCalledFunction() == setjmp_func)
+                return false;
+            n++;
+        }
+    }
+    return n <= inline_threshold;
+}
+
 //static int n_compile=0;
-static Function *to_function(jl_lambda_info_t *li)
+static Function *to_function(jl_lambda_info_t *li, Function **specf=NULL)
 {
     JL_SIGATOMIC_BEGIN();
+    std::string fname = li->name->name;
+    if (imaging_mode)
+        fname = "julia_" + fname;
     Function *f = Function::Create(jl_func_sig, Function::ExternalLinkage,
-                                   li->name->name, jl_Module);
+                                   fname, jl_Module);
+    if (imaging_mode)
+        julia_functions.insert(f);
     assert(!li->inInference);
     if (li->functionObject == NULL)
         li->functionObject = (void*)f;
@@ -166,9 +216,16 @@ static Function *to_function(jl_lambda_info_t *li)
     DebugLoc olddl = builder.getCurrentDebugLocation();
     bool last_n_c = nested_compile;
     nested_compile = true;
-    emit_function(li, f);
+    Function *sf = emit_function(li, f);
     nested_compile = last_n_c;
+    if (sf != NULL) {
+        FPM->run(*sf);
+        if (should_inline(sf))
+            inlinable_functions.insert(sf);
+    }
     FPM->run(*f);
+    if (specf != NULL)
+        *specf = sf;
     //n_compile++;
     // print out the function's LLVM code
     //ios_printf(ios_stderr, "%s:%d\n",
@@ -192,8 +249,17 @@ extern "C" void jl_generate_fptr(jl_function_t *f)
     if (li->fptr == &jl_trampoline) {
         JL_SIGATOMIC_BEGIN();
         li->fptr = (jl_fptr_t)jl_ExecutionEngine->getPointerToFunction(llvmf);
+        Function *specf = (Function*)li->specFunctionObject;
+        if (specf != NULL)
+            (void)jl_ExecutionEngine->getPointerToFunction(specf);
         JL_SIGATOMIC_END();
-        llvmf->deleteBody();
+        // keep the IR around if it might go into a native system image
+        if (!imaging_mode) {
+            llvmf->deleteBody();
+            // small native-signature bodies are still needed for inlining
+            if (specf != NULL && !inlinable_functions.count(specf))
+                specf->deleteBody();
+        }
     }
     f->fptr = li->fptr;
 }
@@ -201,6 +267,16 @@ extern "C" void jl_generate_fptr(jl_function_t *f)
 extern "C" void jl_compile(jl_function_t *f)
 {
     jl_lambda_info_t *li = f->linfo;
+    if (li->functionObject == NULL && li->fptr != &jl_trampoline) {
+        // native code restored from the system image; just declare it
+        Function *llvmf = Function::Create(jl_func_sig,
+                                           Function::ExternalLinkage,
+                                           li->name->name, jl_Module);
+        jl_ExecutionEngine->addGlobalMapping(llvmf, (void*)li->fptr);
+        li->functionObject = (void*)llvmf;
+        if (imaging_mode)
+            julia_functions.insert(llvmf);
+    }
     if (li->functionObject == NULL) {
         // objective: assign li->functionObject
         li->inCompile = 1;
@@ -227,22 +303,160 @@ const jl_value_t *jl_dump_function(jl_function_t *f, jl_tuple_t *types)
     std::string code;
     llvm::raw_string_ostream stream(code);
     Function *llvmf;
+    Function *specf = NULL;
     if (sf->linfo->functionObject == NULL) {
         jl_compile(sf);
         llvmf = (Function*)sf->linfo->functionObject;
+        specf = (Function*)sf->linfo->specFunctionObject;
     }
     else {
         if (sf->fptr == &jl_trampoline) {
             llvmf = (Function*)sf->linfo->functionObject;
+            specf = (Function*)sf->linfo->specFunctionObject;
         }
         else {
-            llvmf = to_function(sf->linfo);
+            llvmf = to_function(sf->linfo, &specf);
         }
     }
+    // show the native-signature body rather than its boxing wrapper
+    if (specf != NULL && !specf->isDeclaration())
+        llvmf = specf;
     llvmf->print(stream);
     return jl_cstr_to_string((char*)stream.str().c_str());
 }
 
+// --- ahead-of-time compilation ---
+
+// a function can go into the native image unless it embeds an address from
+// this process or calls a function that cannot.
+static bool calls_any(Function *f, std::set<Function*> &fs)
+{
+    for (Function::iterator bb = f->begin(); bb != f->end(); ++bb) {
+        for (BasicBlock::iterator i = bb->begin(); i != bb->end(); ++i) {
+            for (User::op_iterator op = i->op_begin(); op != i->op_end(); ++op) {
+                Function *g = dyn_cast<Function>(*op);
+                if (g != NULL && fs.count(g))
+                    return true;
+            }
+        }
+    }
+    return false;
+}
+
+extern "C" void jl_prepare_native_image(void)
+{
+    if (!imaging_mode)
+        return;
+    std::set<Function*> bad(nonrelocatable);
+    std::set<Function*>::iterator it;
+    for (it = julia_functions.begin(); it != julia_functions.end(); ++it) {
+        if ((*it)->isDeclaration())
+            bad.insert(*it);
+    }
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (it = julia_functions.begin(); it != julia_functions.end(); ++it) {
+            if (!bad.count(*it) && calls_any(*it, bad)) {
+                bad.insert(*it);
+                changed = true;
+            }
+        }
+    }
+    for (it = julia_functions.begin(); it != julia_functions.end(); ++it) {
+        if (!bad.count(*it))
+            relocatable.insert(*it);
+    }
+    native_image_prepared = true;
+}
+
+// index+1 of a function in jl_sysimg_fvars, or 0 if it has no native code
+extern "C" int32_t jl_assign_functionID(void *function)
+{
+    if (!native_image_prepared || function == NULL)
+        return 0;
+    Function *f = (Function*)function;
+    if (!relocatable.count(f))
+        return 0;
+    int32_t &id = function_ids[f];
+    if (id == 0) {
+        imaged_functions.push_back(f);
+        id = imaged_functions.size();
+    }
+    return id;
+}
+
+static void emit_pointer_table(std::vector<Constant*> &ptrs, const char *name)
+{
+    ArrayType *atype = ArrayType::get(T_pint8, ptrs.size());
+    new GlobalVariable(*jl_Module, atype, true, GlobalVariable::ExternalLinkage,
+                       ConstantArray::get(atype, ArrayRef<Constant*>(ptrs)),
+                       name);
+}
+
+static void slots_to_table(std::vector<GlobalVariable*> &slots,
+                           const char *name)
+{
+    std::vector<Constant*> ptrs;
+    for(size_t i=0; i < slots.size(); i++) {
+        GlobalVariable *gv = slots[i];
+        // filled in by jl_restore_system_image
+        gv->setInitializer(Constant::getNullValue(gv->getType()->getElementType()));
+        gv->setConstant(false);
+        gv->setLinkage(GlobalVariable::InternalLinkage);
+        ptrs.push_back(ConstantExpr::getBitCast(gv, T_pint8));
+    }
+    emit_pointer_table(ptrs, name);
+}
+
+// writes all relocatable code to an object file. this modifies jl_Module,
+// so it should only be done right before exiting.
+extern "C" void jl_dump_objfile(char *fname)
+{
+#if defined(LLVM_VERSION_MAJOR) && LLVM_VERSION_MAJOR == 3 && LLVM_VERSION_MINOR >= 1
+    if (!native_image_prepared)
+        jl_error("jl_dump_objfile: not in imaging mode");
+    std::set<Function*>::iterator it;
+    for (it = julia_functions.begin(); it != julia_functions.end(); ++it) {
+        Function *f = *it;
+        if (relocatable.count(f))
+            f->setLinkage(GlobalValue::InternalLinkage);
+        else if (!f->isDeclaration())
+            f->deleteBody();
+    }
+    std::vector<Constant*> fptrs;
+    for(size_t i=0; i < imaged_functions.size(); i++)
+        fptrs.push_back(ConstantExpr::getBitCast(imaged_functions[i], T_pint8));
+    emit_pointer_table(fptrs, "jl_sysimg_fvars");
+    slots_to_table(gvar_slots, "jl_sysimg_gvars");
+    slots_to_table(bvar_slots, "jl_sysimg_bvars");
+    dbuilder->finalize();
+
+    // the JIT uses a static relocation model; the image is loaded as a
+    // shared library, so it needs position-independent code.
+    EngineBuilder eb(jl_Module);
+    eb.setRelocationModel(Reloc::PIC_);
+    eb.setTargetOptions(jl_TargetMachine->Options);
+    TargetMachine *tm = eb.selectTarget();
+    jl_Module->setTargetTriple(tm->getTargetTriple());
+
+    std::string err;
+    raw_fd_ostream out(fname, err, raw_fd_ostream::F_Binary);
+    if (!err.empty())
+        jl_errorf("could not open %s: %s", fname, err.c_str());
+    formatted_raw_ostream fout(out);
+    PassManager PM;
+    PM.add(new TargetData(*tm->getTargetData()));
+    if (tm->addPassesToEmitFile(PM, fout, TargetMachine::CGFT_ObjectFile,
+                                false))
+        jl_error("jl_dump_objfile: target cannot emit object files");
+    PM.run(*jl_Module);
+    delete tm;
+#else
+    jl_error("jl_dump_objfile: native system images require LLVM 3.1");
+#endif
+}
+
 // information about the context of a piece of code: its enclosing
 // function and module, and visible local variables and labels.
 typedef struct {
@@ -265,14 +479,16 @@ typedef struct {
     Value *envArg;
     const Argument *argArray;
     const Argument *argCount;
+    Value *ptlsStates;  // this thread's jl_tls_states_t, as an i8*
     AllocaInst *argTemp;
     int argDepth;
-    //int maxDepth;
+    int maxDepth;
     int argSpace;
     std::string funcName;
     jl_sym_t *vaName;  // name of vararg argument
     bool vaStack;      // varargs stack-allocated
     int nReqArgs;
+    std::vector<CallInst*> *to_inline;
 } jl_codectx_t;
 
 static Value *emit_expr(jl_value_t *expr, jl_codectx_t *ctx, bool boxed=true,
@@ -280,6 +496,7 @@ static Value *emit_expr(jl_value_t *expr, jl_codectx_t *ctx, bool boxed=true,
 static Value *emit_unboxed(jl_value_t *e, jl_codectx_t *ctx);
 static int is_global(jl_sym_t *s, jl_codectx_t *ctx);
 static void make_gcroot(Value *v, jl_codectx_t *ctx);
+static bool store_unboxed_p(char *name, jl_codectx_t *ctx);
 static Value *global_binding_pointer(jl_module_t *m, jl_sym_t *s,
                                      jl_binding_t **pbnd, bool assign);
 static Value *emit_checked_var(Value *bp, const char *name, jl_codectx_t *ctx);
@@ -376,10 +593,17 @@ static void max_arg_depth(jl_value_t *expr, int32_t *max, int32_t *sp,
                         }
                         else {
                             esc = true;
-                            // first 3 arguments are static
+                            // first 3 arguments are static. each converted
+                            // argument is followed by an object that is
+                            // kept rooted for the duration of the call.
                             for(i=4; i < (size_t)alen; i++) {
                                 max_arg_depth(jl_exprarg(e,i), max, sp, esc, ctx);
+                                if (i%2 == 1) {
+                                    (*sp)++;
+                                    if (*sp > *max) *max = *sp;
+                                }
                             }
+                            (*sp) = lastsp;
                             return;
                         }
                     }
@@ -449,8 +673,333 @@ static void make_gcroot(Value *v, jl_codectx_t *ctx)
                                                       ctx->argDepth));
     builder.CreateStore(v, froot);
     ctx->argDepth++;
-    //if (ctx->argDepth > ctx->maxDepth)
-    //    ctx->maxDepth = ctx->argDepth;
+    if (ctx->argDepth > ctx->maxDepth)
+        ctx->maxDepth = ctx->argDepth;
+}
+
+// --- safepoints ---
+
+// with jl_compile_safepoints set, loops poll jl_yield_pending on every
+// backedge and functions poll it on entry, calling jl_safepoint (which may
+// switch tasks) when it is set.
+
+static void emit_safepoint(jl_codectx_t *ctx)
+{
+    Value *flag = builder.CreateLoad(jlyieldpending_var, true);
+    BasicBlock *pollBB = BasicBlock::Create(getGlobalContext(), "safepoint",
+                                            ctx->f);
+    BasicBlock *contBB = BasicBlock::Create(getGlobalContext(), "cont",
+                                            ctx->f);
+    builder.CreateCondBr(builder.CreateICmpNE(flag, ConstantInt::get(T_int32,0)),
+                         pollBB, contBB);
+    builder.SetInsertPoint(pollBB);
+    builder.CreateCall(jlsafepoint_func);
+    builder.CreateBr(contBB);
+    builder.SetInsertPoint(contBB);
+}
+
+// address of a field of this thread's jl_tls_states_t, given its offset
+static Value *emit_tls_field(size_t offset, Type *T, jl_codectx_t *ctx)
+{
+    Value *p = builder.CreateConstGEP1_32(ctx->ptlsStates, offset);
+    return builder.CreateBitCast(p, PointerType::get(T, 0));
+}
+
+// the entry poll goes after the allocas but before the gc frame is set up,
+// where nothing of ours is live yet. it is added after the frame has been
+// finalized so it does not keep an otherwise unneeded frame alive.
+static void emit_entry_safepoint(jl_codectx_t *ctx)
+{
+    BasicBlock *entry = &ctx->f->getEntryBlock();
+    // the split goes right after the leading allocas. fixed-size allocas
+    // emitted later in the entry block are moved up into that prologue
+    // first, so nothing that runs before the poll ends up after it.
+    BasicBlock::iterator split = entry->begin();
+    while (split != entry->end() && isa<AllocaInst>(split))
+        ++split;
+    std::vector<AllocaInst*> late;
+    for(BasicBlock::iterator it = split; it != entry->end(); ++it) {
+        AllocaInst *ai = dyn_cast<AllocaInst>(it);
+        if (ai != NULL && isa<Constant>(ai->getArraySize()))
+            late.push_back(ai);
+    }
+    for(size_t i=0; i < late.size(); i++)
+        late[i]->moveBefore(split);
+    BasicBlock *body = entry->splitBasicBlock(split, "body");
+    entry->getTerminator()->eraseFromParent();
+    builder.SetInsertPoint(entry);
+    Value *flag = builder.CreateLoad(jlyieldpending_var, true);
+    BasicBlock *pollBB = BasicBlock::Create(getGlobalContext(), "safepoint",
+                                            ctx->f, body);
+    builder.CreateCondBr(builder.CreateICmpNE(flag, ConstantInt::get(T_int32,0)),
+                         pollBB, body);
+    builder.SetInsertPoint(pollBB);
+    builder.CreateCall(jlsafepoint_func);
+    builder.CreateBr(body);
+}
+
+// --- gc root slot assignment ---
+
+typedef std::map<jl_sym_t*, std::pair<int,int> > var_ranges_t;
+
+// record the first and last statement mentioning each variable
+static void find_var_ranges(jl_value_t *e, int stmt, var_ranges_t &ranges)
+{
+    if (jl_is_symbolnode(e))
+        e = (jl_value_t*)jl_symbolnode_sym(e);
+    if (jl_is_symbol(e)) {
+        var_ranges_t::iterator it = ranges.find((jl_sym_t*)e);
+        if (it == ranges.end())
+            ranges[(jl_sym_t*)e] = std::pair<int,int>(stmt, stmt);
+        else
+            (*it).second.second = stmt;
+    }
+    else if (jl_is_getfieldnode(e)) {
+        find_var_ranges(jl_fieldref(e,0), stmt, ranges);
+    }
+    else if (jl_is_expr(e)) {
+        jl_expr_t *ex = (jl_expr_t*)e;
+        for(size_t i=0; i < ex->args->length; i++)
+            find_var_ranges(jl_exprarg(ex,i), stmt, ranges);
+    }
+}
+
+static bool is_assignment_to(jl_value_t *stmt, jl_sym_t *s)
+{
+    if (!jl_is_expr(stmt) || ((jl_expr_t*)stmt)->head != assign_sym)
+        return false;
+    jl_value_t *lhs = jl_exprarg(stmt,0);
+    if (jl_is_symbolnode(lhs))
+        lhs = (jl_value_t*)jl_symbolnode_sym(lhs);
+    if (lhs != (jl_value_t*)s)
+        return false;
+    var_ranges_t rhs;
+    find_var_ranges(jl_exprarg(stmt,1), 0, rhs);
+    return rhs.find(s) == rhs.end();
+}
+
+// assign gc frame slots to boxed local variables. a variable whose live
+// range (extended over any jumps into it) begins with an assignment to it
+// is never read undefined, so variables with disjoint ranges can share a
+// slot. others get a slot of their own, initialized to null on entry.
+// returns the number of slots used.
+static int assign_local_roots(jl_array_t *lvars, jl_array_t *stmts,
+                              std::map<std::string,int> &slots,
+                              jl_codectx_t *ctx)
+{
+    size_t i;
+    var_ranges_t ranges;
+    std::map<int,int> labelpos;
+    for(i=0; i < stmts->length; i++) {
+        jl_value_t *st = jl_cellref(stmts,i);
+        if (jl_is_labelnode(st))
+            labelpos[jl_labelnode_label(st)] = i;
+        else
+            find_var_ranges(st, i, ranges);
+    }
+    std::vector<std::pair<int,int> > jumps;
+    for(i=0; i < stmts->length; i++) {
+        jl_value_t *st = jl_cellref(stmts,i);
+        if (jl_is_gotonode(st)) {
+            jumps.push_back(std::pair<int,int>(i, labelpos[jl_gotonode_label(st)]));
+        }
+        else if (jl_is_expr(st)) {
+            jl_expr_t *ex = (jl_expr_t*)st;
+            if (ex->head == goto_ifnot_sym)
+                jumps.push_back(std::pair<int,int>(i, labelpos[jl_unbox_long(jl_exprarg(ex,1))]));
+            else if (ex->head == enter_sym)
+                jumps.push_back(std::pair<int,int>(i, labelpos[jl_unbox_long(jl_exprarg(ex,0))]));
+        }
+    }
+
+    // (start, var index) of variables that can share, and the last
+    // statement of each shared slot's current occupant
+    std::vector<std::pair<int,int> > shared;
+    std::map<int,int> ends;
+    int nslots = 0;
+    for(i=0; i < lvars->length; i++) {
+        jl_sym_t *s = (jl_sym_t*)jl_cellref(lvars,i);
+        if (store_unboxed_p(s->name, ctx))
+            continue;
+        var_ranges_t::iterator it = ranges.find(s);
+        if (it != ranges.end() && !(*ctx->isCaptured)[s->name]) {
+            int start = (*it).second.first, end = (*it).second.second;
+            bool changed = true;
+            while (changed) {
+                changed = false;
+                for(size_t j=0; j < jumps.size(); j++) {
+                    int src = jumps[j].first, dst = jumps[j].second;
+                    if (dst > start && dst <= end) {
+                        if (src < start) { start = src; changed = true; }
+                        if (src > end) { end = src; changed = true; }
+                    }
+                }
+            }
+            if (is_assignment_to(jl_cellref(stmts,start), s)) {
+                shared.push_back(std::pair<int,int>(start, i));
+                (*it).second = std::pair<int,int>(start, end);
+                continue;
+            }
+        }
+        slots[s->name] = nslots++;
+    }
+    std::sort(shared.begin(), shared.end());
+    for(i=0; i < shared.size(); i++) {
+        jl_sym_t *s = (jl_sym_t*)jl_cellref(lvars, shared[i].second);
+        std::pair<int,int> r = ranges[s];
+        int slot = -1;
+        for(std::map<int,int>::iterator e = ends.begin(); e != ends.end(); e++) {
+            if ((*e).second < r.first) {
+                slot = (*e).first;
+                break;
+            }
+        }
+        if (slot == -1)
+            slot = nslots++;
+        ends[slot] = r.second;
+        slots[s->name] = slot;
+    }
+    return nslots;
+}
+
+// an instruction that might allocate, and therefore trigger a collection
+static bool may_gc(Instruction *I)
+{
+    CallInst *call = dyn_cast<CallInst>(I);
+    if (call == NULL)
+        return false;
+    Function *callee = call->getCalledFunction();
+    if (callee == jlgetptls_func)
+        return false;
+    return (callee == NULL || !callee->isIntrinsic());
+}
+
+// erase an instruction, along with operands it leaves unused
+static void erase_unused(Instruction *I)
+{
+    std::vector<Value*> ops(I->op_begin(), I->op_end());
+    I->eraseFromParent();
+    for(size_t i=0; i < ops.size(); i++) {
+        Instruction *op = dyn_cast<Instruction>(ops[i]);
+        if (op != NULL && op->use_empty() && !op->mayHaveSideEffects() &&
+            !isa<AllocaInst>(op))
+            erase_unused(op);
+    }
+}
+
+static int root_slot_index(Value *p, Value *roots)
+{
+    GetElementPtrInst *gep = dyn_cast<GetElementPtrInst>(p);
+    if (gep == NULL || gep->getPointerOperand() != roots ||
+        gep->getNumIndices() != 1)
+        return -1;
+    ConstantInt *idx = dyn_cast<ConstantInt>(gep->getOperand(1));
+    return idx ? (int)idx->getZExtValue() : -1;
+}
+
+// information about a function's gc frame, filled in as it is emitted
+typedef struct {
+    AllocaInst *roots;
+    AllocaInst *frame;
+    int argSpace;                        // temporaries estimated up front
+    StoreInst *sizeStore;                // sets the frame's root count
+    std::vector<StoreInst*> setup;       // builds and pushes the frame
+    std::vector<StoreInst*> nullInits;   // one per root slot
+    std::vector<StoreInst*> pops;
+} jl_gcframe_info_t;
+
+// shrink the temporary area to what was used, drop null initializations
+// of slots that are written before anything can allocate, and remove the
+// frame entirely from functions that cannot trigger a collection.
+static void finalize_gc_frame(jl_gcframe_info_t *fr, jl_codectx_t *ctx)
+{
+    size_t i;
+    int unused = fr->argSpace - ctx->maxDepth;
+    int nroots = dyn_cast<ConstantInt>(fr->roots->getArraySize())->getZExtValue();
+    if (unused > 0) {
+        for(i=0; i < fr->nullInits.size(); i++) {
+            int slot = root_slot_index(fr->nullInits[i]->getPointerOperand(), fr->roots);
+            if (slot >= ctx->maxDepth && slot < fr->argSpace) {
+                erase_unused(fr->nullInits[i]);
+                fr->nullInits.erase(fr->nullInits.begin()+i);
+                i--;
+            }
+        }
+        // move local variable slots down over the unused temporaries
+        std::vector<User*> users(fr->roots->use_begin(), fr->roots->use_end());
+        for(i=0; i < users.size(); i++) {
+            int slot = root_slot_index(users[i], fr->roots);
+            if (slot >= fr->argSpace)
+                users[i]->setOperand(1, ConstantInt::get(T_int32, slot-unused));
+        }
+        nroots -= unused;
+        fr->roots->setOperand(0, ConstantInt::get(T_int32, nroots));
+        fr->sizeStore->setOperand(0, ConstantInt::get(T_size, nroots));
+    }
+
+    bool needframe = false;
+    if (nroots > 0) {
+        for(Function::iterator bb = ctx->f->begin(); bb != ctx->f->end() && !needframe; bb++) {
+            for(BasicBlock::iterator I = bb->begin(); I != bb->end(); I++) {
+                if (may_gc(I)) {
+                    needframe = true;
+                    break;
+                }
+            }
+        }
+    }
+    if (!needframe) {
+        for(i=0; i < fr->pops.size(); i++)
+            erase_unused(fr->pops[i]);
+        for(i=0; i < fr->nullInits.size(); i++)
+            erase_unused(fr->nullInits[i]);
+        for(i=fr->setup.size(); i > 0; i--)
+            erase_unused(fr->setup[i-1]);
+        fr->frame->eraseFromParent();
+        if (fr->roots->use_empty())
+            fr->roots->eraseFromParent();
+        return;
+    }
+
+    // scan the straight-line code following the frame setup for slots
+    // that are stored to before the first possible allocation or read
+    std::set<int> written, needed;
+    std::set<BasicBlock*> visited;
+    StoreInst *last = fr->nullInits.empty() ? fr->setup.back() : fr->nullInits.back();
+    BasicBlock::iterator I = last;
+    BasicBlock *bb = last->getParent();
+    I++;
+    while (true) {
+        if (I == bb->end()) {
+            BranchInst *br = dyn_cast<BranchInst>(bb->getTerminator());
+            if (br == NULL || br->isConditional())
+                break;
+            bb = br->getSuccessor(0);
+            if (!visited.insert(bb).second)
+                break;
+            I = bb->begin();
+            continue;
+        }
+        Instruction *inst = I;
+        if (may_gc(inst))
+            break;
+        for(unsigned j=0; j < inst->getNumOperands(); j++) {
+            int slot = root_slot_index(inst->getOperand(j), fr->roots);
+            if (slot < 0 || written.find(slot) != written.end())
+                continue;
+            if (isa<StoreInst>(inst) && j == 1)
+                written.insert(slot);
+            else
+                needed.insert(slot);
+        }
+        I++;
+    }
+    for(i=0; i < fr->nullInits.size(); i++) {
+        int slot = root_slot_index(fr->nullInits[i]->getPointerOperand(), fr->roots);
+        if (written.find(slot) != written.end() &&
+            needed.find(slot) == needed.end())
+            erase_unused(fr->nullInits[i]);
+    }
 }
 
 // --- lambda ---
@@ -577,6 +1126,31 @@ static Value *emit_getfield(jl_value_t *expr, jl_sym_t *name, jl_codectx_t *ctx)
     return result;
 }
 
+// convert an unboxed value to a native argument or return type
+static Value *emit_native_value(Type *to, Value *x)
+{
+    Value *v = emit_unbox(to, PointerType::get(to,0), x);
+    // e.g. Bools held as int8
+    if (v->getType() != to && v->getType()->isIntegerTy() && to->isIntegerTy())
+        v = builder.CreateIntCast(v, to, false);
+    return v;
+}
+
+static Value *emit_specsig_call(Function *specf, jl_value_t **args,
+                                size_t nargs, jl_codectx_t *ctx)
+{
+    FunctionType *ft = specf->getFunctionType();
+    std::vector<Value*> argvals(0);
+    for(size_t i=0; i < nargs; i++) {
+        argvals.push_back(emit_native_value(ft->getParamType(i),
+                                            emit_unboxed(args[i+1], ctx)));
+    }
+    CallInst *call = builder.CreateCall(specf, ArrayRef<Value*>(argvals));
+    if (inlinable_functions.count(specf))
+        ctx->to_inline->push_back(call);
+    return mark_julia_type(call, specsig_rettypes[specf]);
+}
+
 static Value *emit_known_call(jl_value_t *ff, jl_value_t **args, size_t nargs,
                               jl_codectx_t *ctx,
                               Value **theFptr, Value **theF,
@@ -610,6 +1184,14 @@ static Value *emit_known_call(jl_value_t *ff, jl_value_t **args, size_t nargs,
                 f = jl_get_specialization(f, aty);
                 if (f != NULL) {
                     assert(f->linfo->functionObject != NULL);
+                    Function *specf = (Function*)f->linfo->specFunctionObject;
+                    if (specf != NULL &&
+                        specf->getFunctionType()->getNumParams() == nargs) {
+                        Value *result = emit_specsig_call(specf, args, nargs,
+                                                          ctx);
+                        JL_GC_POP();
+                        return result;
+                    }
                     *theFptr = (Value*)f->linfo->functionObject;
                     *theF = literal_pointer_val((jl_value_t*)f);
                 }
@@ -1106,7 +1688,7 @@ static Value *global_binding_pointer(jl_module_t *m, jl_sym_t *s,
     if (assign || b==NULL)
         b = jl_get_binding_wr(m, s);
     if (pbnd) *pbnd = b;
-    return literal_pointer_val(&b->value, jl_ppvalue_llvmt);
+    return binding_value_pointer(b);
 }
 
 // yields a jl_value_t** giving the binding location of a variable
@@ -1214,7 +1796,7 @@ static void emit_assignment(jl_value_t *l, jl_value_t *r, jl_codectx_t *ctx)
     Value *bp = var_binding_pointer(s, &bnd, true, ctx);
     if (bnd) {
         builder.CreateCall2(jlcheckassign_func,
-                            literal_pointer_val((void*)bnd),
+                            literal_pointer_val(bnd),
                             boxed(emit_expr(r, ctx, true)));
     }
     else {
@@ -1265,6 +1847,10 @@ static Value *emit_expr(jl_value_t *expr, jl_codectx_t *ctx, bool isboxed,
             int labelname = jl_gotonode_label(expr);
             BasicBlock *bb = (*ctx->labels)[labelname];
             assert(bb);
+            if (jl_compile_safepoints && bb->getParent() != NULL) {
+                // the label was already emitted, so this is a loop backedge
+                emit_safepoint(ctx);
+            }
             builder.CreateBr(bb);
             BasicBlock *after = BasicBlock::Create(getGlobalContext(), 
                                                    "br", ctx->f);
@@ -1282,7 +1868,7 @@ static Value *emit_expr(jl_value_t *expr, jl_codectx_t *ctx, bool isboxed,
         jl_binding_t *b = jl_get_binding(ctx->module, var);
         if (b == NULL)
             b = jl_get_binding_wr(ctx->module, var);
-        Value *bp = literal_pointer_val(&b->value, jl_ppvalue_llvmt);
+        Value *bp = binding_value_pointer(b);
         if ((b->constp && b->value!=NULL) ||
             (etype!=(jl_value_t*)jl_any_type &&
              !jl_subtype((jl_value_t*)jl_undef_type, etype, 0))) {
@@ -1374,7 +1960,7 @@ static Value *emit_expr(jl_value_t *expr, jl_codectx_t *ctx, bool isboxed,
         make_gcroot(boxed(a2), ctx);
         Value *a3 = emit_expr(args[3], ctx);
         make_gcroot(boxed(a3), ctx);
-        Value *mdargs[6] = { name, bp, literal_pointer_val((void*)bnd),
+        Value *mdargs[6] = { name, bp, literal_pointer_val(bnd),
                              a1, a2, a3 };
         builder.CreateCall(jlmethod_func, ArrayRef<Value*>(&mdargs[0], 6));
         ctx->argDepth = last_depth;
@@ -1386,7 +1972,7 @@ static Value *emit_expr(jl_value_t *expr, jl_codectx_t *ctx, bool isboxed,
         (void)var_binding_pointer(sym, &bnd, true, ctx);
         if (bnd) {
             builder.CreateCall(jldeclareconst_func,
-                               literal_pointer_val((void*)bnd));
+                               literal_pointer_val(bnd));
         }
     }
 
@@ -1435,7 +2021,9 @@ static Value *emit_expr(jl_value_t *expr, jl_codectx_t *ctx, bool isboxed,
         return builder.CreateCall(jlnew_func, typ);
     }
     else if (head == exc_sym) {
-        return builder.CreateLoad(jlexc_var, true);
+        return builder.CreateLoad(emit_tls_field(offsetof(jl_tls_states_t,
+                                                          exception_in_transit),
+                                                 jl_pvalue_llvmt, ctx), true);
     }
     else if (head == leave_sym) {
         assert(jl_is_long(args[0]));
@@ -1512,7 +2100,75 @@ extern "C" jl_tuple_t *jl_tuple_tvars_to_symbols(jl_tuple_t *t);
 //static int used_roots=0;
 //static int n_elim=0;
 
-static void emit_function(jl_lambda_info_t *lam, Function *f)
+// a method whose arguments and result are all native bits types gets a
+// function taking and returning them directly, without boxing.
+static Type *specsig_type(jl_value_t *jt, jl_codectx_t *ctx)
+{
+    if (!jl_is_bits_type(jt) || !jl_is_leaf_type(jt) ||
+        jt == (jl_value_t*)jl_intrinsic_type)
+        return NULL;
+    Type *t = julia_type_to_llvm(jt, ctx);
+    if (t == NULL || t == T_void || t->isPointerTy())
+        return NULL;
+    return t;
+}
+
+static Function *specsig_function(jl_lambda_info_t *lam, jl_array_t *largs,
+                                  jl_codectx_t *ctx)
+{
+    if (lam->specTypes == NULL || ctx->vaName != NULL ||
+        jl_lam_capt(ctx->ast)->length > 0)
+        return NULL;
+    jl_value_t *rt = jl_lam_body(ctx->ast)->etype;
+    Type *lrt = specsig_type(rt, ctx);
+    if (lrt == NULL)
+        return NULL;
+    std::vector<Type*> fsig(0);
+    for(size_t i=0; i < largs->length; i++) {
+        char *argname = jl_decl_var(jl_cellref(largs,i))->name;
+        if (!store_unboxed_p(argname, ctx))
+            return NULL;
+        Type *t = specsig_type((*ctx->declTypes)[argname], ctx);
+        if (t == NULL)
+            return NULL;
+        fsig.push_back(t);
+    }
+    std::string fname = lam->name->name;
+    if (imaging_mode)
+        fname = "julia_" + fname;
+    Function *f = Function::Create(FunctionType::get(lrt, fsig, false),
+                                   Function::ExternalLinkage, fname,
+                                   jl_Module);
+    if (imaging_mode)
+        julia_functions.insert(f);
+    specsig_rettypes[f] = rt;
+    return f;
+}
+
+// the generic entry point for a native-signature function
+static void emit_specsig_wrapper(Function *w, Function *sf)
+{
+    BasicBlock *b0 = BasicBlock::Create(jl_LLVMContext, "top", w);
+    builder.SetInsertPoint(b0);
+    builder.SetCurrentDebugLocation(DebugLoc());
+    Function::arg_iterator AI = w->arg_begin();
+    AI++;
+    Value *argArray = AI;
+    FunctionType *ft = sf->getFunctionType();
+    std::vector<Value*> args(0);
+    for(unsigned i=0; i < ft->getNumParams(); i++) {
+        Type *at = ft->getParamType(i);
+        Value *theArg =
+            builder.CreateLoad(builder.CreateGEP(argArray,
+                                                 ConstantInt::get(T_int32, i)),
+                               false);
+        args.push_back(emit_unbox(at, PointerType::get(at,0), theArg));
+    }
+    Value *r = builder.CreateCall(sf, ArrayRef<Value*>(args));
+    builder.CreateRet(boxed(mark_julia_type(r, specsig_rettypes[sf])));
+}
+
+static Function *emit_function(jl_lambda_info_t *lam, Function *f)
 {
     jl_expr_t *ast = (jl_expr_t*)lam->ast;
     jl_tuple_t *sparams = NULL;
@@ -1524,8 +2180,6 @@ static void emit_function(jl_lambda_info_t *lam, Function *f)
     sparams = jl_tuple_tvars_to_symbols(lam->sparams);
     //JL_PRINTF((jl_value_t*)ast);
     //JL_PRINTF(JL_STDOUT, "\n");
-    BasicBlock *b0 = BasicBlock::Create(jl_LLVMContext, "top", f);
-    builder.SetInsertPoint(b0);
     std::map<std::string, Value*> localVars;
     //std::map<std::string, Value*> argumentMap;
     std::map<std::string, Value*> passedArgumentMap;
@@ -1537,6 +2191,7 @@ static void emit_function(jl_lambda_info_t *lam, Function *f)
     std::map<int, BasicBlock*> labels;
     std::map<int, Value*> savestates;
     std::map<int, Value*> jmpbufs;
+    std::vector<CallInst*> to_inline;
     jl_array_t *largs = jl_lam_args(ast);
     jl_array_t *lvars = jl_lam_locals(ast);
     Function::arg_iterator AI = f->arg_begin();
@@ -1565,6 +2220,51 @@ static void emit_function(jl_lambda_info_t *lam, Function *f)
     ctx.funcName = lam->name->name;
     ctx.vaName = NULL;
     ctx.vaStack = false;
+    ctx.to_inline = &to_inline;
+
+    // process var-info lists to see what vars are captured, need boxing
+    size_t nreq = largs->length;
+    int va = 0;
+    if (nreq > 0 && jl_is_rest_arg(jl_cellref(largs,nreq-1))) {
+        nreq--;
+        va = 1;
+        ctx.vaName = jl_decl_var(jl_cellref(largs,nreq));
+    }
+    ctx.nReqArgs = nreq;
+
+    jl_array_t *vinfos = jl_lam_vinfo(ast);
+    size_t i;
+    for(i=0; i < vinfos->length; i++) {
+        jl_array_t *vi = (jl_array_t*)jl_cellref(vinfos, i);
+        assert(jl_is_array(vi));
+        char *vname = ((jl_sym_t*)jl_cellref(vi,0))->name;
+        isAssigned[vname] = (jl_vinfo_assigned(vi)!=0);
+        bool iscapt = (jl_vinfo_capt(vi)!=0);
+        isCaptured[vname] = iscapt;
+        escapes[vname] = iscapt;
+        declTypes[vname] = jl_cellref(vi,1);
+    }
+    vinfos = jl_lam_capt(ast);
+    for(i=0; i < vinfos->length; i++) {
+        jl_array_t *vi = (jl_array_t*)jl_cellref(vinfos, i);
+        assert(jl_is_array(vi));
+        char *vname = ((jl_sym_t*)jl_cellref(vi,0))->name;
+        closureEnv[vname] = i;
+        isAssigned[vname] = (jl_vinfo_assigned(vi)!=0);
+        isCaptured[vname] = true;
+        escapes[vname] = true;
+        declTypes[vname] = jl_cellref(vi,1);
+    }
+
+    // the body goes into a native-signature function if possible
+    Function *specf = specsig_function(lam, largs, &ctx);
+    if (specf != NULL) {
+        ctx.f = specf;
+        if (lam->specFunctionObject == NULL)
+            lam->specFunctionObject = (void*)specf;
+    }
+    BasicBlock *b0 = BasicBlock::Create(jl_LLVMContext, "top", ctx.f);
+    builder.SetInsertPoint(b0);
 
     // look for initial (line num filename) node
     jl_array_t *stmts = jl_lam_body(ast)->args;
@@ -1594,7 +2294,7 @@ static void emit_function(jl_lambda_info_t *lam, Function *f)
                                  0,
                                  dbuilder->createSubroutineType(fil,EltTypeArray),
                                  false, true,
-                                 0, true, f);
+                                 0, true, ctx.f);
     
     // set initial line number
     builder.SetCurrentDebugLocation(DebugLoc::get(lno, 0, (MDNode*)SP, NULL));
@@ -1611,39 +2311,6 @@ static void emit_function(jl_lambda_info_t *lam, Function *f)
                                                (uptrint_t)jl_stack_lo));
     error_unless(sp_ok, "stack overflow", &ctx);
     */
-    // process var-info lists to see what vars are captured, need boxing
-    size_t nreq = largs->length;
-    int va = 0;
-    if (nreq > 0 && jl_is_rest_arg(jl_cellref(largs,nreq-1))) {
-        nreq--;
-        va = 1;
-        ctx.vaName = jl_decl_var(jl_cellref(largs,nreq));
-    }
-    ctx.nReqArgs = nreq;
-
-    jl_array_t *vinfos = jl_lam_vinfo(ast);
-    size_t i;
-    for(i=0; i < vinfos->length; i++) {
-        jl_array_t *vi = (jl_array_t*)jl_cellref(vinfos, i);
-        assert(jl_is_array(vi));
-        char *vname = ((jl_sym_t*)jl_cellref(vi,0))->name;
-        isAssigned[vname] = (jl_vinfo_assigned(vi)!=0);
-        bool iscapt = (jl_vinfo_capt(vi)!=0);
-        isCaptured[vname] = iscapt;
-        escapes[vname] = iscapt;
-        declTypes[vname] = jl_cellref(vi,1);
-    }
-    vinfos = jl_lam_capt(ast);
-    for(i=0; i < vinfos->length; i++) {
-        jl_array_t *vi = (jl_array_t*)jl_cellref(vinfos, i);
-        assert(jl_is_array(vi));
-        char *vname = ((jl_sym_t*)jl_cellref(vi,0))->name;
-        closureEnv[vname] = i;
-        isAssigned[vname] = (jl_vinfo_assigned(vi)!=0);
-        isCaptured[vname] = true;
-        escapes[vname] = true;
-        declTypes[vname] = jl_cellref(vi,1);
-    }
 
     int n_roots = 0;
     // allocate local variables
@@ -1663,10 +2330,10 @@ static void emit_function(jl_lambda_info_t *lam, Function *f)
         if (store_unboxed_p(varname, &ctx)) {
             alloc_local(varname, &ctx);
         }
-        else {
-            n_roots++;
-        }
     }
+    std::map<std::string,int> localSlots;
+    int n_local_roots = assign_local_roots(lvars, stmts, localSlots, &ctx);
+    n_roots += n_local_roots;
 
     // fetch env out of function object if we need it
     if (vinfos->length > 0) {
@@ -1678,32 +2345,18 @@ static void emit_function(jl_lambda_info_t *lam, Function *f)
     n_roots += argdepth;
     //total_roots += n_roots;
     ctx.argDepth = 0;
-    //ctx.maxDepth = 0;
+    ctx.maxDepth = 0;
     ctx.argSpace = argdepth;
 #ifdef JL_GC_MARKSWEEP
-    AllocaInst *gcframe = NULL;
+    jl_gcframe_info_t gcframe;
+    gcframe.argSpace = argdepth;
 #endif
     if (n_roots > 0) {
         ctx.argTemp = builder.CreateAlloca(jl_pvalue_llvmt,
                                            ConstantInt::get(T_int32, n_roots));
 #ifdef JL_GC_MARKSWEEP
-        // create gc frame
-        gcframe = builder.CreateAlloca(T_gcframe, 0);
-        builder.CreateStore(builder.CreateBitCast(ctx.argTemp,
-                                                  PointerType::get(jl_ppvalue_llvmt,0)),
-                            builder.CreateConstGEP2_32(gcframe, 0, 0));
-        builder.CreateStore(ConstantInt::get(T_size, n_roots),
-                            builder.CreateConstGEP2_32(gcframe, 0, 1));
-        builder.CreateStore(ConstantInt::get(T_int32, 0),
-                            builder.CreateConstGEP2_32(gcframe, 0, 2));
-        builder.CreateStore(builder.CreateLoad(jlpgcstack_var, false),
-                            builder.CreateConstGEP2_32(gcframe, 0, 3));
-        builder.CreateStore(gcframe, jlpgcstack_var, false);
-        // initialize stack roots to null
-        for(i=0; i < (size_t)n_roots; i++) {
-            Value *argTempi = builder.CreateConstGEP1_32(ctx.argTemp,i);
-            builder.CreateStore(V_null, argTempi);
-        }
+        gcframe.roots = ctx.argTemp;
+        gcframe.frame = builder.CreateAlloca(T_gcframe, 0);
 #endif
     }
     else {
@@ -1729,22 +2382,14 @@ static void emit_function(jl_lambda_info_t *lam, Function *f)
         if (store_unboxed_p(argname, &ctx)) {
         }
         else {
-            Value *lv = builder.CreateConstGEP1_32(ctx.argTemp,varnum);
-            varnum++;
+            Value *lv = builder.CreateConstGEP1_32(ctx.argTemp,
+                                                   varnum+localSlots[argname]);
             localVars[argname] = lv;
         }
     }
+    varnum += n_local_roots;
     assert(varnum == n_roots);
 
-    // create boxes for boxed locals
-    for(i=0; i < lvars->length; i++) {
-        char *argname = ((jl_sym_t*)jl_cellref(lvars,i))->name;
-        if (isBoxed(argname, &ctx)) {
-            Value *lv = localVars[argname];
-            builder.CreateStore(builder.CreateCall(jlbox_func, V_null), lv);
-        }
-    }
-
     // allocate space for exception handler contexts
     for(i=0; i < stmts->length; i++) {
         jl_value_t *stmt = jl_cellref(stmts,i);
@@ -1763,6 +2408,9 @@ static void emit_function(jl_lambda_info_t *lam, Function *f)
         }
     }
 
+    // load the thread state pointer once; unused loads are deleted later
+    ctx.ptlsStates = builder.CreateCall(jlgetptls_func);
+
     // check arg count
     if (ctx.linfo->specTypes == NULL) {
         if (va) {
@@ -1797,9 +2445,44 @@ static void emit_function(jl_lambda_info_t *lam, Function *f)
         }
     }
 
+#ifdef JL_GC_MARKSWEEP
+    if (n_roots > 0) {
+        // create gc frame
+        Value *frame = gcframe.frame;
+        gcframe.setup.push_back(
+            builder.CreateStore(builder.CreateBitCast(ctx.argTemp,
+                                                      PointerType::get(jl_ppvalue_llvmt,0)),
+                                builder.CreateConstGEP2_32(frame, 0, 0)));
+        gcframe.sizeStore =
+            builder.CreateStore(ConstantInt::get(T_size, n_roots),
+                                builder.CreateConstGEP2_32(frame, 0, 1));
+        gcframe.setup.push_back(gcframe.sizeStore);
+        gcframe.setup.push_back(
+            builder.CreateStore(ConstantInt::get(T_int32, 0),
+                                builder.CreateConstGEP2_32(frame, 0, 2)));
+        Value *pgcstack = emit_tls_field(offsetof(jl_tls_states_t, pgcstack),
+                                         PointerType::get(T_gcframe,0), &ctx);
+        gcframe.setup.push_back(
+            builder.CreateStore(builder.CreateLoad(pgcstack, false),
+                                builder.CreateConstGEP2_32(frame, 0, 3)));
+        gcframe.setup.push_back(builder.CreateStore(frame, pgcstack, false));
+        // initialize stack roots to null
+        for(i=0; i < (size_t)n_roots; i++) {
+            Value *argTempi = builder.CreateConstGEP1_32(ctx.argTemp,i);
+            gcframe.nullInits.push_back(builder.CreateStore(V_null, argTempi));
+        }
+    }
+#endif
+
     // move args into local variables
+    Function::arg_iterator specArg = ctx.f->arg_begin();
     for(i=0; i < nreq; i++) {
         char *argname = jl_decl_var(jl_cellref(largs,i))->name;
+        if (specf != NULL) {
+            // native arguments always have unboxed slots
+            builder.CreateStore((Value*)specArg++, localVars[argname]);
+            continue;
+        }
         Value *argPtr = builder.CreateGEP((Value*)&argArray,
                                           ConstantInt::get(T_int32, i));
         Value *lv = localVars[argname];
@@ -1848,6 +2531,15 @@ static void emit_function(jl_lambda_info_t *lam, Function *f)
         }
     }
 
+    // create boxes for boxed locals
+    for(i=0; i < lvars->length; i++) {
+        char *argname = ((jl_sym_t*)jl_cellref(lvars,i))->name;
+        if (isBoxed(argname, &ctx)) {
+            Value *lv = localVars[argname];
+            builder.CreateStore(builder.CreateCall(jlbox_func, V_null), lv);
+        }
+    }
+
     // associate labels with basic blocks so forward jumps can be resolved
     BasicBlock *prev=NULL;
     for(i=0; i < stmts->length; i++) {
@@ -1890,12 +2582,22 @@ static void emit_function(jl_lambda_info_t *lam, Function *f)
         }
         if (jl_is_expr(stmt) && ((jl_expr_t*)stmt)->head == return_sym) {
             jl_expr_t *ex = (jl_expr_t*)stmt;
-            Value *retval = boxed(emit_expr(jl_exprarg(ex,0), &ctx, true));
+            Value *retval;
+            if (specf != NULL) {
+                retval = emit_native_value(specf->getReturnType(),
+                                           emit_unboxed(jl_exprarg(ex,0), &ctx));
+            }
+            else {
+                retval = boxed(emit_expr(jl_exprarg(ex,0), &ctx, true));
+            }
 #ifdef JL_GC_MARKSWEEP
             // JL_GC_POP();
             if (n_roots > 0) {
-                builder.CreateStore(builder.CreateLoad(builder.CreateConstGEP2_32(gcframe, 0, 3), false),
-                                    jlpgcstack_var);
+                gcframe.pops.push_back(
+                    builder.CreateStore(builder.CreateLoad(builder.CreateConstGEP2_32(gcframe.frame, 0, 3), false),
+                                        emit_tls_field(offsetof(jl_tls_states_t, pgcstack),
+                                                       PointerType::get(T_gcframe,0),
+                                                       &ctx)));
             }
 #endif
             builder.CreateRet(retval);
@@ -1911,10 +2613,26 @@ static void emit_function(jl_lambda_info_t *lam, Function *f)
     }
     // sometimes we have dangling labels after the end
     if (builder.GetInsertBlock()->getTerminator() == NULL) {
-        builder.CreateRet(V_null);
+        if (specf != NULL)
+            builder.CreateRet(UndefValue::get(specf->getReturnType()));
+        else
+            builder.CreateRet(V_null);
     }
-    //used_roots += ctx.maxDepth;
+    // inline calls to small native-signature functions
+    for(i=0; i < to_inline.size(); i++) {
+        InlineFunctionInfo info;
+        InlineFunction(to_inline[i], info);
+    }
+#ifdef JL_GC_MARKSWEEP
+    if (n_roots > 0)
+        finalize_gc_frame(&gcframe, &ctx);
+#endif
+    if (jl_compile_safepoints)
+        emit_entry_safepoint(&ctx);
+    if (specf != NULL)
+        emit_specsig_wrapper(f, specf);
     JL_GC_POP();
+    return specf;
 }
 
 // --- initialization ---
@@ -1999,19 +2717,11 @@ static void init_julia_llvm_env(Module *m)
         PointerType::getUnqual(gcfst) };
     gcfst->setBody(ArrayRef<Type*>(gcframeStructElts, 4));
     T_gcframe = gcfst;
-
-    jlpgcstack_var =
-        new GlobalVariable(*jl_Module, PointerType::get(T_gcframe,0),
-                           true, GlobalVariable::ExternalLinkage,
-                           NULL, "jl_pgcstack");
-    jl_ExecutionEngine->addGlobalMapping(jlpgcstack_var, (void*)&jl_pgcstack);
 #endif
 
     jltrue_var = global_to_llvm("jl_true", (void*)&jl_true);
     jlfalse_var = global_to_llvm("jl_false", (void*)&jl_false);
     jlnull_var = global_to_llvm("jl_null", (void*)&jl_null);
-    jlexc_var = global_to_llvm("jl_exception_in_transit",
-                               (void*)&jl_exception_in_transit);
     jldiverr_var = global_to_llvm("jl_divbyzero_exception",
                                   (void*)&jl_divbyzero_exception);
     jlundeferr_var = global_to_llvm("jl_undefref_exception",
@@ -2152,6 +2862,30 @@ static void init_julia_llvm_env(Module *m)
                          "jl_pop_handler", jl_Module);
     jl_ExecutionEngine->addGlobalMapping(jlleave_func, (void*)&jl_pop_handler);
 
+    jlsafepoint_func =
+        Function::Create(FunctionType::get(T_void, false),
+                         Function::ExternalLinkage,
+                         "jl_safepoint", jl_Module);
+    jl_ExecutionEngine->addGlobalMapping(jlsafepoint_func, (void*)&jl_safepoint);
+
+    // the result only depends on the calling thread, so repeated calls
+    // can be merged and unused ones deleted
+    jlgetptls_func =
+        Function::Create(FunctionType::get(T_pint8, false),
+                         Function::ExternalLinkage,
+                         "jl_get_ptls_states", jl_Module);
+    jlgetptls_func->setDoesNotAccessMemory();
+    jlgetptls_func->setDoesNotThrow();
+    jl_ExecutionEngine->addGlobalMapping(jlgetptls_func,
+                                         (void*)&jl_get_ptls_states);
+
+    jlyieldpending_var =
+        new GlobalVariable(*jl_Module, T_int32,
+                           false, GlobalVariable::ExternalLinkage,
+                           NULL, "jl_yield_pending");
+    jl_ExecutionEngine->addGlobalMapping(jlyieldpending_var,
+                                         (void*)&jl_yield_pending);
+
     std::vector<Type *> args_2vals(0);
     args_2vals.push_back(jl_pvalue_llvmt);
     args_2vals.push_back(jl_pvalue_llvmt);
@@ -2290,9 +3024,6 @@ extern "C" void jl_init_codegen(void)
     jl_ExecutionEngine->addGlobalMapping(value_to_pointer_func,
                                          (void*)&jl_value_to_pointer);
 
-    temp_arg_area = (char*)malloc(arg_area_sz);
-    arg_area_loc = 0;
-
     std::vector<Type*> noargs(0);
     save_arg_area_loc_func =
         Function::Create(FunctionType::get(T_uint64, noargs, false),
@@ -2307,6 +3038,12 @@ extern "C" void jl_init_codegen(void)
                          jl_Module);
     jl_ExecutionEngine->addGlobalMapping(restore_arg_area_loc_func,
                                          (void*)&restore_arg_area_loc);
+
+    if (jl_native_objfile != NULL) {
+        imaging_mode = true;
+        jl_sysimg_gvals = jl_alloc_cell_1d(0);
+        jl_sysimg_bvals = jl_alloc_cell_1d(0);
+    }
 }
 
 /*
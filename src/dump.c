@@ -2,6 +2,7 @@
   saving and restoring system images
 */
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <assert.h>
 #ifdef __WIN32__
@@ -39,6 +40,10 @@ void jl_idtable_rehash(jl_array_t **pa, size_t newsz);
 // queue of types to cache
 static jl_array_t *tagtype_list=NULL;
 
+// native code for the system image, if any
+static uv_lib_t *sysimg_handle=NULL;
+static jl_fptr_t *sysimg_fvars=NULL;
+
 #define write_uint8(s, n) ios_putc((n), (s))
 #define read_uint8(s) ((uint8_t)ios_getc(s))
 #define write_int8(s, n) write_uint8(s, n)
@@ -324,6 +329,7 @@ static void jl_serialize_value_(ios_t *s, jl_value_t *v)
         jl_serialize_value(s, (jl_value_t*)li->file);
         jl_serialize_value(s, (jl_value_t*)li->line);
         jl_serialize_value(s, (jl_value_t*)li->module);
+        write_int32(s, jl_assign_functionID(li->functionObject));
     }
     else if (jl_typeis(v, jl_module_type)) {
         jl_serialize_module(s, (jl_module_t*)v);
@@ -590,10 +596,14 @@ static jl_value_t *jl_deserialize_value(ios_t *s)
         li->file = jl_deserialize_value(s);
         li->line = jl_deserialize_value(s);
         li->module = (jl_module_t*)jl_deserialize_value(s);
+        int32_t cfunc_llvm = read_int32(s);
 
         li->fptr = &jl_trampoline;
+        if (cfunc_llvm > 0 && sysimg_fvars != NULL)
+            li->fptr = sysimg_fvars[cfunc_llvm-1];
         li->roots = NULL;
         li->functionObject = NULL;
+        li->specFunctionObject = NULL;
         li->inInference = 0;
         li->inCompile = 0;
         li->unspecialized = NULL;
@@ -677,6 +687,63 @@ static jl_value_t *jl_deserialize_value(ios_t *s)
     return NULL;
 }
 
+// --- native code ---
+
+#if defined(__APPLE__)
+#define NATIVE_IMAGE_EXT ".dylib"
+#elif defined(_WIN32)
+#define NATIVE_IMAGE_EXT ".dll"
+#else
+#define NATIVE_IMAGE_EXT ".so"
+#endif
+
+int jl_uv_dlopen(const char* filename, uv_lib_t* lib);
+void *jl_dlsym_e(uv_lib_t *handle, char *symbol);
+
+// native code for foo.ji is expected in the shared library foo.so, linked
+// from the object file written by jl_dump_objfile.
+static void jl_load_native_image(char *fname)
+{
+    char path[1024];
+    size_t len = strlen(fname);
+    if (len > 3 && strcmp(fname+len-3, ".ji") == 0)
+        len -= 3;
+    snprintf(path, sizeof(path), "%s%.*s%s",
+             strchr(fname, '/') ? "" : "./", (int)len, fname, NATIVE_IMAGE_EXT);
+    uv_lib_t *handle = (uv_lib_t*)malloc(sizeof(uv_lib_t));
+    if (jl_uv_dlopen(path, handle) != 0) {
+        JL_PRINTF(JL_STDERR,
+                  "Warning: could not load native code from %s\n", path);
+        free(handle);
+        return;
+    }
+    sysimg_fvars = (jl_fptr_t*)jl_dlsym_e(handle, "jl_sysimg_fvars");
+    if (sysimg_fvars == NULL) {
+        JL_PRINTF(JL_STDERR,
+                  "Warning: %s does not contain a native system image\n", path);
+        uv_dlclose(handle);
+        free(handle);
+        return;
+    }
+    sysimg_handle = handle;
+}
+
+// point the slots used by native code at the restored values and bindings
+static void jl_fill_slots(char *name, jl_array_t *vals, int stride)
+{
+    void ***slots = (void***)jl_dlsym(sysimg_handle, name);
+    for(size_t i=0; i < jl_array_len(vals)/stride; i++) {
+        if (stride == 1) {
+            *slots[i] = jl_cellref(vals, i);
+        }
+        else {
+            jl_module_t *m = (jl_module_t*)jl_cellref(vals, 2*i);
+            jl_sym_t *var = (jl_sym_t*)jl_cellref(vals, 2*i+1);
+            *slots[i] = jl_get_binding_wr(m, var);
+        }
+    }
+}
+
 // --- entry points ---
 
 DLLEXPORT
@@ -690,6 +757,11 @@ void jl_save_system_image(char *fname, char *startscriptname)
     ios_t f;
     ios_file(&f, fname, 1, 1, 1, 1);
 
+    // decide which functions go into the native image before assigning
+    // them ids during serialization
+    jl_prepare_native_image();
+    write_uint8(&f, jl_native_objfile != NULL);
+
     // orphan old Base module if present
     jl_base_module = (jl_module_t*)jl_get_global(jl_root_module, jl_symbol("Base"));
 
@@ -715,6 +787,9 @@ void jl_save_system_image(char *fname, char *startscriptname)
 
     jl_serialize_value(&f, jl_root_module);
 
+    jl_serialize_value(&f, jl_sysimg_gvals);
+    jl_serialize_value(&f, jl_sysimg_bvals);
+
     jl_serialize_value(&f, idtable_list);
 
     write_int32(&f, jl_get_t_uid_ctr());
@@ -728,6 +803,8 @@ void jl_save_system_image(char *fname, char *startscriptname)
     ios_putc(0, &f);
 
     ios_close(&f);
+    if (jl_native_objfile != NULL)
+        jl_dump_objfile(jl_native_objfile);
     if (en) jl_gc_enable();
 }
 
@@ -752,6 +829,9 @@ void jl_restore_system_image(char *fname)
 
     tagtype_list = jl_alloc_cell_1d(0);
 
+    if (read_uint8(&f))
+        jl_load_native_image(fname);
+
     jl_array_type->env = jl_deserialize_value(&f);
     
     jl_root_module = (jl_module_t*)jl_deserialize_value(&f);
@@ -761,6 +841,13 @@ void jl_restore_system_image(char *fname)
                                                  jl_symbol("Base"));
     jl_current_module = jl_base_module; // run start_image in Base
 
+    jl_sysimg_gvals = (jl_array_t*)jl_deserialize_value(&f);
+    jl_sysimg_bvals = (jl_array_t*)jl_deserialize_value(&f);
+    if (sysimg_handle != NULL) {
+        jl_fill_slots("jl_sysimg_gvars", jl_sysimg_gvals, 1);
+        jl_fill_slots("jl_sysimg_bvars", jl_sysimg_bvals, 2);
+    }
+
     jl_array_t *idtl = (jl_array_t*)jl_deserialize_value(&f);
     // rehash ObjectIdDicts
     for(int i=0; i < jl_array_len(idtl); i++) {
@@ -1022,3 +1109,845 @@ void jl_init_serializer(void)
         i += 1;
     }
 }
+
+// --- inter-process messages ---
+
+// worker messages use the format written by serialize() in
+// base/serialize.jl. base passes in its tag list and the functions to call
+// back; values whose serialize or deserialize method is not one of the
+// defaults are handed to julia, everything else is encoded here.
+// deserialization keeps the two phases of the julia version: a container
+// holding a thunk returned by a julia method becomes a thunk itself.
+
+jl_array_t *jl_eqtable_put(jl_array_t *h, void *key, void *val);
+jl_value_t *jl_eqtable_get(jl_array_t *h, void *key, jl_value_t *deflt);
+
+static htable_t msg_ser_tag;
+static jl_array_t *msg_tags=NULL;  // value of each tag, from tag 2
+static uint8_t msg_VALUE_TAGS;
+static uint8_t Symbol_tag, LongSymbol_mtag, Tuple_tag, LongTuple_mtag,
+    Expr_tag, LongExpr_mtag, Array_tag, AbstractKind_tag, BitsKind_tag,
+    CompositeKind_tag, NewSymbol_tag, SymbolRef_tag, NewType_tag,
+    TypeRef_tag, NewTypeObj_tag, TypeObjRef_tag, PackedArray_tag,
+    PackedTuple_tag;
+
+static jl_function_t *serialize_hook, *deserialize_hook, *read_hook,
+    *read_tuple_hook, *deferred_hook;
+static jl_value_t *msg_eof_error;
+
+// how values of a type are encoded, cached per type
+#define MSG_HOOK      2  // call back into julia
+#define MSG_ARRAY     3
+#define MSG_STRUCT    4  // fields one by one
+#define MSG_RAWSTRUCT 5  // fields as raw bits
+#define MSG_RAW       6  // raw bits
+static htable_t msg_ser_kind;
+static htable_t msg_deser_kind;
+static jl_function_t *ser_default, *ser_default_array;
+static jl_function_t *deser_default_struct, *deser_default_bits;
+static size_t msg_ndefs = 0;
+
+// fields of SerializationSession
+#define SES_TYPES  0
+#define SES_SYMS   1
+#define SES_NTYPES 2
+#define SES_NSYMS  3
+#define SES_RTYPES 4
+#define SES_RSYMS  5
+
+typedef struct {
+    jl_value_t *stream;   // the IOStream, for hooks
+    ios_t *s;
+    jl_value_t *session;  // SerializationSession, or nothing
+} msg_ctx_t;
+
+static uint8_t msg_tag(void *v)
+{
+    void *tag = ptrhash_get(&msg_ser_tag, v);
+    if (tag == HT_NOTFOUND)
+        jl_error("message serializer: missing tag");
+    return (uint8_t)(ptrint_t)tag;
+}
+
+DLLEXPORT
+void jl_init_msg_serializer(jl_array_t *tags, jl_tuple_t *dummies,
+                            jl_tuple_t *hooks)
+{
+    size_t i;
+    htable_new(&msg_ser_tag, 0);
+    htable_new(&msg_ser_kind, 0);
+    htable_new(&msg_deser_kind, 0);
+    for(i=0; i < jl_array_len(tags); i++)
+        ptrhash_put(&msg_ser_tag, jl_cellref(tags, i), (void*)(i+2));
+    msg_tags = tags;
+    msg_VALUE_TAGS = msg_tag(jl_null);
+
+    Symbol_tag        = msg_tag(jl_symbol_type);
+    Tuple_tag         = msg_tag(jl_tuple_type);
+    Expr_tag          = msg_tag(jl_expr_type);
+    Array_tag         = msg_tag(jl_array_type);
+    AbstractKind_tag  = msg_tag(jl_tag_kind);
+    BitsKind_tag      = msg_tag(jl_bits_kind);
+    CompositeKind_tag = msg_tag(jl_struct_kind);
+    LongSymbol_mtag   = msg_tag(jl_tupleref(dummies, 0));
+    LongTuple_mtag    = msg_tag(jl_tupleref(dummies, 1));
+    LongExpr_mtag     = msg_tag(jl_tupleref(dummies, 2));
+    NewSymbol_tag     = msg_tag(jl_tupleref(dummies, 3));
+    SymbolRef_tag     = msg_tag(jl_tupleref(dummies, 4));
+    NewType_tag       = msg_tag(jl_tupleref(dummies, 5));
+    TypeRef_tag       = msg_tag(jl_tupleref(dummies, 6));
+    NewTypeObj_tag    = msg_tag(jl_tupleref(dummies, 7));
+    TypeObjRef_tag    = msg_tag(jl_tupleref(dummies, 8));
+    PackedArray_tag   = msg_tag(jl_tupleref(dummies, 9));
+    PackedTuple_tag   = msg_tag(jl_tupleref(dummies, 10));
+
+    serialize_hook   = (jl_function_t*)jl_tupleref(hooks, 0);
+    deserialize_hook = (jl_function_t*)jl_tupleref(hooks, 1);
+    read_hook        = (jl_function_t*)jl_tupleref(hooks, 2);
+    read_tuple_hook  = (jl_function_t*)jl_tupleref(hooks, 3);
+    deferred_hook    = (jl_function_t*)jl_tupleref(hooks, 4);
+    msg_eof_error    = jl_tupleref(hooks, 5);
+    msg_ndefs = 0;
+}
+
+static size_t n_method_defs(jl_function_t *gf)
+{
+    size_t n = 0;
+    jl_methlist_t *ml = jl_gf_mtable(gf)->defs;
+    while (ml != JL_NULL) {
+        n++;
+        ml = ml->next;
+    }
+    return n;
+}
+
+static jl_function_t *msg_method(jl_function_t *gf, void *a, void *b)
+{
+    jl_tuple_t *tt = jl_tuple2(a, b);
+    JL_GC_PUSH(&tt);
+    jl_function_t *f = jl_method_def_lookup(jl_gf_mtable(gf), tt);
+    JL_GC_POP();
+    return f;
+}
+
+// the cached choices are redone when methods are added to serialize or
+// deserialize
+static void msg_check_methods(void)
+{
+    size_t n = n_method_defs(serialize_hook) + n_method_defs(deserialize_hook);
+    if (n == msg_ndefs)
+        return;
+    htable_reset(&msg_ser_kind, 32);
+    htable_reset(&msg_deser_kind, 32);
+    ser_default = msg_method(serialize_hook, jl_any_type, jl_any_type);
+    ser_default_array = msg_method(serialize_hook, jl_any_type,
+                                   jl_array_any_type);
+    deser_default_struct = msg_method(deserialize_hook, jl_any_type,
+                                      jl_struct_kind);
+    deser_default_bits = msg_method(deserialize_hook, jl_any_type,
+                                    jl_bits_kind);
+    msg_ndefs = n;
+}
+
+// bits types whose write() and read() are their raw bytes
+static int msg_is_raw(jl_value_t *t)
+{
+    return (t == (jl_value_t*)jl_int64_type || t == (jl_value_t*)jl_float64_type ||
+            t == (jl_value_t*)jl_int32_type || t == (jl_value_t*)jl_uint8_type ||
+            t == (jl_value_t*)jl_uint64_type || t == (jl_value_t*)jl_float32_type ||
+            t == (jl_value_t*)jl_uint32_type || t == (jl_value_t*)jl_int8_type ||
+            t == (jl_value_t*)jl_int16_type || t == (jl_value_t*)jl_uint16_type ||
+            t == (jl_value_t*)jl_bool_type);
+}
+
+static ptrint_t msg_struct_kind(jl_struct_type_t *st)
+{
+    size_t i, nf = jl_tuple_len(st->types);
+    for(i=0; i < nf; i++) {
+        if (!jl_is_bits_type(jl_tupleref(st->types, i)))
+            return MSG_STRUCT;
+    }
+    for(i=0; i < nf; i++) {
+        if (!msg_is_raw(jl_tupleref(st->types, i)))
+            return MSG_HOOK;
+    }
+    return nf == 0 ? MSG_STRUCT : MSG_RAWSTRUCT;
+}
+
+static ptrint_t msg_ser_kind_of(msg_ctx_t *c, jl_value_t *t)
+{
+    void *k = ptrhash_get(&msg_ser_kind, t);
+    if (k != HT_NOTFOUND)
+        return (ptrint_t)k;
+    ptrint_t kind = MSG_HOOK;
+    jl_function_t *f = msg_method(serialize_hook, jl_typeof(c->stream), t);
+    if (f == ser_default_array && jl_is_array_type(t)) {
+        kind = MSG_ARRAY;
+    }
+    else if (f == ser_default) {
+        if (jl_is_bits_type(t))
+            kind = msg_is_raw(t) ? MSG_RAW : MSG_HOOK;
+        else if (jl_is_struct_type(t))
+            kind = msg_struct_kind((jl_struct_type_t*)t);
+    }
+    ptrhash_put(&msg_ser_kind, t, (void*)kind);
+    return kind;
+}
+
+static ptrint_t msg_deser_kind_of(msg_ctx_t *c, jl_value_t *t)
+{
+    void *k = ptrhash_get(&msg_deser_kind, t);
+    if (k != HT_NOTFOUND)
+        return (ptrint_t)k;
+    ptrint_t kind = MSG_HOOK;
+    jl_value_t *tt = (jl_value_t*)jl_wrap_Type(t);
+    JL_GC_PUSH(&tt);
+    jl_function_t *f = msg_method(deserialize_hook, jl_typeof(c->stream), tt);
+    JL_GC_POP();
+    if (f == deser_default_struct && jl_is_struct_type(t))
+        kind = msg_struct_kind((jl_struct_type_t*)t);
+    else if (f == deser_default_bits && jl_is_bits_type(t))
+        kind = msg_is_raw(t) ? MSG_RAW : MSG_HOOK;
+    ptrhash_put(&msg_deser_kind, t, (void*)kind);
+    return kind;
+}
+
+// per-connection tables, see SerializationSession in base/serialize.jl
+
+static size_t session_get(jl_value_t *ses, int field, jl_value_t *v)
+{
+    jl_value_t *d = jl_fieldref(ses, field);
+    jl_value_t *id = jl_eqtable_get((jl_array_t*)jl_fieldref(d, 0), v, NULL);
+    return id == NULL ? 0 : jl_unbox_long(id);
+}
+
+static void session_put(jl_value_t *ses, int field, int nfield, jl_value_t *v)
+{
+    jl_value_t *d = jl_fieldref(ses, field);
+    jl_value_t *id = jl_box_long(jl_unbox_long(jl_fieldref(ses, nfield))+1);
+    JL_GC_PUSH(&id);
+    jl_fieldref(d, 0) =
+        (jl_value_t*)jl_eqtable_put((jl_array_t*)jl_fieldref(d, 0), v, id);
+    jl_fieldref(ses, nfield) = id;
+    JL_GC_POP();
+}
+
+static jl_value_t *session_ref(msg_ctx_t *c, int field, size_t id)
+{
+    if (c->session == jl_nothing)
+        jl_error("deserialize: table reference on a stream without a session");
+    jl_array_t *a = (jl_array_t*)jl_fieldref(c->session, field);
+    if (id < 1 || id > jl_array_len(a))
+        jl_error("deserialize: invalid table reference");
+    return jl_cellref(a, id-1);
+}
+
+static void session_push(msg_ctx_t *c, int field, jl_value_t *v)
+{
+    if (c->session == jl_nothing)
+        jl_error("deserialize: table definition on a stream without a session");
+    jl_cell_1d_push((jl_array_t*)jl_fieldref(c->session, field), v);
+}
+
+static void write_varint(ios_t *s, size_t n)
+{
+    while (n >= 0x80) {
+        write_uint8(s, (n & 0x7f) | 0x80);
+        n >>= 7;
+    }
+    write_uint8(s, n);
+}
+
+// --- serialize messages ---
+
+static void msg_serialize(msg_ctx_t *c, jl_value_t *v);
+
+static void msg_serialize_hook(msg_ctx_t *c, jl_value_t *v)
+{
+    jl_value_t *args[2] = { c->stream, v };
+    jl_apply(serialize_hook, args, 2);
+}
+
+static void msg_serialize_symbol(msg_ctx_t *c, jl_sym_t *sym)
+{
+    ios_t *s = c->s;
+    size_t l = strlen(sym->name);
+    if (c->session != jl_nothing) {
+        size_t id = session_get(c->session, SES_SYMS, (jl_value_t*)sym);
+        if (id > 0) {
+            write_uint8(s, SymbolRef_tag);
+            write_varint(s, id);
+            return;
+        }
+        session_put(c->session, SES_SYMS, SES_NSYMS, (jl_value_t*)sym);
+        write_uint8(s, NewSymbol_tag);
+        write_varint(s, l);
+    }
+    else if (l <= 255) {
+        write_uint8(s, Symbol_tag);
+        write_uint8(s, (uint8_t)l);
+    }
+    else {
+        write_uint8(s, LongSymbol_mtag);
+        write_int32(s, l);
+    }
+    ios_write(s, sym->name, l);
+}
+
+static void msg_serialize_type_data(msg_ctx_t *c, jl_value_t *t)
+{
+    jl_sym_t *name = ((jl_tag_type_t*)t)->name->name;
+    msg_serialize(c, (jl_value_t*)name);
+    if (jl_get_global(jl_current_module, name) == t)
+        msg_serialize(c, (jl_value_t*)jl_null);
+    else
+        msg_serialize(c, (jl_value_t*)((jl_tag_type_t*)t)->parameters);
+}
+
+// write t through the session's type table, using tag def if it is new
+static int msg_serialize_session_type(msg_ctx_t *c, jl_value_t *t,
+                                      uint8_t def, uint8_t ref)
+{
+    if (c->session == jl_nothing)
+        return 0;
+    size_t id = session_get(c->session, SES_TYPES, t);
+    if (id > 0) {
+        write_uint8(c->s, ref);
+        write_varint(c->s, id);
+    }
+    else {
+        write_uint8(c->s, def);
+        msg_serialize_type_data(c, t);
+        session_put(c->session, SES_TYPES, SES_NTYPES, t);
+    }
+    return 1;
+}
+
+// the type of an instance that follows
+static void msg_serialize_type_header(msg_ctx_t *c, jl_value_t *t)
+{
+    void *tag = ptrhash_get(&msg_ser_tag, t);
+    if (tag != HT_NOTFOUND) {
+        write_uint8(c->s, (uint8_t)(ptrint_t)tag);
+    }
+    else if (!msg_serialize_session_type(c, t, NewTypeObj_tag,
+                                         TypeObjRef_tag)) {
+        write_uint8(c->s, jl_is_bits_type(t) ? BitsKind_tag :
+                    CompositeKind_tag);
+        msg_serialize_type_data(c, t);
+    }
+}
+
+static void msg_serialize_tuple(msg_ctx_t *c, jl_tuple_t *t)
+{
+    ios_t *s = c->s;
+    size_t i, l = jl_tuple_len(t);
+    // short tuples of small integers are smaller with per-element tags
+    if (l >= 4 && l <= 255) {
+        jl_value_t *T = (jl_value_t*)jl_typeof(jl_tupleref(t, 0));
+        if (jl_is_bits_type(T)) {
+            for(i=1; i < l; i++) {
+                if ((jl_value_t*)jl_typeof(jl_tupleref(t, i)) != T)
+                    break;
+            }
+            if (i == l) {
+                if (!msg_is_raw(T)) {
+                    msg_serialize_hook(c, (jl_value_t*)t);
+                    return;
+                }
+                write_uint8(s, PackedTuple_tag);
+                write_uint8(s, (uint8_t)l);
+                msg_serialize(c, T);
+                size_t nb = jl_bitstype_nbits(T)/8;
+                for(i=0; i < l; i++)
+                    ios_write(s, (char*)jl_bits_data(jl_tupleref(t, i)), nb);
+                return;
+            }
+        }
+    }
+    if (l <= 255) {
+        write_uint8(s, Tuple_tag);
+        write_uint8(s, (uint8_t)l);
+    }
+    else {
+        write_uint8(s, LongTuple_mtag);
+        write_int32(s, l);
+    }
+    for(i=0; i < l; i++)
+        msg_serialize(c, jl_tupleref(t, i));
+}
+
+static void msg_serialize_array(msg_ctx_t *c, jl_array_t *a)
+{
+    ios_t *s = c->s;
+    jl_value_t *elty = jl_tparam0(jl_typeof(a));
+    size_t i, nd = jl_array_ndims(a);
+    if (jl_is_bits_type(elty)) {
+        write_uint8(s, PackedArray_tag);
+        msg_serialize(c, elty);
+        write_uint8(s, (uint8_t)nd);
+        for(i=0; i < nd; i++)
+            write_varint(s, jl_array_dim(a, i));
+        ios_write(s, (char*)jl_array_data(a), jl_array_len(a)*a->elsize);
+        return;
+    }
+    write_uint8(s, Array_tag);
+    msg_serialize(c, elty);
+    jl_tuple_t *dims = jl_alloc_tuple(nd);
+    JL_GC_PUSH(&dims);
+    for(i=0; i < nd; i++)
+        jl_tupleset(dims, i, jl_box_long(jl_array_dim(a, i)));
+    msg_serialize_tuple(c, dims);
+    JL_GC_POP();
+    for(i=0; i < jl_array_len(a); i++) {
+        jl_value_t *x = jl_cellref(a, i);
+        if (x == NULL)
+            jl_raise(jl_undefref_exception);
+        msg_serialize(c, x);
+    }
+}
+
+static void msg_serialize_expr(msg_ctx_t *c, jl_expr_t *e)
+{
+    size_t i, l = jl_array_len(e->args);
+    if (l <= 255) {
+        write_uint8(c->s, Expr_tag);
+        write_uint8(c->s, (uint8_t)l);
+    }
+    else {
+        write_uint8(c->s, LongExpr_mtag);
+        write_int32(c->s, l);
+    }
+    msg_serialize(c, (jl_value_t*)e->head);
+    msg_serialize(c, e->etype);
+    for(i=0; i < l; i++)
+        msg_serialize(c, jl_exprarg(e, i));
+}
+
+static void msg_serialize(msg_ctx_t *c, jl_value_t *v)
+{
+    ios_t *s = c->s;
+    jl_value_t *key = v;
+    if (jl_typeis(v, jl_long_type)) {
+        // small integers in the tag list are boxed values from the cache
+        long x = jl_unbox_long(v);
+        if (x >= 0 && x <= 32)
+            key = jl_box_long(x);
+    }
+    void *tag = ptrhash_get(&msg_ser_tag, key);
+    if (tag != HT_NOTFOUND) {
+        if ((ptrint_t)tag < msg_VALUE_TAGS)
+            write_uint8(s, 0);
+        write_uint8(s, (uint8_t)(ptrint_t)tag);
+        return;
+    }
+    if (jl_is_symbol(v)) {
+        msg_serialize_symbol(c, (jl_sym_t*)v);
+    }
+    else if (jl_is_tuple(v)) {
+        msg_serialize_tuple(c, (jl_tuple_t*)v);
+    }
+    else if (jl_is_some_tag_type(v)) {
+        if (!msg_serialize_session_type(c, v, NewType_tag, TypeRef_tag)) {
+            write_uint8(s, AbstractKind_tag);
+            msg_serialize_type_data(c, v);
+        }
+    }
+    else if (jl_is_expr(v)) {
+        msg_serialize_expr(c, (jl_expr_t*)v);
+    }
+    else {
+        jl_value_t *t = (jl_value_t*)jl_typeof(v);
+        size_t i, nf;
+        switch (msg_ser_kind_of(c, t)) {
+        case MSG_ARRAY:
+            msg_serialize_array(c, (jl_array_t*)v);
+            break;
+        case MSG_RAW:
+            msg_serialize_type_header(c, t);
+            ios_write(s, (char*)jl_bits_data(v), jl_bitstype_nbits(t)/8);
+            break;
+        case MSG_STRUCT:
+            msg_serialize_type_header(c, t);
+            nf = jl_tuple_len(((jl_struct_type_t*)t)->names);
+            for(i=0; i < nf; i++) {
+                jl_value_t *fld = ((jl_value_t**)v)[i+1];
+                if (fld == NULL)
+                    jl_raise(jl_undefref_exception);
+                msg_serialize(c, fld);
+            }
+            break;
+        case MSG_RAWSTRUCT:
+            msg_serialize_type_header(c, t);
+            nf = jl_tuple_len(((jl_struct_type_t*)t)->names);
+            for(i=0; i < nf; i++) {
+                jl_value_t *fld = ((jl_value_t**)v)[i+1];
+                ios_write(s, (char*)jl_bits_data(fld),
+                          jl_bitstype_nbits(jl_typeof(fld))/8);
+            }
+            break;
+        default:
+            msg_serialize_hook(c, v);
+        }
+    }
+}
+
+DLLEXPORT
+void jl_msg_serialize(jl_value_t *stream, ios_t *s, jl_value_t *session,
+                      jl_value_t *v)
+{
+    if (msg_tags == NULL)
+        jl_error("message serializer not initialized");
+    msg_check_methods();
+    msg_ctx_t c = { stream, s, session };
+    msg_serialize(&c, v);
+}
+
+// --- deserialize messages ---
+
+static jl_value_t *msg_deserialize(msg_ctx_t *c);
+
+static uint8_t msg_read_uint8(msg_ctx_t *c)
+{
+    int b = ios_getc(c->s);
+    if (b == IOS_EOF)
+        jl_raise(msg_eof_error);
+    return (uint8_t)b;
+}
+
+static void msg_read(msg_ctx_t *c, void *dest, size_t n)
+{
+    if (ios_readall(c->s, (char*)dest, n) < n)
+        jl_raise(msg_eof_error);
+}
+
+static int32_t msg_read_int32(msg_ctx_t *c)
+{
+    int b0 = msg_read_uint8(c);
+    int b1 = msg_read_uint8(c);
+    int b2 = msg_read_uint8(c);
+    int b3 = msg_read_uint8(c);
+    return b0 | (b1<<8) | (b2<<16) | (b3<<24);
+}
+
+static size_t msg_read_varint(msg_ctx_t *c)
+{
+    size_t n = 0;
+    int shift = 0;
+    while (1) {
+        uint8_t b = msg_read_uint8(c);
+        n |= (size_t)(b & 0x7f) << shift;
+        if (b < 0x80)
+            return n;
+        shift += 7;
+    }
+}
+
+static jl_value_t *msg_tag_value(uint8_t b)
+{
+    if (b < 2 || b-2 >= jl_array_len(msg_tags))
+        jl_errorf("deserialize: invalid tag %d", b);
+    return jl_cellref(msg_tags, b-2);
+}
+
+static int msg_is_thunk(jl_value_t *v)
+{
+    return jl_typeis(v, jl_function_type);
+}
+
+static jl_value_t *msg_force(jl_value_t *v)
+{
+    return msg_is_thunk(v) ? jl_apply((jl_function_t*)v, NULL, 0) : v;
+}
+
+static jl_value_t *msg_deferred(jl_value_t *a, jl_value_t *b)
+{
+    jl_value_t *args[2] = { a, b };
+    return jl_apply(deferred_hook, args, b == NULL ? 1 : 2);
+}
+
+static jl_value_t *msg_array_type(jl_value_t *elty, size_t nd)
+{
+    jl_tuple_t *p = jl_tuple2(elty, jl_box_long(nd));
+    JL_GC_PUSH(&p);
+    jl_value_t *at = jl_apply_type((jl_value_t*)jl_array_type, p);
+    JL_GC_POP();
+    return at;
+}
+
+static jl_value_t *msg_read_symbol(msg_ctx_t *c, size_t len)
+{
+    char buf[256];
+    char *name = len < sizeof(buf) ? buf : (char*)malloc(len+1);
+    msg_read(c, name, len);
+    name[len] = '\0';
+    jl_value_t *sym = (jl_value_t*)jl_symbol(name);
+    if (name != buf)
+        free(name);
+    return sym;
+}
+
+static jl_value_t *msg_deserialize_tuple(msg_ctx_t *c, size_t len)
+{
+    size_t i;
+    int thunks = 0;
+    jl_tuple_t *t = jl_alloc_tuple(len);
+    JL_GC_PUSH(&t);
+    for(i=0; i < len; i++) {
+        jl_value_t *x = msg_deserialize(c);
+        jl_tupleset(t, i, x);
+        thunks |= msg_is_thunk(x);
+    }
+    jl_value_t *v = thunks ? msg_deferred((jl_value_t*)t, NULL) : (jl_value_t*)t;
+    JL_GC_POP();
+    return v;
+}
+
+static jl_value_t *msg_deserialize_packed_tuple(msg_ctx_t *c)
+{
+    size_t i, len = msg_read_uint8(c);
+    jl_value_t *T = NULL, *v = NULL;
+    JL_GC_PUSH(&T, &v);
+    T = msg_force(msg_deserialize(c));
+    if (msg_is_raw(T)) {
+        size_t nb = jl_bitstype_nbits(T)/8;
+        int64_t buf;
+        v = (jl_value_t*)jl_alloc_tuple(len);
+        for(i=0; i < len; i++) {
+            msg_read(c, &buf, nb);
+            jl_tupleset(v, i, jl_new_bits((jl_bits_type_t*)T, &buf));
+        }
+    }
+    else {
+        v = jl_box_long(len);
+        jl_value_t *args[3] = { c->stream, T, v };
+        v = jl_apply(read_tuple_hook, args, 3);
+    }
+    JL_GC_POP();
+    return v;
+}
+
+static jl_value_t *msg_deserialize_packed_array(msg_ctx_t *c)
+{
+    size_t i, nd;
+    jl_value_t *elty = NULL, *dims = NULL, *v = NULL;
+    JL_GC_PUSH(&elty, &dims, &v);
+    elty = msg_force(msg_deserialize(c));
+    nd = msg_read_uint8(c);
+    dims = (jl_value_t*)jl_alloc_tuple(nd);
+    for(i=0; i < nd; i++)
+        jl_tupleset(dims, i, jl_box_long(msg_read_varint(c)));
+    if (msg_is_raw(elty)) {
+        v = msg_array_type(elty, nd);
+        v = (jl_value_t*)jl_new_array((jl_type_t*)v, (jl_tuple_t*)dims);
+        msg_read(c, jl_array_data(v),
+                 jl_array_len(v)*((jl_array_t*)v)->elsize);
+    }
+    else {
+        jl_value_t *args[3] = { c->stream, elty, dims };
+        v = jl_apply(read_hook, args, 3);
+    }
+    JL_GC_POP();
+    return v;
+}
+
+static jl_value_t *msg_deserialize_array(msg_ctx_t *c)
+{
+    size_t i, n;
+    int thunks = 0;
+    jl_value_t *elty = NULL, *dims = NULL, *temp = NULL, *v = NULL;
+    JL_GC_PUSH(&elty, &dims, &temp, &v);
+    elty = msg_force(msg_deserialize(c));
+    dims = msg_force(msg_deserialize(c));
+    if (!jl_is_tuple(dims))
+        jl_error("deserialize: invalid array dimensions");
+    v = msg_array_type((jl_value_t*)jl_any_type, jl_tuple_len(dims));
+    temp = (jl_value_t*)jl_new_array((jl_type_t*)v, (jl_tuple_t*)dims);
+    n = jl_array_len(temp);
+    for(i=0; i < n; i++) {
+        jl_value_t *x = msg_deserialize(c);
+        jl_cellset(temp, i, x);
+        thunks |= msg_is_thunk(x);
+    }
+    if (thunks) {
+        v = msg_deferred(elty, temp);
+    }
+    else if (elty == (jl_value_t*)jl_any_type) {
+        v = temp;
+    }
+    else {
+        v = msg_array_type(elty, jl_tuple_len(dims));
+        v = (jl_value_t*)jl_new_array((jl_type_t*)v, (jl_tuple_t*)dims);
+        for(i=0; i < n; i++)
+            jl_arrayset((jl_array_t*)v, i, jl_cellref(temp, i));
+    }
+    JL_GC_POP();
+    return v;
+}
+
+static jl_value_t *msg_deserialize_expr(msg_ctx_t *c, size_t len)
+{
+    size_t i;
+    jl_value_t *head = NULL, *ty = NULL, *e = NULL;
+    JL_GC_PUSH(&head, &ty, &e);
+    head = msg_deserialize(c);
+    if (!jl_is_symbol(head))
+        jl_error("deserialize: expression head is not a symbol");
+    ty = msg_deserialize(c);
+    int thunks = msg_is_thunk(ty);
+    e = (jl_value_t*)jl_exprn((jl_sym_t*)head, len);
+    ((jl_expr_t*)e)->etype = ty;
+    for(i=0; i < len; i++) {
+        jl_value_t *x = msg_deserialize(c);
+        jl_cellset(((jl_expr_t*)e)->args, i, x);
+        thunks |= msg_is_thunk(x);
+    }
+    if (thunks)
+        e = msg_deferred(e, NULL);
+    JL_GC_POP();
+    return e;
+}
+
+static jl_value_t *msg_deserialize_type_data(msg_ctx_t *c)
+{
+    jl_value_t *name = NULL, *params = NULL;
+    JL_GC_PUSH(&name, &params);
+    name = msg_deserialize(c);
+    if (!jl_is_symbol(name))
+        jl_error("deserialize: type name is not a symbol");
+    params = msg_force(msg_deserialize(c));
+    // resolved where eval(name) would be, like deserialize() in serialize.jl
+    jl_value_t *ty = jl_get_global(jl_current_module, (jl_sym_t*)name);
+    if (ty == NULL)
+        jl_errorf("%s not defined", ((jl_sym_t*)name)->name);
+    if (!jl_is_tuple(params))
+        jl_error("deserialize: invalid type parameters");
+    if (params != (jl_value_t*)jl_null)
+        ty = jl_apply_type(ty, (jl_tuple_t*)params);
+    JL_GC_POP();
+    return ty;
+}
+
+static jl_value_t *msg_deserialize_session_type(msg_ctx_t *c)
+{
+    jl_value_t *t = msg_deserialize_type_data(c);
+    JL_GC_PUSH(&t);
+    session_push(c, SES_RTYPES, t);
+    JL_GC_POP();
+    return t;
+}
+
+static jl_value_t *msg_deserialize_instance(msg_ctx_t *c, jl_value_t *t)
+{
+    size_t i, nf;
+    jl_value_t *v = NULL, *f = NULL;
+    int64_t buf;
+    if (!jl_is_some_tag_type(t))
+        goto hook;
+    switch (msg_deser_kind_of(c, t)) {
+    case MSG_RAW:
+        msg_read(c, &buf, jl_bitstype_nbits(t)/8);
+        return jl_new_bits((jl_bits_type_t*)t, &buf);
+    case MSG_RAWSTRUCT: {
+        nf = jl_tuple_len(((jl_struct_type_t*)t)->names);
+        v = jl_new_struct_uninit((jl_struct_type_t*)t);
+        JL_GC_PUSH(&v);
+        for(i=0; i < nf; i++) {
+            jl_value_t *ft = jl_tupleref(((jl_struct_type_t*)t)->types, i);
+            msg_read(c, &buf, jl_bitstype_nbits(ft)/8);
+            ((jl_value_t**)v)[i+1] = jl_new_bits((jl_bits_type_t*)ft, &buf);
+        }
+        JL_GC_POP();
+        return v;
+    }
+    case MSG_STRUCT: {
+        nf = jl_tuple_len(((jl_struct_type_t*)t)->names);
+        if (nf == 0)
+            return jl_new_struct_uninit((jl_struct_type_t*)t);
+        int thunks = 0;
+        JL_GC_PUSH(&v, &f);
+        f = (jl_value_t*)jl_alloc_tuple(nf);
+        for(i=0; i < nf; i++) {
+            jl_value_t *x = msg_deserialize(c);
+            jl_tupleset(f, i, x);
+            thunks |= msg_is_thunk(x);
+        }
+        if (thunks)
+            v = msg_deferred(t, f);
+        else
+            v = jl_new_structt((jl_struct_type_t*)t, (jl_tuple_t*)f);
+        JL_GC_POP();
+        return v;
+    }
+    }
+ hook:
+    {
+        jl_value_t *args[2] = { c->stream, t };
+        return jl_apply(deserialize_hook, args, 2);
+    }
+}
+
+static jl_value_t *msg_deserialize(msg_ctx_t *c)
+{
+    uint8_t b = msg_read_uint8(c);
+    if (b == 0)
+        return msg_tag_value(msg_read_uint8(c));
+    if (b >= msg_VALUE_TAGS)
+        return msg_tag_value(b);
+    if (b == Symbol_tag)
+        return msg_read_symbol(c, msg_read_uint8(c));
+    if (b == LongSymbol_mtag)
+        return msg_read_symbol(c, msg_read_int32(c));
+    if (b == NewSymbol_tag) {
+        jl_value_t *sym = msg_read_symbol(c, msg_read_varint(c));
+        session_push(c, SES_RSYMS, sym);
+        return sym;
+    }
+    if (b == SymbolRef_tag)
+        return session_ref(c, SES_RSYMS, msg_read_varint(c));
+    if (b == Tuple_tag)
+        return msg_deserialize_tuple(c, msg_read_uint8(c));
+    if (b == LongTuple_mtag)
+        return msg_deserialize_tuple(c, msg_read_int32(c));
+    if (b == PackedTuple_tag)
+        return msg_deserialize_packed_tuple(c);
+    if (b == Array_tag)
+        return msg_deserialize_array(c);
+    if (b == PackedArray_tag)
+        return msg_deserialize_packed_array(c);
+    if (b == Expr_tag)
+        return msg_deserialize_expr(c, msg_read_uint8(c));
+    if (b == LongExpr_mtag)
+        return msg_deserialize_expr(c, msg_read_int32(c));
+    if (b == AbstractKind_tag)
+        return msg_deserialize_type_data(c);
+    if (b == NewType_tag)
+        return msg_deserialize_session_type(c);
+    if (b == TypeRef_tag)
+        return session_ref(c, SES_RTYPES, msg_read_varint(c));
+
+    jl_value_t *t;
+    if (b == BitsKind_tag || b == CompositeKind_tag)
+        t = msg_deserialize_type_data(c);
+    else if (b == NewTypeObj_tag)
+        t = msg_deserialize_session_type(c);
+    else if (b == TypeObjRef_tag)
+        t = session_ref(c, SES_RTYPES, msg_read_varint(c));
+    else
+        t = msg_tag_value(b);
+    JL_GC_PUSH(&t);
+    jl_value_t *v = msg_deserialize_instance(c, t);
+    JL_GC_POP();
+    return v;
+}
+
+DLLEXPORT
+jl_value_t *jl_msg_deserialize(jl_value_t *stream, ios_t *s,
+                               jl_value_t *session)
+{
+    if (msg_tags == NULL)
+        jl_error("message serializer not initialized");
+    msg_check_methods();
+    msg_ctx_t c = { stream, s, session };
+    return msg_deserialize(&c);
+}
@@ -546,13 +546,20 @@ static void gc_markval_(jl_value_t *v)
         if (ta->result)
             GC_Markval(ta->result);
         GC_Markval(ta->state.eh_task);
+        // the live gc stack of a task running on some thread is in that
+        // thread's state
+        jl_tls_states_t *running = NULL;
+        for(int i=0; i < jl_n_tls_states; i++) {
+            if (jl_all_tls_states[i]->current_task == ta)
+                running = jl_all_tls_states[i];
+        }
+#ifdef COPY_STACKS
         if (ta->stkbuf != NULL)
             gc_setmark_buf(ta->stkbuf);
-#ifdef COPY_STACKS
         ptrint_t offset;
-        if (ta == jl_current_task) {
+        if (running != NULL) {
             offset = 0;
-            gc_mark_stack(jl_pgcstack, offset);
+            gc_mark_stack(running->pgcstack, offset);
         }
         else {
             offset = ta->stkbuf - (ta->stackbase-ta->ssize);
@@ -566,7 +573,7 @@ static void gc_markval_(jl_value_t *v)
                 ss = (jl_savestate_t*)((char*)ss + offset);
         }
 #else
-        gc_mark_stack(ta->state.gcstack, 0);
+        gc_mark_stack(running != NULL ? running->pgcstack : ta->state.gcstack, 0);
         jl_savestate_t *ss = &ta->state;
         while (ss != NULL) {
             GC_Markval(ss->ostream_obj);
@@ -599,7 +606,8 @@ static void gc_markval_(jl_value_t *v)
 
 void jl_mark_box_caches(void);
 
-extern jl_value_t * volatile jl_task_arg_in_transit;
+static void gc_mark_root(jl_value_t *v) { GC_Markval(v); }
+
 #ifdef GCTIME
 double clock_now(void);
 #endif
@@ -608,9 +616,14 @@ static void gc_mark(void)
 {
     // mark all roots
 
-    // active tasks
-    GC_Markval(jl_root_task);
-    GC_Markval(jl_current_task);
+    // active tasks, and values in transit on each thread
+    for(int i=0; i < jl_n_tls_states; i++) {
+        jl_tls_states_t *ptls = jl_all_tls_states[i];
+        GC_Markval(ptls->root_task);
+        GC_Markval(ptls->current_task);
+        GC_Markval(ptls->exception_in_transit);
+        GC_Markval(ptls->task_arg_in_transit);
+    }
 
     // modules
     GC_Markval(jl_root_module);
@@ -618,12 +631,14 @@ static void gc_mark(void)
 
     // invisible builtin values
     if (jl_an_empty_cell) GC_Markval(jl_an_empty_cell);
-    GC_Markval(jl_exception_in_transit);
-    GC_Markval(jl_task_arg_in_transit);
     GC_Markval(jl_unprotect_stack_func);
     GC_Markval(jl_bottom_func);
     GC_Markval(jl_typetype_type);
 
+    // values referenced by native code in the system image
+    if (jl_sysimg_gvals) GC_Markval(jl_sysimg_gvals);
+    if (jl_sysimg_bvals) GC_Markval(jl_sysimg_bvals);
+
     // constants
     GC_Markval(jl_null);
     GC_Markval(jl_true);
@@ -631,6 +646,9 @@ static void gc_mark(void)
 
     jl_mark_box_caches();
 
+    // values of native thread pool work
+    jl_threadpool_mark(gc_mark_root);
+
     size_t i;
 
     // stuff randomly preserved
@@ -708,6 +726,7 @@ void jl_gc_collect(void)
         JL_PRINTF(JL_STDERR, "sweep time %.3f ms\n", (clock_now()-t0)*1000);
 #endif
         run_finalizers();
+        jl_trim_stack_pool();
         JL_SIGATOMIC_END();
 #ifdef OBJPROFILE
         print_obj_profile();
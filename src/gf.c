@@ -850,6 +850,13 @@ static jl_function_t *jl_mt_assoc_by_type(jl_methtable_t *mt, jl_tuple_t *tt, in
     return nf;
 }
 
+// the method definition a call with argument types tt dispatches to,
+// without specializing or caching it
+jl_function_t *jl_method_def_lookup(jl_methtable_t *mt, jl_tuple_t *tt)
+{
+    return jl_mt_assoc_by_type(mt, tt, 0);
+}
+
 jl_tag_type_t *jl_wrap_Type(jl_value_t *t);
 
 static int sigs_eq(jl_value_t *a, jl_value_t *b)
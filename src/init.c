@@ -30,6 +30,9 @@
 #endif
 
 int jl_boot_file_loaded = 0;
+// if set, generated code is also written to this object file when the
+// system image is saved
+char *jl_native_objfile = NULL;
 
 char *jl_stack_lo;
 char *jl_stack_hi;
@@ -119,7 +122,6 @@ uv_lib_t *jl_dl_handle;
 
 #ifdef COPY_STACKS
 void jl_switch_stack(jl_task_t *t, jmp_buf *where);
-extern jmp_buf * volatile jl_jmp_target;
 #endif
 
 void julia_init(char *imageFile)
@@ -147,6 +149,7 @@ void julia_init(char *imageFile)
     jl_init_frontend();
     jl_init_types();
     jl_init_tasks(jl_stack_lo, jl_stack_hi-jl_stack_lo);
+    jl_init_event_loop();
     jl_init_codegen();
     jl_an_empty_cell = (jl_value_t*)jl_alloc_cell_1d(0);
 
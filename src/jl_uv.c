@@ -0,0 +1,473 @@
+/*
+  jl_uv.c
+  event loop: file descriptor readiness, timers and wakeups via libuv
+*/
+#include "julia.h"
+#include "uv.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#ifndef __WIN32__
+#include <poll.h>
+#endif
+
+// each watched descriptor has one uv_poll_t, watching for what the fd
+// handler (if any) and the tasks parked on it need. readiness is appended
+// to the ready list (for fd handlers) or the woken list (for parked tasks),
+// which the julia event loop drains after each pass; so dispatch costs
+// O(ready descriptors), not O(watched ones).
+
+typedef struct {
+    uv_poll_t *poll;
+    int handler;    // has a julia fd handler
+    int waiting;    // UV_READABLE/UV_WRITABLE events tasks are parked on
+} jl_fdwatch_t;
+
+static uv_loop_t *loop = NULL;
+static jl_fdwatch_t *watches = NULL;   // indexed by fd
+static int n_watches = 0;
+
+typedef struct {
+    int *fds;
+    int n;
+    int cap;
+} jl_fdlist_t;
+
+static jl_fdlist_t ready = {NULL, 0, 0};
+static jl_fdlist_t woken = {NULL, 0, 0};   // fd, events pairs
+// set when a list could not grow during a pass; raised once the pass is over
+static int events_oom = 0;
+
+static uv_timer_t timeout_timer;
+static uv_idle_t nowait_idle;
+static uv_async_t wakeup_async;
+
+static void jl_ios_wait(long fd, int writable);
+
+static void wakeup_cb(uv_async_t *handle, int status)
+{
+}
+
+void jl_init_event_loop(void)
+{
+    if (loop != NULL)
+        return;
+    loop = uv_default_loop();
+    uv_timer_init(loop, &timeout_timer);
+    uv_idle_init(loop, &nowait_idle);
+    uv_async_init(loop, &wakeup_async, wakeup_cb);
+    ios_wait_hook = jl_ios_wait;
+}
+
+DLLEXPORT uv_loop_t *jl_event_loop(void)
+{
+    return loop;
+}
+
+// make room for k more entries. polls are level-triggered, so an event
+// dropped for lack of memory is reported again on a later pass.
+static int fdlist_reserve(jl_fdlist_t *l, int k)
+{
+    if (l->n+k <= l->cap)
+        return 1;
+    int cap = l->cap ? 2*l->cap : 64;
+    int *fds = (int*)realloc(l->fds, cap*sizeof(int));
+    if (fds == NULL) {
+        events_oom = 1;
+        return 0;
+    }
+    l->fds = fds;
+    l->cap = cap;
+    return 1;
+}
+
+static void fdlist_push(jl_fdlist_t *l, int x)
+{
+    l->fds[l->n++] = x;
+}
+
+static void update_watch(int fd);
+
+static void poll_cb(uv_poll_t *handle, int status, int events)
+{
+    int fd = (int)(intptr_t)handle->data;
+    jl_fdwatch_t *w = &watches[fd];
+    if (w->handler && (events & UV_READABLE) && fdlist_reserve(&ready, 1))
+        fdlist_push(&ready, fd);
+    if ((w->waiting & events) && fdlist_reserve(&woken, 2)) {
+        fdlist_push(&woken, fd);
+        fdlist_push(&woken, w->waiting & events);
+        w->waiting &= ~events;
+        update_watch(fd);
+    }
+}
+
+static void close_cb(uv_handle_t *handle)
+{
+    free(handle);
+}
+
+static jl_fdwatch_t *get_watch(int fd)
+{
+    if (fd < 0)
+        jl_errorf("invalid descriptor %d", fd);
+    if (fd >= n_watches) {
+        int n = n_watches ? n_watches : 64;
+        while (n <= fd) n *= 2;
+        jl_fdwatch_t *nw = (jl_fdwatch_t*)realloc(watches, n*sizeof(jl_fdwatch_t));
+        if (nw == NULL)
+            jl_raise(jl_memory_exception);
+        watches = nw;
+        memset(&watches[n_watches], 0, (n-n_watches)*sizeof(jl_fdwatch_t));
+        n_watches = n;
+    }
+    return &watches[fd];
+}
+
+// start, change or stop the poller of fd to match what is wanted of it
+static void update_watch(int fd)
+{
+    jl_fdwatch_t *w = &watches[fd];
+    int events = (w->handler ? UV_READABLE : 0) | w->waiting;
+    if (events == 0) {
+        if (w->poll != NULL) {
+            uv_poll_stop(w->poll);
+            uv_close((uv_handle_t*)w->poll, close_cb);
+            w->poll = NULL;
+        }
+        return;
+    }
+    if (w->poll == NULL) {
+        uv_poll_t *p = (uv_poll_t*)malloc(sizeof(uv_poll_t));
+        if (p == NULL)
+            jl_raise(jl_memory_exception);
+        if (uv_poll_init(loop, p, fd) != 0) {
+            free(p);
+            w->handler = 0;
+            w->waiting = 0;
+            jl_errorf("could not watch descriptor %d", fd);
+        }
+        p->data = (void*)(intptr_t)fd;
+        w->poll = p;
+    }
+    uv_poll_start(w->poll, events, poll_cb);
+}
+
+DLLEXPORT void jl_poll_fd(int fd)
+{
+    jl_fdwatch_t *w = get_watch(fd);
+    if (w->handler)
+        return;
+    w->handler = 1;
+    update_watch(fd);
+}
+
+DLLEXPORT void jl_unpoll_fd(int fd)
+{
+    if (fd < 0 || fd >= n_watches || !watches[fd].handler)
+        return;
+    watches[fd].handler = 0;
+    update_watch(fd);
+    // drop readiness already reported for this descriptor
+    for(int i=0; i < ready.n; i++) {
+        if (ready.fds[i] == fd)
+            ready.fds[i] = -1;
+    }
+}
+
+// report the next time fd becomes readable (or writable) in the woken list
+DLLEXPORT void jl_wait_fd_once(int fd, int writable)
+{
+    jl_fdwatch_t *w = get_watch(fd);
+    w->waiting |= (writable ? UV_WRITABLE : UV_READABLE);
+    update_watch(fd);
+}
+
+static void timeout_cb(uv_timer_t *handle, int status)
+{
+}
+
+static void nowait_cb(uv_idle_t *handle, int status)
+{
+}
+
+// --- timers ---
+
+// pending timers are kept in a binary min-heap ordered by deadline, and
+// each timer knows its index in the heap, so starting, stopping and firing
+// one is O(log n). libuv only ever waits for the earliest deadline.
+// fired timers are reported by id in the fired list, which the julia event
+// loop drains like the ready list.
+
+struct _jl_timer_t {
+    double when;        // deadline, in seconds on the uv_hrtime clock
+    double interval;    // period of a repeating timer, or 0
+    int64_t id;
+    ssize_t idx;        // index in the heap, or -1 when not pending
+};
+
+static jl_timer_t **timer_heap = NULL;
+static size_t n_timers = 0;
+static size_t timer_heap_cap = 0;
+
+static int64_t *fired = NULL;
+static size_t n_fired = 0;
+static size_t fired_cap = 0;
+
+static double now_seconds(void)
+{
+    return uv_hrtime()*1e-9;
+}
+
+static void heap_set(size_t i, jl_timer_t *t)
+{
+    timer_heap[i] = t;
+    t->idx = i;
+}
+
+static void heap_up(size_t i)
+{
+    jl_timer_t *t = timer_heap[i];
+    while (i > 0) {
+        size_t parent = (i-1)/2;
+        if (timer_heap[parent]->when <= t->when)
+            break;
+        heap_set(i, timer_heap[parent]);
+        i = parent;
+    }
+    heap_set(i, t);
+}
+
+static void heap_down(size_t i)
+{
+    jl_timer_t *t = timer_heap[i];
+    while (1) {
+        size_t child = 2*i+1;
+        if (child >= n_timers)
+            break;
+        if (child+1 < n_timers &&
+            timer_heap[child+1]->when < timer_heap[child]->when)
+            child++;
+        if (t->when <= timer_heap[child]->when)
+            break;
+        heap_set(i, timer_heap[child]);
+        i = child;
+    }
+    heap_set(i, t);
+}
+
+static void heap_insert(jl_timer_t *t)
+{
+    if (n_timers == timer_heap_cap) {
+        size_t cap = timer_heap_cap ? 2*timer_heap_cap : 64;
+        jl_timer_t **h = (jl_timer_t**)realloc(timer_heap,
+                                               cap*sizeof(jl_timer_t*));
+        if (h == NULL)
+            jl_raise(jl_memory_exception);
+        timer_heap = h;
+        timer_heap_cap = cap;
+    }
+    heap_set(n_timers++, t);
+    heap_up(n_timers-1);
+}
+
+static void heap_remove(jl_timer_t *t)
+{
+    size_t i = t->idx;
+    t->idx = -1;
+    n_timers--;
+    if (i == n_timers)
+        return;
+    heap_set(i, timer_heap[n_timers]);
+    if (i > 0 && timer_heap[i]->when < timer_heap[(i-1)/2]->when)
+        heap_up(i);
+    else
+        heap_down(i);
+}
+
+DLLEXPORT jl_timer_t *jl_timer_new(int64_t id)
+{
+    jl_timer_t *t = (jl_timer_t*)malloc(sizeof(jl_timer_t));
+    if (t == NULL)
+        jl_error("Timer: out of memory");
+    t->when = 0;
+    t->interval = 0;
+    t->id = id;
+    t->idx = -1;
+    return t;
+}
+
+// fire t in delay seconds, then every interval seconds if interval > 0.
+// restarts t if it is already pending.
+DLLEXPORT void jl_timer_start(jl_timer_t *t, double delay, double interval)
+{
+    if (t->idx >= 0)
+        heap_remove(t);
+    t->when = now_seconds() + (delay > 0 ? delay : 0);
+    t->interval = interval > 0 ? interval : 0;
+    heap_insert(t);
+}
+
+DLLEXPORT void jl_timer_stop(jl_timer_t *t)
+{
+    if (t->idx >= 0)
+        heap_remove(t);
+}
+
+DLLEXPORT int jl_timer_pending(jl_timer_t *t)
+{
+    return t->idx >= 0;
+}
+
+DLLEXPORT void jl_timer_free(jl_timer_t *t)
+{
+    jl_timer_stop(t);
+    free(t);
+}
+
+static void fire_timers(void)
+{
+    double now = now_seconds();
+    while (n_timers > 0 && timer_heap[0]->when <= now) {
+        jl_timer_t *t = timer_heap[0];
+        if (n_fired == fired_cap) {
+            // timers left due stay in the heap and fire on a later pass
+            size_t cap = fired_cap ? 2*fired_cap : 64;
+            int64_t *f = (int64_t*)realloc(fired, cap*sizeof(int64_t));
+            if (f == NULL) {
+                events_oom = 1;
+                break;
+            }
+            fired = f;
+            fired_cap = cap;
+        }
+        fired[n_fired++] = t->id;
+        if (t->interval > 0) {
+            // keep a fixed rate, but skip ticks that were missed entirely
+            t->when += t->interval;
+            if (t->when <= now)
+                t->when = now + t->interval;
+            heap_down(0);
+        }
+        else {
+            heap_remove(t);
+        }
+    }
+}
+
+DLLEXPORT int jl_n_fired_timers(void)
+{
+    return n_fired;
+}
+
+DLLEXPORT int64_t jl_fired_timer(int i)
+{
+    assert(i >= 0 && (size_t)i < n_fired);
+    return fired[i];
+}
+
+// run one pass of the event loop, waiting at most timeout seconds (forever
+// if negative), and no longer than until the next timer is due, for
+// something to happen. returns the number of ready descriptors, which are
+// then read with jl_ready_fd; descriptors that parked tasks were waiting
+// for are read with jl_woken_fd, and timers that fired with jl_fired_timer.
+// a SIGINT arriving while we block interrupts the wait; it is delivered
+// once the loop is back in a consistent state.
+DLLEXPORT int jl_process_events(double timeout)
+{
+    ready.n = 0;
+    woken.n = 0;
+    n_fired = 0;
+    if (n_timers > 0) {
+        double due = timer_heap[0]->when - now_seconds();
+        if (due < 0)
+            due = 0;
+        if (timeout < 0 || due < timeout)
+            timeout = due;
+    }
+    if (timeout == 0)
+        uv_idle_start(&nowait_idle, nowait_cb);
+    else if (timeout > 0)
+        uv_timer_start(&timeout_timer, timeout_cb,
+                       (int64_t)ceil(timeout*1000), 0);
+    JL_SIGATOMIC_BEGIN();
+    uv_run_once(loop);
+    if (timeout == 0)
+        uv_idle_stop(&nowait_idle);
+    else if (timeout > 0)
+        uv_timer_stop(&timeout_timer);
+    fire_timers();
+    JL_SIGATOMIC_END();
+    if (events_oom) {
+        events_oom = 0;
+        jl_raise(jl_memory_exception);
+    }
+    return ready.n;
+}
+
+DLLEXPORT int jl_ready_fd(int i)
+{
+    assert(i >= 0 && i < ready.n);
+    return ready.fds[i];
+}
+
+DLLEXPORT int jl_n_woken_fds(void)
+{
+    return woken.n/2;
+}
+
+DLLEXPORT int jl_woken_fd(int i)
+{
+    assert(i >= 0 && 2*i < woken.n);
+    return woken.fds[2*i];
+}
+
+// which waits on the i'th woken descriptor ended: 1 readable, 2 writable
+DLLEXPORT int jl_woken_events(int i)
+{
+    assert(i >= 0 && 2*i < woken.n);
+    return ((woken.fds[2*i+1] & UV_READABLE) ? 1 : 0) |
+        ((woken.fds[2*i+1] & UV_WRITABLE) ? 2 : 0);
+}
+
+// make a blocked jl_process_events return. safe to call from any thread.
+DLLEXPORT void jl_wake_event_loop(void)
+{
+    uv_async_send(&wakeup_async);
+}
+
+// --- parking tasks on descriptors ---
+
+static jl_function_t *wait_fd_func = NULL;
+
+// ios_wait_hook: a read or write on a non-blocking descriptor would block.
+// Base._jl_wait_fd parks the current task until the event loop sees the
+// descriptor ready; if the task cannot be parked (it is not one the
+// scheduler resumes), block this thread in poll() instead.
+static void jl_ios_wait(long fd, int writable)
+{
+    if (wait_fd_func == NULL && jl_base_module != NULL) {
+        jl_value_t *f = jl_get_global(jl_base_module, jl_symbol("_jl_wait_fd"));
+        if (f != NULL && jl_is_function(f))
+            wait_fd_func = (jl_function_t*)f;
+    }
+    if (wait_fd_func != NULL) {
+        jl_value_t *args[2] = {NULL, NULL};
+        JL_GC_PUSH(&args[0], &args[1]);
+        args[0] = jl_box_int32((int32_t)fd);
+        args[1] = writable ? jl_true : jl_false;
+        jl_value_t *parked = jl_apply(wait_fd_func, args, 2);
+        JL_GC_POP();
+        if (parked == jl_true)
+            return;
+    }
+#ifndef __WIN32__
+    struct pollfd pfd;
+    pfd.fd = (int)fd;
+    pfd.events = writable ? POLLOUT : POLLIN;
+    pfd.revents = 0;
+    poll(&pfd, 1, -1);
+#endif
+}
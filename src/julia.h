@@ -165,6 +165,8 @@ typedef struct _jl_lambda_info_t {
     // hidden fields:
     jl_fptr_t fptr;
     void *functionObject;
+    // version of functionObject taking and returning native values, if any
+    void *specFunctionObject;
     // flag telling if inference is running on this function
     // used to avoid infinite recursion
     uptrint_t inInference : 1;
@@ -713,6 +715,7 @@ DLLEXPORT jl_value_t *jl_array_to_string(jl_array_t *a);
 DLLEXPORT jl_array_t *jl_alloc_cell_1d(size_t n);
 DLLEXPORT jl_value_t *jl_arrayref(jl_array_t *a, size_t i);  // 0-indexed
 DLLEXPORT void jl_arrayset(jl_array_t *a, size_t i, jl_value_t *v);  // 0-indexed
+DLLEXPORT void jl_arrayunset(jl_array_t *a, size_t i);
 DLLEXPORT void *jl_array_ptr(jl_array_t *a);
 DLLEXPORT void jl_array_grow_end(jl_array_t *a, size_t inc);
 DLLEXPORT void jl_array_del_end(jl_array_t *a, size_t dec);
@@ -764,11 +767,28 @@ void jl_init_primitives(void);
 void jl_init_codegen(void);
 void jl_init_intrinsic_functions(void);
 void jl_init_tasks(void *stack, size_t ssize);
+void jl_init_event_loop(void);
 void jl_init_serializer(void);
 
 void jl_save_system_image(char *fname, char *startscriptname);
 void jl_restore_system_image(char *fname);
 
+// inter-process messages
+DLLEXPORT void jl_init_msg_serializer(jl_array_t *tags, jl_tuple_t *dummies,
+                                      jl_tuple_t *hooks);
+DLLEXPORT void jl_msg_serialize(jl_value_t *stream, ios_t *s,
+                                jl_value_t *session, jl_value_t *v);
+DLLEXPORT jl_value_t *jl_msg_deserialize(jl_value_t *stream, ios_t *s,
+                                         jl_value_t *session);
+
+// ahead-of-time compilation of the system image
+extern DLLEXPORT char *jl_native_objfile;
+extern jl_array_t *jl_sysimg_gvals;
+extern jl_array_t *jl_sysimg_bvals;
+void jl_prepare_native_image(void);
+int32_t jl_assign_functionID(void *function);
+void jl_dump_objfile(char *fname);
+
 // front end interface
 DLLEXPORT jl_value_t *jl_parse_input_line(const char *str);
 void jl_start_parsing_file(const char *fname);
@@ -835,6 +855,7 @@ jl_lambda_info_t *jl_add_static_parameters(jl_lambda_info_t *l, jl_tuple_t *sp);
 jl_function_t *jl_method_lookup_by_type(jl_methtable_t *mt, jl_tuple_t *types,
                                         int cache);
 jl_function_t *jl_method_lookup(jl_methtable_t *mt, jl_value_t **args, size_t nargs, int cache);
+jl_function_t *jl_method_def_lookup(jl_methtable_t *mt, jl_tuple_t *tt);
 jl_value_t *jl_gf_invoke(jl_function_t *gf, jl_tuple_t *types,
                          jl_value_t **args, size_t nargs);
 
@@ -905,8 +926,6 @@ typedef struct _jl_gcframe_t {
 // jl_value_t *x, *y; JL_GC_PUSH(&x, &y);
 // x = f(); y = g(); foo(x, y)
 
-extern DLLEXPORT jl_gcframe_t *jl_pgcstack;
-
 #define JL_GC_PUSH(...)                                                 \
   void *__gc_rts[] = {__VA_ARGS__};                                     \
   jl_gcframe_t __gc_stkf_ = { (jl_value_t***)__gc_rts, VA_NARG(__VA_ARGS__), \
@@ -983,6 +1002,8 @@ typedef struct _jl_savestate_t {
 #ifdef JL_GC_MARKSWEEP
     jl_gcframe_t *gcstack;
 #endif
+    // position in the task's ccall temporary argument area
+    uint64_t argloc;
     struct _jl_savestate_t *prev;
 } jl_savestate_t;
 
@@ -997,6 +1018,8 @@ typedef struct _jl_task_t {
         void *stack;
     };
     jmp_buf base_ctx;
+    // saved stack pointer of a suspended task with its own stack
+    void *sp;
     size_t bufsz;
     void *stkbuf;
     size_t ssize;
@@ -1004,17 +1027,118 @@ typedef struct _jl_task_t {
     jl_value_t *result;
     // exception state and per-task dynamic parameters
     jl_savestate_t state;
+    // ccall temporary argument space, held while inside a ccall
+    struct _jl_argarea_t *argarea;
+    // depth of @nopreempt regions this task is inside
+    int nopreempt;
 } jl_task_t;
 
-extern DLLEXPORT jl_task_t * volatile jl_current_task;
-extern DLLEXPORT jl_task_t *jl_root_task;
-extern DLLEXPORT jl_value_t *jl_exception_in_transit;
+// per-thread state
+
+#ifdef WIN32
+#define JL_THREAD __declspec(thread)
+#else
+#define JL_THREAD __thread
+#endif
+
+// the mutable runtime state private to each thread. C code reaches the
+// fields through the macros below; generated code calls
+// jl_get_ptls_states() once per function and addresses the fields from
+// that pointer. tasks do not move between threads, so the pointer stays
+// valid across task switches.
+typedef struct _jl_tls_states_t {
+#ifdef JL_GC_MARKSWEEP
+    jl_gcframe_t *pgcstack;
+#endif
+    jl_value_t *exception_in_transit;
+    jl_task_t * volatile current_task;
+    jl_task_t *root_task;
+    jl_value_t * volatile task_arg_in_transit;
+    jmp_buf * volatile jmp_target;
+} jl_tls_states_t;
+
+extern DLLEXPORT JL_THREAD jl_tls_states_t jl_tls_states;
+DLLEXPORT jl_tls_states_t *jl_get_ptls_states(void);
+void jl_register_thread_state(void);
+// states of all threads that have run julia code, for the gc
+#define JL_MAX_TLS_STATES 64
+extern jl_tls_states_t *jl_all_tls_states[JL_MAX_TLS_STATES];
+extern int jl_n_tls_states;
+
+#ifdef JL_GC_MARKSWEEP
+#define jl_pgcstack (jl_tls_states.pgcstack)
+#endif
+#define jl_exception_in_transit (jl_tls_states.exception_in_transit)
+#define jl_current_task (jl_tls_states.current_task)
+#define jl_root_task (jl_tls_states.root_task)
+#define jl_task_arg_in_transit (jl_tls_states.task_arg_in_transit)
+#define jl_jmp_target (jl_tls_states.jmp_target)
 
 jl_task_t *jl_new_task(jl_function_t *start, size_t ssize);
 jl_value_t *jl_switchto(jl_task_t *t, jl_value_t *arg);
+void jl_trim_stack_pool(void);
+
+// preemption
+extern DLLEXPORT int jl_compile_safepoints;
+extern DLLEXPORT volatile int32_t jl_yield_pending;
+DLLEXPORT void jl_safepoint(void);
+DLLEXPORT void jl_preempt_disable(void);
+DLLEXPORT void jl_preempt_enable(void);
+DLLEXPORT void jl_set_preempt_interval(double seconds);
+DLLEXPORT void jl_stack_pool_stats(size_t *out);
+DLLEXPORT void *jl_pool_stack_alloc(size_t ssize);
+DLLEXPORT void jl_pool_stack_free(void *stk, size_t ssize);
+
+// native thread pool
+typedef struct _jl_work_t jl_work_t;
+DLLEXPORT int jl_threadpool_size(void);
+DLLEXPORT int jl_threadpool_id(void);
+DLLEXPORT jl_work_t *jl_threadpool_spawn(void (*fptr)(void*), void *arg);
+DLLEXPORT jl_work_t *jl_threadcall(void (*fptr)(void*), void *arg,
+                                   jl_value_t *root);
+DLLEXPORT void jl_threadpool_wait(jl_work_t *w);
+DLLEXPORT void jl_threadpool_for(void (*body)(void*, int64_t, int64_t, void*),
+                                 void *arg, int64_t lo, int64_t hi, int sched,
+                                 int64_t chunk, char *acc, size_t accsize);
+DLLEXPORT void jl_pfor_count_body(void *arg, int64_t lo, int64_t hi,
+                                  void *acc);
+void jl_threadpool_mark(void (*mark)(jl_value_t*));
+DLLEXPORT int jl_work_done(jl_work_t *w);
+DLLEXPORT void jl_work_release(jl_work_t *w);
+DLLEXPORT int64_t jl_mpmc_reserve_put(size_t *pos, size_t *seq, size_t mask);
+DLLEXPORT void jl_mpmc_commit_put(size_t *seq, int64_t p, size_t mask);
+DLLEXPORT int64_t jl_mpmc_reserve_take(size_t *pos, size_t *seq, size_t mask);
+DLLEXPORT void jl_mpmc_commit_take(size_t *seq, int64_t p, size_t mask);
+DLLEXPORT size_t jl_mpmc_length(size_t *pos);
+DLLEXPORT int jl_mpmc_put(size_t *pos, size_t *seq, char *data, size_t elsize,
+                          size_t mask, const void *x);
+DLLEXPORT int jl_mpmc_take(size_t *pos, size_t *seq, char *data, size_t elsize,
+                           size_t mask, void *x);
+
+// event loop
+DLLEXPORT void jl_poll_fd(int fd);
+DLLEXPORT void jl_unpoll_fd(int fd);
+DLLEXPORT int jl_process_events(double timeout);
+DLLEXPORT int jl_ready_fd(int i);
+DLLEXPORT void jl_wait_fd_once(int fd, int writable);
+DLLEXPORT int jl_n_woken_fds(void);
+DLLEXPORT int jl_woken_fd(int i);
+DLLEXPORT int jl_woken_events(int i);
+DLLEXPORT void jl_wake_event_loop(void);
+typedef struct _jl_timer_t jl_timer_t;
+DLLEXPORT jl_timer_t *jl_timer_new(int64_t id);
+DLLEXPORT void jl_timer_start(jl_timer_t *t, double delay, double interval);
+DLLEXPORT void jl_timer_stop(jl_timer_t *t);
+DLLEXPORT int jl_timer_pending(jl_timer_t *t);
+DLLEXPORT void jl_timer_free(jl_timer_t *t);
+DLLEXPORT int jl_n_fired_timers(void);
+DLLEXPORT int64_t jl_fired_timer(int i);
 DLLEXPORT void jl_raise(jl_value_t *e);
 DLLEXPORT void jl_register_toplevel_eh(void);
 
+DLLEXPORT uint64_t jl_arg_area_loc(void);
+DLLEXPORT void restore_arg_area_loc(uint64_t l);
+
 DLLEXPORT jl_array_t *jl_takebuf_array(ios_t *s);
 DLLEXPORT jl_value_t *jl_takebuf_string(ios_t *s);
 DLLEXPORT void *jl_takebuf_raw(ios_t *s);
@@ -1043,6 +1167,7 @@ static inline void jl_eh_restore_state(jl_savestate_t *ss)
 #ifdef JL_GC_MARKSWEEP
     jl_pgcstack = ss->gcstack;
 #endif
+    restore_arg_area_loc(ss->argloc);
     JL_SIGATOMIC_END();
 }
 
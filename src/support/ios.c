@@ -69,6 +69,21 @@ static int _enonfatal(int err)
 
 #define SLEEP_TIME 5//ms
 
+// called when a non-blocking descriptor is not ready. the embedding
+// program can install a hook that lets other work run meanwhile (julia
+// parks the current task on its event loop); otherwise we sleep briefly.
+DLLEXPORT void (*ios_wait_hook)(long fd, int writable) = NULL;
+
+static void _os_wait(long fd, int writable)
+{
+    if (errno == EINTR)
+        return;
+    if (ios_wait_hook != NULL)
+        ios_wait_hook(fd, writable);
+    else
+        sleep_ms(SLEEP_TIME);
+}
+
 // return error code, #bytes read in *nread
 // these wrappers retry operations until success or a fatal error
 static int _os_read(long fd, void *buf, size_t n, size_t *nread)
@@ -85,7 +100,7 @@ static int _os_read(long fd, void *buf, size_t n, size_t *nread)
             *nread = 0;
             return errno;
         }
-        sleep_ms(SLEEP_TIME);
+        _os_wait(fd, 0);
     }
     return 0;
 }
@@ -121,7 +136,7 @@ static int _os_write(long fd, void *buf, size_t n, size_t *nwritten)
             *nwritten = 0;
             return errno;
         }
-        sleep_ms(SLEEP_TIME);
+        _os_wait(fd, 1);
     }
     return 0;
 }
@@ -631,6 +646,47 @@ char *ios_takebuf(ios_t *s, size_t *psize)
     return buf;
 }
 
+// exchange the data of a memory stream for the empty buffer buf of
+// capacity cap (allocated with 1 spare byte, like the stream's own), which
+// the stream then owns; buf can be NULL. returns the old data, its length
+// in *psize and its capacity in *pcap, now owned by the caller. the data
+// is copied (into buf, if it fits) only when it is in the inline buffer.
+char *ios_swapbuf(ios_t *s, char *buf, size_t cap, size_t *psize, size_t *pcap)
+{
+    char *old;
+
+    ios_flush(s);
+    *psize = s->size;
+    if (s->buf == &s->local[0] || !s->ownbuf) {
+        if (buf == NULL || cap < (size_t)s->size) {
+            char *temp = LLT_REALLOC(buf, s->size+1);
+            if (temp == NULL)
+                return NULL;
+            buf = temp;
+            cap = s->size;
+        }
+        if (s->size)
+            memcpy(buf, s->buf, s->size);
+        *pcap = cap;
+        if (s->buf == &s->local[0])
+            s->size = s->bpos = 0;
+        else
+            _buf_init(s, s->bm);
+        return buf;
+    }
+    old = s->buf;
+    *pcap = s->maxsize;
+    if (buf != NULL) {
+        s->buf = buf;
+        s->maxsize = cap;
+        s->size = s->bpos = 0;
+    }
+    else {
+        _buf_init(s, s->bm);
+    }
+    return old;
+}
+
 int ios_setbuf(ios_t *s, char *buf, size_t size, int own)
 {
     ios_flush(s);
@@ -760,6 +816,7 @@ static void _ios_init(ios_t *s)
     s->rereadable = 0;
     s->readonly = 0;
     s->mutex_initialized = 0;
+    s->nonblocking = 0;
 }
 
 /* stream object initializers. we do no allocation. */
@@ -823,6 +880,24 @@ ios_t *ios_fd(ios_t *s, long fd, int isfile, int own)
     return s;
 }
 
+// put the descriptor in non-blocking mode, so that a read or write that
+// would block goes through ios_wait_hook instead
+int ios_set_nonblocking(ios_t *s, int on)
+{
+#ifndef WIN32
+    int flags = fcntl((int)s->fd, F_GETFL, 0);
+    if (flags == -1)
+        return errno;
+    flags = on ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    if (fcntl((int)s->fd, F_SETFL, flags) == -1)
+        return errno;
+    s->nonblocking = on ? 1 : 0;
+    return 0;
+#else
+    return 0;
+#endif
+}
+
 ios_t *ios_stdin = NULL;
 ios_t *ios_stdout = NULL;
 ios_t *ios_stderr = NULL;
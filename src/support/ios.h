@@ -60,6 +60,9 @@ typedef struct {
 
     unsigned char mutex_initialized:1;
 
+    // reads and writes that would block go through ios_wait_hook
+    unsigned char nonblocking:1;
+
     int64_t userdata;
     pthread_mutex_t mutex;
 
@@ -80,6 +83,8 @@ DLLEXPORT int ios_eof(ios_t *s);
 DLLEXPORT int ios_flush(ios_t *s);
 DLLEXPORT void ios_close(ios_t *s);
 DLLEXPORT char *ios_takebuf(ios_t *s, size_t *psize);  // release buffer to caller
+DLLEXPORT char *ios_swapbuf(ios_t *s, char *buf, size_t cap, size_t *psize,
+                            size_t *pcap);
 // set buffer space to use
 DLLEXPORT int ios_setbuf(ios_t *s, char *buf, size_t size, int own);
 DLLEXPORT int ios_bufmode(ios_t *s, bufmode_t mode);
@@ -100,6 +105,8 @@ DLLEXPORT ios_t *ios_mem(ios_t *s, size_t initsize);
 ios_t *ios_str(ios_t *s, char *str);
 ios_t *ios_static_buffer(ios_t *s, char *buf, size_t sz);
 DLLEXPORT ios_t *ios_fd(ios_t *s, long fd, int isfile, int own);
+DLLEXPORT int ios_set_nonblocking(ios_t *s, int on);
+extern DLLEXPORT void (*ios_wait_hook)(long fd, int writable);
 // todo: ios_socket
 extern DLLEXPORT ios_t *ios_stdin;
 extern DLLEXPORT ios_t *ios_stdout;
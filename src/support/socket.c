@@ -168,6 +168,30 @@ int connect_to_addr(struct sockaddr_in *host_addr)
     return sockfd;
 }
 
+/* have the kernel probe the peer after idle seconds of silence, every
+   interval seconds, and fail the connection after count unanswered probes.
+   reads then fail with ETIMEDOUT. */
+int set_tcp_keepalive(int fd, int idle, int interval, int count)
+{
+    int yes=1, r=0;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, (char*)&yes, sizeof(int)))
+        return -1;
+#if defined(TCP_KEEPIDLE)
+    r |= setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, (char*)&idle, sizeof(int));
+#elif defined(TCP_KEEPALIVE)
+    r |= setsockopt(fd, IPPROTO_TCP, TCP_KEEPALIVE, (char*)&idle, sizeof(int));
+#endif
+#ifdef TCP_KEEPINTVL
+    r |= setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, (char*)&interval,
+                    sizeof(int));
+#endif
+#ifdef TCP_KEEPCNT
+    r |= setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, (char*)&count, sizeof(int));
+#endif
+    return r ? -1 : 0;
+}
+
 void getlocalip(char *buf, size_t len)
 {
     struct ifaddrs * ifAddrStruct=NULL;
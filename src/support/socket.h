@@ -19,6 +19,7 @@ DLLEXPORT int open_any_tcp_port(short *portno);
 DLLEXPORT int open_any_udp_port(short *portno);
 DLLEXPORT int connect_to_host(char *hostname, short portno);
 DLLEXPORT void getlocalip(char *buf, size_t len);
+DLLEXPORT int set_tcp_keepalive(int fd, int idle, int interval, int count);
 int connect_to_addr(struct sockaddr_in *host_addr);
 
 #ifdef WIN32
@@ -11,6 +11,10 @@
 #ifndef __WIN32__
 #include <sys/sysctl.h>
 #include <sys/wait.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <poll.h>
 #endif
 #include <errno.h>
 #include <signal.h>
@@ -419,70 +423,529 @@ int jl_stderr(void) { return STDERR_FILENO; }
 
 // -- I/O thread --
 
+// messages to other processes are serialized into a memory stream per
+// connection (the send buffer). the I/O thread moves the data out by
+// swapping an empty buffer into the stream, queues it in the connection's
+// ring of buffers, and writes all queued buffers with one vectored write.
+// ring buffers keep their capacity as they are reused, so in the steady
+// state sending allocates nothing. writes do not block: a connection whose
+// socket is full waits for writability on the I/O thread's own libuv loop
+// while other connections proceed. connections with data waiting are kept
+// on a doubly-linked list ordered by when they are due, urgent ones at the
+// front; enqueueing is O(1) except for the rare connection that is due
+// before ones queued earlier.
+//
+// non-urgent messages are coalesced like Nagle's algorithm does: a message
+// to an idle connection goes out at once, so request/response traffic sees
+// no added latency, while messages arriving in a burst wait a little for
+// the ones expected to follow, up to the connection's max_delay, or until
+// flush_bytes are buffered.
+//
+// connections to processes on the same host may instead have a shared
+// memory link (see below); their buffers are copied into its ring rather
+// than written to the socket.
+
+#define JL_SENDQ_RING     16
+#define JL_SENDBUF_KEEP   (1<<20)  // larger buffers are freed once written
+
+// default coalescing policy, adjustable per connection
+#define JL_SEND_MAX_DELAY_US  500
+#define JL_SEND_FLUSH_BYTES   65536
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} jl_sendbuf_t;
+
+typedef struct _jl_sendq_t {
+    int fd;
+    ios_t *src;                // the send buffer
+    jl_sendbuf_t ring[JL_SENDQ_RING];
+    unsigned head;             // oldest buffer with data left to write
+    unsigned n;                // number of buffers with data left to write
+    size_t off;                // bytes of ring[head] already written
+    // protected by q_mut:
+    int queued;                // on the ready list
+    int now;                   // urgent
+    int blocked;               // waiting for the socket to become writable
+    int busy;                  // being written by the I/O thread
+    int closing;               // detached from fd; 2 once it can be freed
+    int *stopped;              // set once the poll of a closed queue stops
+    int64_t due;               // when to write, in microseconds
+    struct _jl_sendq_t *prev, *next;
+    // coalescing policy and the traffic it is based on
+    int64_t max_delay;         // microseconds
+    size_t flush_bytes;
+    int64_t last_enq;          // time of the last message
+    int64_t gap;               // moving average of the time between messages
+    // counters; n_msgs is protected by q_mut, the others are updated
+    // atomically by the I/O thread
+    int64_t n_msgs;
+    volatile int64_t n_writes;
+    volatile int64_t n_bytes;
+    uv_poll_t poll;
+    int poll_init;
+    struct _jl_shmlink_t *shm; // protected by q_mut
+} jl_sendq_t;
+
 static pthread_t io_thread;
 static pthread_mutex_t q_mut;
-static pthread_mutex_t wake_mut;
-static pthread_cond_t wake_cond;
+static pthread_cond_t q_idle;        // a queue stopped being busy
+static uv_loop_t *io_loop;
+static uv_async_t io_wakeup;
+static uv_timer_t io_timer;
 
-typedef struct _sendreq_t {
-    int fd;
-    ios_t *buf;
-    int now;
-    struct _sendreq_t *next;
-} sendreq_t;
+static jl_sendq_t **sendqs = NULL;   // indexed by fd
+static int n_sendqs = 0;
+static jl_sendq_t *ready_head = NULL;
+static jl_sendq_t *ready_tail = NULL;
 
-static sendreq_t *ioq = NULL;
-static sendreq_t *ioq_freelist = NULL;
+static int64_t now_us(void)
+{
+    return (int64_t)(clock_now()*1e6);
+}
 
-int _os_write_all(long fd, void *buf, size_t n, size_t *nwritten);
+// ready list operations; q_mut must be held
+static void ready_unlink(jl_sendq_t *q)
+{
+    if (q->prev) q->prev->next = q->next; else ready_head = q->next;
+    if (q->next) q->next->prev = q->prev; else ready_tail = q->prev;
+    q->prev = q->next = NULL;
+    q->queued = 0;
+}
 
-static void *run_io_thr(void *arg)
+// put q in the ready list, keeping it ordered by due time; urgent
+// connections (due 0) go to the front, others normally to the back
+static void ready_push(jl_sendq_t *q, int front)
 {
-    sigset_t set;
-    sigemptyset(&set);
-    sigaddset(&set, SIGFPE);
-    sigaddset(&set, SIGINT);
-    sigaddset(&set, SIGSEGV);
-    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    jl_sendq_t *after = NULL;
+    q->queued = 1;
+    if (front) {
+        q->due = 0;
+    }
+    else {
+        after = ready_tail;
+        while (after != NULL && after->due > q->due)
+            after = after->prev;
+    }
+    if (after == NULL) {
+        q->prev = NULL;
+        q->next = ready_head;
+        if (ready_head) ready_head->prev = q; else ready_tail = q;
+        ready_head = q;
+    }
+    else {
+        q->prev = after;
+        q->next = after->next;
+        if (after->next) after->next->prev = q; else ready_tail = q;
+        after->next = q;
+    }
+}
 
-    while (1) {
-        while (ioq == NULL) {
-            pthread_mutex_lock(&wake_mut);
-            pthread_cond_wait(&wake_cond, &wake_mut);
-            pthread_mutex_unlock(&wake_mut);
+static jl_sendq_t *get_sendq(int fd, ios_t *src)
+{
+    if (fd >= n_sendqs) {
+        int n = n_sendqs ? n_sendqs : 64;
+        while (n <= fd) n *= 2;
+        sendqs = (jl_sendq_t**)realloc(sendqs, n*sizeof(jl_sendq_t*));
+        memset(&sendqs[n_sendqs], 0, (n-n_sendqs)*sizeof(jl_sendq_t*));
+        n_sendqs = n;
+    }
+    jl_sendq_t *q = sendqs[fd];
+    if (q == NULL) {
+        q = (jl_sendq_t*)calloc(1, sizeof(jl_sendq_t));
+        q->fd = fd;
+        q->max_delay = JL_SEND_MAX_DELAY_US;
+        q->flush_bytes = JL_SEND_FLUSH_BYTES;
+        q->gap = JL_SEND_MAX_DELAY_US;
+        sendqs[fd] = q;
+    }
+    if (src != NULL)
+        q->src = src;
+    return q;
+}
+
+// move the contents of the send buffer into the ring
+static void collect_sendq(jl_sendq_t *q)
+{
+    if (q->n == JL_SENDQ_RING)
+        return;
+    jl_sendbuf_t *b = &q->ring[(q->head+q->n) % JL_SENDQ_RING];
+    pthread_mutex_lock(&q->src->mutex);
+    if (q->src->size > 0) {
+        size_t len, cap;
+        char *data = ios_swapbuf(q->src, b->data, b->cap, &len, &cap);
+        if (data != NULL) {
+            b->data = data;
+            b->len = len;
+            b->cap = cap;
+            q->n++;
         }
-        assert(ioq != NULL);
+    }
+    pthread_mutex_unlock(&q->src->mutex);
+}
 
-        pthread_mutex_lock(&q_mut);
-        sendreq_t *r = ioq;
-        ioq = ioq->next;
-        pthread_mutex_unlock(&q_mut);
+static void retire_sendbuf(jl_sendbuf_t *b)
+{
+    b->len = 0;
+    if (b->cap > JL_SENDBUF_KEEP) {
+        free(b->data);
+        b->data = NULL;
+        b->cap = 0;
+    }
+}
 
-        if (!r->now) {
-            int64_t now = (int64_t)(clock_now()*1e6);
-            int64_t waittime = r->buf->userdata+200-now;  // microseconds
-            if (waittime > 0) {
-                struct timespec wt;
-                wt.tv_sec = 0;
-                wt.tv_nsec = waittime * 1000;
-                nanosleep(&wt, NULL);
+static ssize_t send_iov(int fd, struct iovec *iov, int cnt)
+{
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = cnt;
+    ssize_t nw = sendmsg(fd, &msg, MSG_DONTWAIT|MSG_NOSIGNAL);
+    if (nw < 0 && errno == ENOTSOCK)
+        nw = writev(fd, iov, cnt);
+    return nw;
+}
+
+static void writable_cb(uv_poll_t *handle, int status, int events)
+{
+    jl_sendq_t *q = (jl_sendq_t*)handle->data;
+    uv_poll_stop(handle);
+    pthread_mutex_lock(&q_mut);
+    q->blocked = 0;
+    if (q->queued)
+        ready_unlink(q);
+    q->now = 1;
+    ready_push(q, 1);
+    pthread_mutex_unlock(&q_mut);
+}
+
+// write as much of the ring as the socket takes
+static void flush_sendq(jl_sendq_t *q)
+{
+    struct iovec iov[JL_SENDQ_RING];
+    while (q->n > 0) {
+        for(unsigned i=0; i < q->n; i++) {
+            jl_sendbuf_t *b = &q->ring[(q->head+i) % JL_SENDQ_RING];
+            size_t skip = i==0 ? q->off : 0;
+            iov[i].iov_base = b->data + skip;
+            iov[i].iov_len = b->len - skip;
+        }
+        ssize_t nw = send_iov(q->fd, iov, q->n);
+        if (nw >= 0) {
+            __sync_add_and_fetch(&q->n_writes, 1);
+            __sync_add_and_fetch(&q->n_bytes, nw);
+        }
+        if (nw < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                pthread_mutex_lock(&q_mut);
+                q->blocked = 1;
+                pthread_mutex_unlock(&q_mut);
+                if (!q->poll_init) {
+                    uv_poll_init(io_loop, &q->poll, q->fd);
+                    q->poll.data = q;
+                    q->poll_init = 1;
+                }
+                uv_poll_start(&q->poll, UV_WRITABLE, writable_cb);
+                return;
+            }
+            // the connection is broken; the reading side reports it
+            while (q->n > 0) {
+                retire_sendbuf(&q->ring[q->head]);
+                q->head = (q->head+1) % JL_SENDQ_RING;
+                q->n--;
             }
+            q->off = 0;
+            return;
+        }
+        size_t left = (size_t)nw;
+        while (q->n > 0) {
+            jl_sendbuf_t *b = &q->ring[q->head];
+            if (left < b->len - q->off) {
+                q->off += left;
+                break;
+            }
+            left -= b->len - q->off;
+            retire_sendbuf(b);
+            q->head = (q->head+1) % JL_SENDQ_RING;
+            q->n--;
+            q->off = 0;
+        }
+    }
+}
+
+// -- shared-memory links --
+
+// a link connects two processes on the same host through a file in
+// /dev/shm holding a ring for each direction. the process that connected
+// creates the file and writes into ring 0, the one that accepted writes
+// into ring 1. each ring has a single writer, the I/O thread of its
+// process, and a single reader, its peer's main thread, so positions are
+// advanced without locks. a buffer from the send queue goes in as one or
+// more frames, each an 8-byte header (length, and whether more of the
+// buffer follows) and the data; the reader passes on whole buffers only,
+// which always hold whole messages.
+//
+// the socket is kept, for failure detection and as a doorbell: a reader
+// about to wait on it sets its ring's sleeping flag, and a writer that
+// finds the flag set clears it and sends a byte. a full ring is retried
+// after a short delay, since the reader has no way to wake the writer's
+// I/O thread.
+
+#define JL_SHM_RING_SIZE  (1<<20)
+#define JL_SHM_HDR_SIZE   4096
+#define JL_SHM_FRAME_HDR  8
+#define JL_SHM_MIN_CHUNK  4096   // don't write smaller pieces of a buffer
+#define JL_SHM_RETRY_US   50
+
+typedef struct {
+    volatile uint64_t head;     // advanced by the reader
+    char pad0[56];
+    volatile uint64_t tail;     // advanced by the writer
+    char pad1[56];
+    volatile uint32_t sleeping; // the reader waits for a doorbell
+    char pad2[60];
+} jl_shmring_t;
+
+typedef struct {
+    uint64_t cap;               // bytes of data in each ring
+    char pad[56];
+    jl_shmring_t ring[2];
+} jl_shmseg_t;
+
+typedef struct _jl_shmlink_t {
+    int fd;
+    char *base;
+    size_t size;
+    uint64_t cap;
+    jl_shmring_t *tx, *rx;
+    char *txdata, *rxdata;
+    ios_t partial;              // frames of a buffer not yet complete
+    // protected by q_mut:
+    int busy;                   // in use by the I/O thread
+    int closed;
+} jl_shmlink_t;
+
+static void shmlink_free(jl_shmlink_t *l)
+{
+    munmap(l->base, l->size);
+    ios_close(&l->partial);
+    free(l);
+}
+
+// q_mut must be held for these two
+static void shmlink_hold(jl_shmlink_t *l)
+{
+    l->busy++;
+}
+
+static void shmlink_release(jl_shmlink_t *l)
+{
+    if (--l->busy == 0 && l->closed)
+        shmlink_free(l);
+}
+
+static void shm_ring_put(char *ring, uint64_t cap, uint64_t pos,
+                         const char *src, size_t n)
+{
+    size_t i = pos & (cap-1);
+    size_t n1 = cap - i < n ? cap - i : n;
+    memcpy(ring + i, src, n1);
+    memcpy(ring, src + n1, n - n1);
+}
+
+static void shm_ring_get(char *ring, uint64_t cap, uint64_t pos,
+                         char *dest, size_t n)
+{
+    size_t i = pos & (cap-1);
+    size_t n1 = cap - i < n ? cap - i : n;
+    memcpy(dest, ring + i, n1);
+    memcpy(dest + n1, ring, n - n1);
+}
+
+static void shm_ring_get_ios(char *ring, uint64_t cap, uint64_t pos,
+                             ios_t *dest, size_t n)
+{
+    size_t i = pos & (cap-1);
+    size_t n1 = cap - i < n ? cap - i : n;
+    ios_write(dest, ring + i, n1);
+    ios_write(dest, ring, n - n1);
+}
+
+static void shm_doorbell(jl_shmlink_t *l)
+{
+    __sync_synchronize();
+    if (l->tx->sleeping && __sync_bool_compare_and_swap(&l->tx->sleeping, 1, 0)) {
+        char c = 0;
+        send(l->fd, &c, 1, MSG_DONTWAIT|MSG_NOSIGNAL);
+    }
+}
+
+// copy as much of the ring of buffers as fits into the shared ring
+static void flush_sendq_shm(jl_sendq_t *q, jl_shmlink_t *l)
+{
+    jl_shmring_t *r = l->tx;
+    uint64_t tail = r->tail;
+    int wrote = 0;
+    while (q->n > 0) {
+        jl_sendbuf_t *b = &q->ring[q->head];
+        size_t left = b->len - q->off;
+        uint64_t space = l->cap - (tail - r->head);
+        __sync_synchronize();
+        size_t want = left < JL_SHM_MIN_CHUNK ? left : JL_SHM_MIN_CHUNK;
+        if (space < JL_SHM_FRAME_HDR + want)
+            break;
+        size_t n = left < space - JL_SHM_FRAME_HDR ? left : space - JL_SHM_FRAME_HDR;
+        uint32_t hdr[2];
+        hdr[0] = (uint32_t)n;
+        hdr[1] = n < left;
+        shm_ring_put(l->txdata, l->cap, tail, (char*)hdr, JL_SHM_FRAME_HDR);
+        shm_ring_put(l->txdata, l->cap, tail + JL_SHM_FRAME_HDR, b->data + q->off, n);
+        tail += JL_SHM_FRAME_HDR + n;
+        __sync_synchronize();
+        r->tail = tail;
+        wrote = 1;
+        __sync_add_and_fetch(&q->n_bytes, n);
+        q->off += n;
+        if (q->off == b->len) {
+            retire_sendbuf(b);
+            q->head = (q->head+1) % JL_SENDQ_RING;
+            q->n--;
+            q->off = 0;
         }
+    }
+    if (wrote) {
+        __sync_add_and_fetch(&q->n_writes, 1);
+        shm_doorbell(l);
+    }
+}
 
-        pthread_mutex_lock(&r->buf->mutex);
-        size_t sz;
-        size_t n = r->buf->size;
-        char *buf = ios_takebuf(r->buf, &sz);
-        pthread_mutex_unlock(&r->buf->mutex);
+static void sendq_poll_closed(uv_handle_t *handle)
+{
+    free(handle->data);
+}
 
-        size_t nw;
-        _os_write_all(r->fd, buf, n, &nw);
-        free(buf);
+// called on the I/O thread for a queue that was closed
+static void free_sendq(jl_sendq_t *q)
+{
+    for(int i=0; i < JL_SENDQ_RING; i++)
+        free(q->ring[i].data);
+    if (q->poll_init) {
+        uv_poll_stop(&q->poll);
+        uv_close((uv_handle_t*)&q->poll, sendq_poll_closed);
+    }
+    else {
+        free(q);
+    }
+}
 
+// serve the connections that are due. returns the microseconds until the
+// next one is, or -1 if none is waiting.
+static int64_t service_sendqs(void)
+{
+    while (1) {
         pthread_mutex_lock(&q_mut);
-        r->next = ioq_freelist;
-        ioq_freelist = r;
+        jl_sendq_t *q = ready_head;
+        if (q == NULL) {
+            pthread_mutex_unlock(&q_mut);
+            return -1;
+        }
+        // the list is in due order, so if the first one is not due none is
+        if (!q->now) {
+            int64_t wait = q->due - now_us();
+            if (wait > 0) {
+                pthread_mutex_unlock(&q_mut);
+                return wait;
+            }
+        }
+        ready_unlink(q);
+        if (q->closing) {
+            // freed once jl_close_sendq is done with it
+            int *stopped = (q->closing == 2) ? q->stopped : NULL;
+            pthread_mutex_unlock(&q_mut);
+            if (stopped != NULL) {
+                free_sendq(q);
+                // the fd is no longer polled; let it be closed
+                pthread_mutex_lock(&q_mut);
+                *stopped = 1;
+                pthread_cond_broadcast(&q_idle);
+                pthread_mutex_unlock(&q_mut);
+            }
+            continue;
+        }
+        q->busy = 1;
+        struct _jl_shmlink_t *shm = q->shm;
+        if (shm)
+            shmlink_hold(shm);
         pthread_mutex_unlock(&q_mut);
+
+        // refill the ring as it drains, until the send buffer is empty or
+        // the socket is full
+        do {
+            collect_sendq(q);
+            if (shm)
+                flush_sendq_shm(q, shm);
+            else
+                flush_sendq(q);
+        } while (q->n == 0 && !q->blocked && q->src->size > 0);
+
+        pthread_mutex_lock(&q_mut);
+        q->busy = 0;
+        if (q->closing) {
+            pthread_cond_broadcast(&q_idle);
+        }
+        else if (shm && q->n > 0 && !q->queued) {
+            // the shared ring is full; try again once the reader has
+            // had a chance to make room
+            q->now = 0;
+            q->due = now_us() + JL_SHM_RETRY_US;
+            ready_push(q, 0);
+        }
+        if (shm)
+            shmlink_release(shm);
+        pthread_mutex_unlock(&q_mut);
+    }
+}
+
+static void io_wakeup_cb(uv_async_t *handle, int status)
+{
+}
+
+static void io_timer_cb(uv_timer_t *handle, int status)
+{
+}
+
+static void *run_io_thr(void *arg)
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGFPE);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGSEGV);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    while (1) {
+        int64_t wait = service_sendqs();
+        if (wait >= 0 && wait < 1000) {
+            // below the loop's timer resolution
+            struct timespec wt;
+            wt.tv_sec = 0;
+            wt.tv_nsec = wait * 1000;
+            nanosleep(&wt, NULL);
+            continue;
+        }
+        if (wait >= 0)
+            uv_timer_start(&io_timer, io_timer_cb, wait/1000, 0);
+        uv_run_once(io_loop);
+        if (wait >= 0)
+            uv_timer_stop(&io_timer);
     }
     return NULL;
 }
@@ -501,64 +964,344 @@ DLLEXPORT void jl_buf_mutex_unlock(ios_t *s)
     pthread_mutex_unlock(&s->mutex);
 }
 
-DLLEXPORT void jl_enq_send_req(ios_t *dest, ios_t *buf, int now)
+// how long a message that just arrived on q may wait for others
+static int64_t coalesce_delay(jl_sendq_t *q, int64_t t, size_t buffered)
+{
+    int64_t gap = t - q->last_enq;
+    q->gap = (7*q->gap + (gap < 2*q->max_delay ? gap : 2*q->max_delay)) / 8;
+    q->last_enq = t;
+    if (buffered >= q->flush_bytes || gap >= q->max_delay)
+        return 0;
+    // in a burst: wait for a few more messages at the current rate
+    int64_t delay = 4*q->gap;
+    return delay < q->max_delay ? delay : q->max_delay;
+}
+
+// ask the I/O thread to send what is in buf to fd; now means urgently
+DLLEXPORT void jl_enq_send_req(int fd, ios_t *buf, int now)
 {
+    pthread_mutex_lock(&buf->mutex);
+    size_t buffered = buf->size;
+    pthread_mutex_unlock(&buf->mutex);
+    int64_t t = now_us();
     pthread_mutex_lock(&q_mut);
-    sendreq_t *req = ioq;
-    sendreq_t **pr = &ioq;
-    while (req != NULL) {
-        if (req->fd == dest->fd) {
-            if (now && !req->now) {
-                // increase priority
-                *pr = req->next;
-                req->next = ioq;
-                ioq = req;
-                req->now = 1;
-            }
-            pthread_mutex_unlock(&q_mut);
-            return;
-        }
-        pr = &req->next;
-        req = req->next;
+    jl_sendq_t *q = get_sendq(fd, buf);
+    q->n_msgs++;
+    int64_t delay = coalesce_delay(q, t, buffered);
+    if (delay == 0)
+        now = 1;
+    if (q->blocked) {
+        // queued again once the socket is writable
+    }
+    else if (!q->queued) {
+        q->now = now;
+        q->due = t + delay;
+        ready_push(q, now);
+    }
+    else if (now && !q->now) {
+        // increase priority
+        ready_unlink(q);
+        q->now = 1;
+        ready_push(q, 1);
     }
+    pthread_mutex_unlock(&q_mut);
+    uv_async_send(&io_wakeup);
+}
 
-    if (ioq_freelist != NULL) {
-        req = ioq_freelist;
-        ioq_freelist = ioq_freelist->next;
+// set how long non-urgent messages to fd may wait to be sent together, and
+// how much buffered data makes them go out at once
+DLLEXPORT void jl_set_send_policy(int fd, double max_delay, size_t flush_bytes)
+{
+    pthread_mutex_lock(&q_mut);
+    jl_sendq_t *q = get_sendq(fd, NULL);
+    q->max_delay = (int64_t)(max_delay*1e6);
+    q->flush_bytes = flush_bytes;
+    pthread_mutex_unlock(&q_mut);
+}
+
+// messages queued, write calls made and bytes written to fd
+DLLEXPORT void jl_send_stats(int fd, int64_t *out)
+{
+    out[0] = out[1] = out[2] = 0;
+    pthread_mutex_lock(&q_mut);
+    if (fd >= 0 && fd < n_sendqs && sendqs[fd] != NULL) {
+        out[0] = sendqs[fd]->n_msgs;
+        out[1] = sendqs[fd]->n_writes;
+        out[2] = sendqs[fd]->n_bytes;
     }
-    else {
-        req = (sendreq_t*)malloc(sizeof(sendreq_t));
+    pthread_mutex_unlock(&q_mut);
+}
+
+// stop sending to fd, dropping anything not yet written, before fd is
+// closed. returns once the I/O thread is no longer writing to or polling
+// it, so the descriptor can be closed and reused; the queue is freed by
+// the I/O thread.
+DLLEXPORT void jl_close_sendq(int fd)
+{
+    pthread_mutex_lock(&q_mut);
+    if (fd >= 0 && fd < n_sendqs && sendqs[fd] != NULL) {
+        jl_sendq_t *q = sendqs[fd];
+        int stopped = 0;
+        sendqs[fd] = NULL;
+        q->closing = 1;
+        while (q->busy)
+            pthread_cond_wait(&q_idle, &q_mut);
+        // hand it to the I/O thread to free; q is not touched after this
+        q->closing = 2;
+        q->stopped = &stopped;
+        if (q->queued)
+            ready_unlink(q);
+        ready_push(q, 1);
+        uv_async_send(&io_wakeup);
+        while (!stopped)
+            pthread_cond_wait(&q_idle, &q_mut);
     }
-    req->fd = dest->fd;
-    req->buf = buf;
-    req->now = now;
-    req->next = NULL;
-    buf->userdata = (int64_t)(clock_now()*1e6);
-    if (ioq == NULL) {
-        ioq = req;
+    pthread_mutex_unlock(&q_mut);
+}
+
+static int shm_write_all(int fd, const void *buf, size_t n)
+{
+    const char *p = (const char*)buf;
+    while (n > 0) {
+        ssize_t nw = write(fd, p, n);
+        if (nw < 0 && errno == EINTR)
+            continue;
+        if (nw <= 0)
+            return -1;
+        p += nw;
+        n -= nw;
     }
-    else {
-        if (now) {
-            req->next = ioq;
-            ioq = req;
+    return 0;
+}
+
+static int shm_read_all(int fd, void *buf, size_t n)
+{
+    char *p = (char*)buf;
+    while (n > 0) {
+        ssize_t nr = read(fd, p, n);
+        if (nr < 0 && errno == EINTR)
+            continue;
+        if (nr <= 0)
+            return -1;
+        p += nr;
+        n -= nr;
+    }
+    return 0;
+}
+
+static jl_shmlink_t *shmlink_map(int fd, int sfd, int side)
+{
+    struct stat st;
+    if (fstat(sfd, &st) != 0 || (size_t)st.st_size < JL_SHM_HDR_SIZE)
+        return NULL;
+    char *base = (char*)mmap(NULL, st.st_size, PROT_READ|PROT_WRITE,
+                             MAP_SHARED, sfd, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+    jl_shmseg_t *seg = (jl_shmseg_t*)base;
+    if (seg->cap == 0 || (seg->cap & (seg->cap-1)) != 0 ||
+        (size_t)st.st_size != JL_SHM_HDR_SIZE + 2*seg->cap) {
+        munmap(base, st.st_size);
+        return NULL;
+    }
+    jl_shmlink_t *l = (jl_shmlink_t*)calloc(1, sizeof(jl_shmlink_t));
+    l->fd = fd;
+    l->base = base;
+    l->size = st.st_size;
+    l->cap = seg->cap;
+    l->tx = &seg->ring[side];
+    l->rx = &seg->ring[1-side];
+    l->txdata = base + JL_SHM_HDR_SIZE + side*seg->cap;
+    l->rxdata = base + JL_SHM_HDR_SIZE + (1-side)*seg->cap;
+    ios_mem(&l->partial, 0);
+    return l;
+}
+
+static void shmlink_attach(jl_shmlink_t *l)
+{
+    pthread_mutex_lock(&q_mut);
+    get_sendq(l->fd, NULL)->shm = l;
+    pthread_mutex_unlock(&q_mut);
+}
+
+// called right after connecting on fd, before anything else is sent:
+// offer a shared-memory link if offer is nonzero, and wait for the other
+// side to take it. returns NULL if the connection stays a plain socket.
+DLLEXPORT void *jl_shm_connect(int fd, int offer)
+{
+    char path[64];
+    jl_shmlink_t *l = NULL;
+    int sfd = -1;
+    if (offer) {
+        struct stat st;
+        strcpy(path, stat("/dev/shm", &st) == 0 && S_ISDIR(st.st_mode) ?
+               "/dev/shm/julia-XXXXXX" : "/tmp/julia-shm-XXXXXX");
+        sfd = mkstemp(path);
+    }
+    if (sfd >= 0) {
+        if (ftruncate(sfd, JL_SHM_HDR_SIZE + 2*JL_SHM_RING_SIZE) == 0) {
+            jl_shmseg_t hdr;
+            memset(&hdr, 0, sizeof(hdr));
+            hdr.cap = JL_SHM_RING_SIZE;
+            if (pwrite(sfd, &hdr, sizeof(hdr), 0) == sizeof(hdr))
+                l = shmlink_map(fd, sfd, 0);
         }
-        else {
-            sendreq_t *r = ioq;
-            while (r->next != NULL) {
-                r = r->next;
+        close(sfd);
+        if (l == NULL)
+            unlink(path);
+    }
+    uint8_t hello[2+sizeof(path)];
+    size_t n = 1;
+    hello[0] = l != NULL;
+    if (l != NULL) {
+        hello[1] = (uint8_t)strlen(path);
+        memcpy(&hello[2], path, hello[1]);
+        n += 1 + hello[1];
+    }
+    uint8_t ack = 0;
+    if (shm_write_all(fd, hello, n) != 0 ||
+        (l != NULL && shm_read_all(fd, &ack, 1) != 0))
+        ack = 0;
+    if (l == NULL)
+        return NULL;
+    // both sides have it mapped now, or never will
+    unlink(path);
+    if (!ack) {
+        shmlink_free(l);
+        return NULL;
+    }
+    shmlink_attach(l);
+    return l;
+}
+
+// called right after accepting fd: take the link the other side offers,
+// if any. returns NULL for a plain socket.
+DLLEXPORT void *jl_shm_accept(int fd)
+{
+    uint8_t tag, len;
+    char path[256];
+    if (shm_read_all(fd, &tag, 1) != 0 || tag == 0)
+        return NULL;
+    if (shm_read_all(fd, &len, 1) != 0 || shm_read_all(fd, path, len) != 0)
+        return NULL;
+    path[len] = '\0';
+    jl_shmlink_t *l = NULL;
+    int sfd = open(path, O_RDWR);
+    if (sfd >= 0) {
+        l = shmlink_map(fd, sfd, 1);
+        close(sfd);
+    }
+    uint8_t ack = l != NULL;
+    if (shm_write_all(fd, &ack, 1) != 0 && l != NULL) {
+        shmlink_free(l);
+        return NULL;
+    }
+    if (l != NULL)
+        shmlink_attach(l);
+    return l;
+}
+
+// move the whole buffers waiting in the link's ring to the end of dest,
+// leaving its read position alone
+static size_t shm_take(jl_shmlink_t *l, ios_t *dest)
+{
+    jl_shmring_t *r = l->rx;
+    uint64_t head = r->head;
+    size_t moved = 0;
+    while (1) {
+        uint64_t tail = r->tail;
+        __sync_synchronize();
+        if (tail - head < JL_SHM_FRAME_HDR)
+            break;
+        uint32_t hdr[2];
+        shm_ring_get(l->rxdata, l->cap, head, (char*)hdr, JL_SHM_FRAME_HDR);
+        uint64_t pos = head + JL_SHM_FRAME_HDR;
+        if (hdr[1] || l->partial.size > 0) {
+            shm_ring_get_ios(l->rxdata, l->cap, pos, &l->partial, hdr[0]);
+            if (!hdr[1]) {
+                ios_write(dest, l->partial.buf, l->partial.size);
+                moved += l->partial.size;
+                ios_trunc(&l->partial, 0);
             }
-            r->next = req;
         }
+        else {
+            shm_ring_get_ios(l->rxdata, l->cap, pos, dest, hdr[0]);
+            moved += hdr[0];
+        }
+        head = pos + hdr[0];
+        __sync_synchronize();
+        r->head = head;
+    }
+    return moved;
+}
+
+// called on the reading side when fd is readable, or to wait for data if
+// wait is nonzero. returns the number of bytes added to dest, or -1 if
+// the connection is closed and nothing is left.
+DLLEXPORT int64_t jl_shm_pull(void *link, ios_t *dest, int wait)
+{
+    jl_shmlink_t *l = (jl_shmlink_t*)link;
+    size_t pos = dest->bpos;
+    if (pos == dest->size) {
+        ios_trunc(dest, 0);
+        pos = 0;
     }
+    ios_seek_end(dest);
+    // a stream that was read from would drop its contents on writing
+    dest->state = bst_none;
+    size_t moved = 0;
+    int eof = 0;
+    while (1) {
+        char junk[64];
+        ssize_t nr;
+        while ((nr = recv(l->fd, junk, sizeof(junk), MSG_DONTWAIT)) > 0)
+            ;
+        // a closed connection, or one that stopped answering keepalive
+        // probes
+        if (nr == 0 || (nr < 0 && errno != EAGAIN &&
+                        errno != EWOULDBLOCK && errno != EINTR))
+            eof = 1;
+        moved += shm_take(l, dest);
+        // tell the writer to ring before data arriving from now on goes
+        // unnoticed
+        l->rx->sleeping = 1;
+        __sync_synchronize();
+        if (l->rx->tail != l->rx->head)
+            continue;
+        if (moved > 0 || eof || !wait)
+            break;
+        struct pollfd pfd;
+        pfd.fd = l->fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        poll(&pfd, 1, -1);
+    }
+    ios_seek(dest, pos);
+    if (moved == 0 && eof)
+        return -1;
+    return moved;
+}
+
+// detach a link from its connection once the connection is closed
+DLLEXPORT void jl_shm_close(void *link)
+{
+    jl_shmlink_t *l = (jl_shmlink_t*)link;
+    pthread_mutex_lock(&q_mut);
+    if (l->fd < n_sendqs && sendqs[l->fd] != NULL && sendqs[l->fd]->shm == l)
+        sendqs[l->fd]->shm = NULL;
+    l->closed = 1;
+    if (l->busy == 0)
+        shmlink_free(l);
     pthread_mutex_unlock(&q_mut);
-    pthread_cond_signal(&wake_cond);
 }
 
 DLLEXPORT void jl_start_io_thread(void)
 {
     pthread_mutex_init(&q_mut, NULL);
-    pthread_mutex_init(&wake_mut, NULL);
-    pthread_cond_init(&wake_cond, NULL);
+    pthread_cond_init(&q_idle, NULL);
+    io_loop = uv_loop_new();
+    uv_async_init(io_loop, &io_wakeup, io_wakeup_cb);
+    uv_timer_init(io_loop, &io_timer);
     pthread_attr_t attr;
     pthread_attr_init(&attr);
     pthread_attr_setstacksize(&attr, 262144);
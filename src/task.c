@@ -11,6 +11,8 @@
 #include <libgen.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
+#include <time.h>
 #include "julia.h"
 #include "builtin_proto.h"
 #if defined(__APPLE__)
@@ -133,20 +135,250 @@ static void _probe_arch(void)
 
 extern size_t jl_page_size;
 jl_struct_type_t *jl_task_type;
-DLLEXPORT jl_task_t * volatile jl_current_task;
-jl_task_t *jl_root_task;
-jl_value_t * volatile jl_task_arg_in_transit;
-static volatile int n_args_in_transit;
-jl_value_t *jl_exception_in_transit;
-#ifdef JL_GC_MARKSWEEP
-jl_gcframe_t *jl_pgcstack = NULL;
-#endif
+DLLEXPORT JL_THREAD jl_tls_states_t jl_tls_states;
+static JL_THREAD volatile int n_args_in_transit;
+
+jl_tls_states_t *jl_all_tls_states[JL_MAX_TLS_STATES];
+int jl_n_tls_states = 0;
+
+DLLEXPORT jl_tls_states_t *jl_get_ptls_states(void)
+{
+    return &jl_tls_states;
+}
+
+// make the calling thread's state visible to the gc. called by each
+// thread before it runs julia code.
+void jl_register_thread_state(void)
+{
+    jl_tls_states_t *ptls = &jl_tls_states;
+    for(int i=0; i < jl_n_tls_states; i++) {
+        if (jl_all_tls_states[i] == ptls)
+            return;
+    }
+    if (jl_n_tls_states == JL_MAX_TLS_STATES)
+        jl_error("too many threads running julia code");
+    jl_all_tls_states[jl_n_tls_states++] = ptls;
+}
 
 static void start_task(jl_task_t *t);
 
-#ifdef COPY_STACKS
-jmp_buf * volatile jl_jmp_target;
+#define JL_MIN_STACK     (4096*sizeof(void*))
+#define JL_DEFAULT_STACK (2*12288*sizeof(void*))
+
+// without COPY_STACKS each task runs on its own mmap'd stack, with an
+// inaccessible guard page below it to catch overflow. stack sizes are
+// rounded up to a power-of-two number of pages, and freed stacks are kept
+// in a pool per size class so that creating a task does not normally need
+// a system call. a stack that
+// sits in the pool across a whole collection is considered idle, and its
+// pages are handed back to the OS with madvise (the mapping and the guard
+// page are kept, so reusing it is still cheap). the pool is built in both
+// modes so that jl_pool_stack_alloc/free can exercise it directly.
+#define JL_N_STACK_CLASSES 16
+#define JL_STACK_POOL_SIZE 16
+
+typedef struct {
+    void *stk;
+    int idle;   // survived a collection in the pool
+} jl_pooled_stack_t;
+
+static jl_pooled_stack_t stack_pool[JL_N_STACK_CLASSES][JL_STACK_POOL_SIZE];
+static int n_pooled_stacks[JL_N_STACK_CLASSES];
+
+static struct {
+    size_t mapped;      // stacks obtained with mmap
+    size_t reused;      // stacks taken from the pool
+    size_t unmapped;    // stacks returned to the OS with munmap
+    size_t trimmed;     // pooled stacks released with madvise
+} stack_stats;
+
+// smallest class whose stacks hold ssize bytes, or -1 if too big to pool
+static int stack_class(size_t ssize)
+{
+    size_t sz = jl_page_size;
+    for(int c=0; c < JL_N_STACK_CLASSES; c++) {
+        if (ssize <= sz)
+            return c;
+        sz <<= 1;
+    }
+    return -1;
+}
+
+static size_t stack_class_size(int c)
+{
+    return jl_page_size<<c;
+}
+
+// round a requested stack size up to the size that will be allocated
+static size_t stack_alloc_size(size_t ssize)
+{
+    int c = stack_class(ssize);
+    if (c < 0)
+        return LLT_ALIGN(ssize, jl_page_size);
+    return stack_class_size(c);
+}
+
+static void *alloc_stack(size_t ssize)
+{
+    int c = stack_class(ssize);
+    if (c >= 0 && n_pooled_stacks[c] > 0) {
+        stack_stats.reused++;
+        return stack_pool[c][--n_pooled_stacks[c]].stk;
+    }
+    size_t pagesz = jl_page_size;
+    char *stk = (char*)mmap(NULL, ssize+pagesz, PROT_READ|PROT_WRITE,
+                            MAP_PRIVATE|MAP_ANON, -1, 0);
+    if (stk == MAP_FAILED)
+        jl_errorf("Task: could not allocate stack: %s", strerror(errno));
+    if (mprotect(stk, pagesz, PROT_NONE) == -1) {
+        munmap(stk, ssize+pagesz);
+        jl_errorf("mprotect: %s", strerror(errno));
+    }
+    stack_stats.mapped++;
+    return stk+pagesz;
+}
+
+static void free_stack(void *stk, size_t ssize)
+{
+    int c = stack_class(ssize);
+    if (c >= 0 && n_pooled_stacks[c] < JL_STACK_POOL_SIZE) {
+        jl_pooled_stack_t *p = &stack_pool[c][n_pooled_stacks[c]++];
+        p->stk = stk;
+        p->idle = 0;
+        return;
+    }
+    munmap((char*)stk-jl_page_size, ssize+jl_page_size);
+    stack_stats.unmapped++;
+}
+
+DLLEXPORT void *jl_pool_stack_alloc(size_t ssize)
+{
+    return alloc_stack(stack_alloc_size(ssize));
+}
+
+DLLEXPORT void jl_pool_stack_free(void *stk, size_t ssize)
+{
+    free_stack(stk, stack_alloc_size(ssize));
+}
+
+#ifndef COPY_STACKS
+static void release_task_stack(jl_task_t *t)
+{
+    if (t->stkbuf != NULL) {
+        free_stack(t->stkbuf, t->ssize);
+        t->stkbuf = NULL;
+        t->state.gcstack = NULL;
+    }
+}
+#endif
+
+// called after each collection. stacks freed since the previous
+// collection stay resident; older ones have their pages dropped.
+void jl_trim_stack_pool(void)
+{
+    for(int c=0; c < JL_N_STACK_CLASSES; c++) {
+        for(int i=0; i < n_pooled_stacks[c]; i++) {
+            jl_pooled_stack_t *p = &stack_pool[c][i];
+            if (p->idle == 1) {
+                madvise(p->stk, stack_class_size(c), MADV_DONTNEED);
+                stack_stats.trimmed++;
+                p->idle = 2;
+            }
+            else if (p->idle == 0) {
+                p->idle = 1;
+            }
+        }
+    }
+}
+
+// fills in, in order: stacks mapped, stacks reused from the pool, stacks
+// unmapped, pooled stacks trimmed, stacks currently pooled, and bytes of
+// pooled stack that may still be resident.
+DLLEXPORT void jl_stack_pool_stats(size_t *out)
+{
+    memset(out, 0, 6*sizeof(size_t));
+    out[0] = stack_stats.mapped;
+    out[1] = stack_stats.reused;
+    out[2] = stack_stats.unmapped;
+    out[3] = stack_stats.trimmed;
+    for(int c=0; c < JL_N_STACK_CLASSES; c++) {
+        out[4] += n_pooled_stacks[c];
+        for(int i=0; i < n_pooled_stacks[c]; i++) {
+            if (stack_pool[c][i].idle != 2)
+                out[5] += stack_class_size(c);
+        }
+    }
+}
 
+#ifndef COPY_STACKS
+
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(__WIN32__)
+// switch stacks by saving the callee-saved registers on the current stack,
+// storing the stack pointer to *save_sp, and popping the registers saved
+// on the new stack. this avoids setjmp/longjmp and pointer mangling.
+#define SWAP_STACKS
+void jl_swap_stack(void **save_sp, void *new_sp);
+
+// a task that has finished, whose stack can be released as soon as we
+// are running on a different one
+static JL_THREAD jl_task_t *finished_task = NULL;
+
+static void release_finished_stack(void)
+{
+    if (finished_task != NULL) {
+        release_task_stack(finished_task);
+        finished_task = NULL;
+    }
+}
+
+#ifdef __APPLE__
+#define ASM_NAME(s) "_" #s
+#else
+#define ASM_NAME(s) #s
+#endif
+#if defined(__x86_64__)
+asm(".text\n"
+    ".globl " ASM_NAME(jl_swap_stack) "\n"
+    ASM_NAME(jl_swap_stack) ":\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n");
+#define N_SAVED_REGS 6
+#else
+asm(".text\n"
+    ".globl " ASM_NAME(jl_swap_stack) "\n"
+    ASM_NAME(jl_swap_stack) ":\n"
+    "    movl 4(%esp), %eax\n"
+    "    movl 8(%esp), %edx\n"
+    "    pushl %ebp\n"
+    "    pushl %ebx\n"
+    "    pushl %esi\n"
+    "    pushl %edi\n"
+    "    movl %esp, (%eax)\n"
+    "    movl %edx, %esp\n"
+    "    popl %edi\n"
+    "    popl %esi\n"
+    "    popl %ebx\n"
+    "    popl %ebp\n"
+    "    ret\n");
+#define N_SAVED_REGS 4
+#endif
+#endif
+#endif /* !COPY_STACKS */
+
+#ifdef COPY_STACKS
 static void save_stack(jl_task_t *t)
 {
     volatile int _x;
@@ -217,6 +449,21 @@ static void ctx_switch(jl_task_t *t, jmp_buf *where)
       *IF AND ONLY IF* throwing the exception involved a task switch.
     */
     //JL_SIGATOMIC_BEGIN();
+#ifdef SWAP_STACKS
+    jl_task_t *lastt = jl_current_task;
+#ifdef JL_GC_MARKSWEEP
+    lastt->state.gcstack = jl_pgcstack;
+    jl_pgcstack = t->state.gcstack;
+#endif
+    jl_current_task = t;
+    if (where == &t->ctx) {
+        jl_swap_stack(&lastt->sp, t->sp);
+        release_finished_stack();
+        return;
+    }
+    // going to an exception handler in another task; lastt has finished
+    longjmp(*where, 1);
+#else
     if (!setjmp(jl_current_task->ctx)) {
 #ifdef COPY_STACKS
         jl_task_t *lastt = jl_current_task;
@@ -237,6 +484,7 @@ static void ctx_switch(jl_task_t *t, jmp_buf *where)
         longjmp(*where, 1);
 #endif
     }
+#endif
     //JL_SIGATOMIC_END();
 }
 
@@ -345,6 +593,8 @@ static void finish_task(jl_task_t *t, jl_value_t *resultval)
     assert(t->done==jl_false);
     t->done = jl_true;
     t->result = resultval;
+    if (t->argarea != NULL)
+        restore_arg_area_loc(0);
     // TODO: early free of t->stkbuf
 #ifdef COPY_STACKS
     t->stkbuf = NULL;
@@ -387,11 +637,33 @@ static void start_task(jl_task_t *t)
     // if parent task has exited, try its parent, and so on
     while (cont->done==jl_true)
         cont = cont->on_exit;
+#ifdef SWAP_STACKS
+    finished_task = t;
+#endif
     jl_switchto(cont, t->result);
     assert(0);
 }
 
-#ifndef COPY_STACKS
+#ifdef SWAP_STACKS
+static void task_entry(void)
+{
+    // this runs the first time we switch to a task
+    release_finished_stack();
+    start_task(jl_current_task);
+}
+
+static void init_task(jl_task_t *t)
+{
+    // build a frame for jl_swap_stack to "return" into task_entry, with
+    // the stack aligned as if task_entry had been called.
+    void **sp = (void**)((char*)t->stack + t->ssize);
+    *--sp = NULL;
+    *--sp = (void*)&task_entry;
+    sp -= N_SAVED_REGS;
+    memset(sp, 0, N_SAVED_REGS*sizeof(void*));
+    t->sp = sp;
+}
+#elif !defined(COPY_STACKS)
 static void init_task(jl_task_t *t)
 {
     if (setjmp(t->ctx)) {
@@ -553,10 +825,13 @@ void jl_raise(jl_value_t *e)
 
 jl_task_t *jl_new_task(jl_function_t *start, size_t ssize)
 {
-    size_t pagesz = jl_page_size;
     jl_task_t *t = (jl_task_t*)allocobj(sizeof(jl_task_t));
     t->type = (jl_type_t*)jl_task_type;
-    ssize = LLT_ALIGN(ssize, pagesz);
+#ifdef COPY_STACKS
+    ssize = LLT_ALIGN(ssize, jl_page_size);
+#else
+    ssize = stack_alloc_size(ssize);
+#endif
     t->ssize = ssize;
     t->on_exit = jl_current_task;
     t->tls = jl_current_task->tls;
@@ -574,24 +849,18 @@ jl_task_t *jl_new_task(jl_function_t *start, size_t ssize)
     t->state.gcstack = NULL;
 #endif
     t->stkbuf = NULL;
+    t->argarea = NULL;
+    t->nopreempt = 0;
 
 #ifdef COPY_STACKS
     t->bufsz = 0;
 #else
     JL_GC_PUSH(&t);
-
-    char *stk = allocb(ssize+pagesz+(pagesz-1));
-    t->stkbuf = stk;
-    stk = (char*)LLT_ALIGN((uptrint_t)stk, pagesz);
-    // add a guard page to detect stack overflow
-    // the GC might read this area, which is ok, just prevent writes
-    if (mprotect(stk, pagesz-1, PROT_READ) == -1)
-        jl_errorf("mprotect: %s", strerror(errno));
-    t->stack = stk+pagesz;
-
+    t->stack = alloc_stack(ssize);
+    t->stkbuf = t->stack;
     init_task(t);
-    JL_GC_POP();
     jl_gc_add_finalizer((jl_value_t*)t, jl_unprotect_stack_func);
+    JL_GC_POP();
 #endif
 
     return t;
@@ -600,17 +869,12 @@ jl_task_t *jl_new_task(jl_function_t *start, size_t ssize)
 JL_CALLABLE(jl_unprotect_stack)
 {
 #ifndef COPY_STACKS
-    jl_task_t *t = (jl_task_t*)args[0];
-    char *stk = t->stack-jl_page_size;
-    // unprotect stack so it can be reallocated for something else
-    mprotect(stk, jl_page_size-1, PROT_READ|PROT_WRITE|PROT_EXEC);
+    // give the stack of an unreachable task back to the pool
+    release_task_stack((jl_task_t*)args[0]);
 #endif
     return (jl_value_t*)jl_null;
 }
 
-#define JL_MIN_STACK     (4096*sizeof(void*))
-#define JL_DEFAULT_STACK (2*12288*sizeof(void*))
-
 JL_CALLABLE(jl_f_task)
 {
     JL_NARGS(Task, 1, 2);
@@ -651,6 +915,77 @@ DLLEXPORT jl_value_t *jl_get_current_task(void)
     return (jl_value_t*)jl_current_task;
 }
 
+// --- preemption ---
+
+// code compiled with jl_compile_safepoints polls jl_yield_pending at loop
+// backedges and function entries. a timer thread sets the flag, and the
+// poll then calls Base._jl_preempt, which yields if the current task is one
+// the scheduler can resume.
+DLLEXPORT int jl_compile_safepoints = 0;
+DLLEXPORT volatile int32_t jl_yield_pending = 0;
+static volatile double preempt_interval = 0;
+static int preempt_thread_running = 0;
+static jl_function_t *preempt_func = NULL;
+
+// the @nopreempt depth belongs to the task, so a region that blocks and
+// switches away does not shield whichever task runs next.
+DLLEXPORT void jl_preempt_disable(void) { jl_current_task->nopreempt++; }
+DLLEXPORT void jl_preempt_enable(void)  { jl_current_task->nopreempt--; }
+
+DLLEXPORT void jl_safepoint(void)
+{
+    if (jl_current_task->nopreempt > 0 || jl_defer_signal)
+        return;
+    jl_yield_pending = 0;
+    if (preempt_func == NULL) {
+        if (jl_base_module == NULL)
+            return;
+        jl_value_t *f = jl_get_global(jl_base_module, jl_symbol("_jl_preempt"));
+        if (f == NULL || !jl_is_function(f))
+            return;
+        preempt_func = (jl_function_t*)f;
+    }
+    jl_apply(preempt_func, NULL, 0);
+}
+
+static void *run_preempt_timer(void *arg)
+{
+    sigset_t set;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    while (1) {
+        double interval = preempt_interval;
+        if (interval <= 0)
+            interval = 0.1;
+        else
+            jl_yield_pending = 1;
+        struct timespec ts;
+        ts.tv_sec = (time_t)interval;
+        ts.tv_nsec = (long)((interval - ts.tv_sec)*1e9);
+        nanosleep(&ts, NULL);
+    }
+    return NULL;
+}
+
+// ask running tasks to yield every `seconds` (0 turns this off). only code
+// compiled with safepoints enabled is affected.
+DLLEXPORT void jl_set_preempt_interval(double seconds)
+{
+    preempt_interval = seconds;
+    if (seconds > 0 && !preempt_thread_running) {
+        pthread_t thr;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setstacksize(&attr, 65536);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thr, &attr, run_preempt_timer, NULL) == 0)
+            preempt_thread_running = 1;
+        pthread_attr_destroy(&attr);
+    }
+    if (seconds <= 0)
+        jl_yield_pending = 0;
+}
+
 jl_function_t *jl_unprotect_stack_func;
 
 void jl_init_tasks(void *stack, size_t ssize)
@@ -666,6 +1001,7 @@ void jl_init_tasks(void *stack, size_t ssize)
     jl_tupleset(jl_task_type->types, 0, (jl_value_t*)jl_task_type);
     jl_task_type->fptr = jl_f_task;
 
+    jl_register_thread_state();
     jl_current_task = (jl_task_t*)allocobj(sizeof(jl_task_t));
     jl_current_task->type = (jl_type_t*)jl_task_type;
 #ifdef COPY_STACKS
@@ -677,6 +1013,8 @@ void jl_init_tasks(void *stack, size_t ssize)
     jl_current_task->ssize = ssize;
 #endif
     jl_current_task->stkbuf = NULL;
+    jl_current_task->argarea = NULL;
+    jl_current_task->nopreempt = 0;
     jl_current_task->on_exit = jl_current_task;
     jl_current_task->tls = NULL;
     jl_current_task->done = jl_false;
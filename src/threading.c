@@ -0,0 +1,532 @@
+/*
+  threading.c
+  native thread pool with per-thread work queues and work stealing
+
+  the julia runtime (gc, codegen, tasks, method and type caches) is not
+  thread safe, so the work items run here are native functions: a function
+  pointer and an argument. they must not allocate julia objects or call
+  back into julia. an item may name a julia object that its argument
+  points into; the gc keeps it alive until the item is released.
+  each thread owns a deque; it pushes and pops its own work at the bottom
+  and idle threads steal from the top of other threads' deques, so work
+  migrates to whichever thread is free. work items may spawn more work
+  from inside a pool thread. a thread waiting for an item runs other work
+  while it waits.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sched.h>
+#include <assert.h>
+#include "julia.h"
+
+#define JL_MAX_THREADS     64
+#define JL_WORK_DEQUE_SIZE 1024   // must be a power of 2
+
+#define JL_SCHED_STATIC  0
+#define JL_SCHED_DYNAMIC 1
+#define JL_SCHED_GUIDED  2
+
+struct _jl_work_t {
+    void (*fptr)(void*);
+    void *arg;
+    jl_value_t *root;     // kept alive until the item is released
+    volatile int done;
+    volatile int refs;   // one for the queue, one for the handle
+    // items with a root for the gc to mark
+    struct _jl_work_t *prev, *next;
+};
+
+typedef struct {
+    pthread_mutex_t lock;
+    size_t top;      // next item to steal
+    size_t bottom;   // next free slot for the owner
+    jl_work_t *items[JL_WORK_DEQUE_SIZE];
+} jl_workdeque_t;
+
+static int n_threads = 0;
+static jl_workdeque_t *deques = NULL;
+static pthread_t threads[JL_MAX_THREADS];
+static pthread_key_t thread_id_key;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static volatile int n_queued = 0;
+static volatile int n_sleeping = 0;
+static pthread_mutex_t sleep_lock;
+static pthread_cond_t wake_cond;
+
+static jl_work_t *live_work = NULL;
+static pthread_mutex_t live_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// index of the calling thread in the pool, or -1 for outside threads
+static int thread_id(void)
+{
+    return (int)(intptr_t)pthread_getspecific(thread_id_key) - 1;
+}
+
+static int deque_push(jl_workdeque_t *q, jl_work_t *w)
+{
+    pthread_mutex_lock(&q->lock);
+    if (q->bottom - q->top >= JL_WORK_DEQUE_SIZE) {
+        pthread_mutex_unlock(&q->lock);
+        return 0;
+    }
+    q->items[q->bottom & (JL_WORK_DEQUE_SIZE-1)] = w;
+    q->bottom++;
+    pthread_mutex_unlock(&q->lock);
+    return 1;
+}
+
+static jl_work_t *deque_pop(jl_workdeque_t *q)
+{
+    jl_work_t *w = NULL;
+    if (q->bottom == q->top)
+        return NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->bottom != q->top) {
+        q->bottom--;
+        w = q->items[q->bottom & (JL_WORK_DEQUE_SIZE-1)];
+    }
+    pthread_mutex_unlock(&q->lock);
+    return w;
+}
+
+static jl_work_t *deque_steal(jl_workdeque_t *q)
+{
+    jl_work_t *w = NULL;
+    if (q->bottom == q->top)
+        return NULL;
+    if (pthread_mutex_trylock(&q->lock) != 0)
+        return NULL;
+    if (q->bottom != q->top) {
+        w = q->items[q->top & (JL_WORK_DEQUE_SIZE-1)];
+        q->top++;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return w;
+}
+
+static void release_work(jl_work_t *w)
+{
+    if (__sync_sub_and_fetch(&w->refs, 1) == 0) {
+        if (w->root != NULL) {
+            pthread_mutex_lock(&live_lock);
+            if (w->prev) w->prev->next = w->next;
+            else live_work = w->next;
+            if (w->next) w->next->prev = w->prev;
+            pthread_mutex_unlock(&live_lock);
+        }
+        free(w);
+    }
+}
+
+// called by the gc. marking only touches the roots' headers, which the
+// native code running on them does not use.
+void jl_threadpool_mark(void (*mark)(jl_value_t*))
+{
+    pthread_mutex_lock(&live_lock);
+    for(jl_work_t *w = live_work; w != NULL; w = w->next)
+        mark(w->root);
+    pthread_mutex_unlock(&live_lock);
+}
+
+static void run_work(jl_work_t *w)
+{
+    w->fptr(w->arg);
+    __sync_synchronize();
+    w->done = 1;
+    release_work(w);
+}
+
+// own work first, newest first; then steal the oldest work of another
+// thread, starting after our own index so thieves spread out
+static jl_work_t *next_work(int tid)
+{
+    jl_work_t *w;
+    if (tid >= 0) {
+        w = deque_pop(&deques[tid]);
+        if (w != NULL)
+            goto found;
+    }
+    for(int i=1; i <= n_threads; i++) {
+        int victim = (tid+i) % n_threads;
+        if (victim < 0) victim += n_threads;
+        w = deque_steal(&deques[victim]);
+        if (w != NULL)
+            goto found;
+    }
+    return NULL;
+ found:
+    __sync_sub_and_fetch(&n_queued, 1);
+    return w;
+}
+
+static void *run_pool_thread(void *arg)
+{
+    int tid = (int)(intptr_t)arg;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGFPE);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGSEGV);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    pthread_setspecific(thread_id_key, (void*)(intptr_t)(tid+1));
+
+    while (1) {
+        jl_work_t *w = next_work(tid);
+        if (w != NULL) {
+            run_work(w);
+            continue;
+        }
+        pthread_mutex_lock(&sleep_lock);
+        __sync_add_and_fetch(&n_sleeping, 1);
+        while (n_queued == 0)
+            pthread_cond_wait(&wake_cond, &sleep_lock);
+        __sync_sub_and_fetch(&n_sleeping, 1);
+        pthread_mutex_unlock(&sleep_lock);
+    }
+    return NULL;
+}
+
+static void init_pool(void)
+{
+    int n = 0;
+    char *cp = getenv("JULIA_NUM_THREADS");
+    if (cp != NULL)
+        n = strtol(cp, NULL, 10);
+    if (n <= 0)
+        n = jl_cpu_cores();
+    if (n <= 0)
+        n = 1;
+    if (n > JL_MAX_THREADS)
+        n = JL_MAX_THREADS;
+
+    pthread_key_create(&thread_id_key, NULL);
+    pthread_mutex_init(&sleep_lock, NULL);
+    pthread_cond_init(&wake_cond, NULL);
+    deques = (jl_workdeque_t*)calloc(n, sizeof(jl_workdeque_t));
+    for(int i=0; i < n; i++)
+        pthread_mutex_init(&deques[i].lock, NULL);
+    n_threads = n;
+
+    // the thread that starts the pool is thread 0; it runs work while
+    // it waits for results
+    pthread_setspecific(thread_id_key, (void*)(intptr_t)1);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 1024*1024);
+    for(int i=1; i < n; i++)
+        pthread_create(&threads[i], &attr, run_pool_thread, (void*)(intptr_t)i);
+    pthread_attr_destroy(&attr);
+}
+
+DLLEXPORT int jl_threadpool_size(void)
+{
+    pthread_once(&pool_once, init_pool);
+    return n_threads;
+}
+
+DLLEXPORT int jl_threadpool_id(void)
+{
+    pthread_once(&pool_once, init_pool);
+    return thread_id();
+}
+
+static jl_work_t *new_work(void (*fptr)(void*), void *arg, jl_value_t *root)
+{
+    pthread_once(&pool_once, init_pool);
+    jl_work_t *w = (jl_work_t*)malloc(sizeof(jl_work_t));
+    if (w == NULL)
+        return NULL;
+    w->fptr = fptr;
+    w->arg = arg;
+    w->root = root;
+    w->done = 0;
+    w->refs = 2;
+    w->prev = NULL;
+    if (root != NULL) {
+        pthread_mutex_lock(&live_lock);
+        w->next = live_work;
+        if (live_work) live_work->prev = w;
+        live_work = w;
+        pthread_mutex_unlock(&live_lock);
+    }
+    else {
+        w->next = NULL;
+    }
+    return w;
+}
+
+// queue w on the calling thread's deque (thread 0's for threads outside
+// the pool). the result must be given back with jl_work_release.
+static jl_work_t *queue_work(jl_work_t *w)
+{
+    int tid = thread_id();
+    __sync_add_and_fetch(&n_queued, 1);
+    if (!deque_push(&deques[tid < 0 ? 0 : tid], w)) {
+        // queue full: run it now, depth first
+        __sync_sub_and_fetch(&n_queued, 1);
+        run_work(w);
+        return w;
+    }
+    if (n_sleeping > 0) {
+        pthread_mutex_lock(&sleep_lock);
+        pthread_cond_signal(&wake_cond);
+        pthread_mutex_unlock(&sleep_lock);
+    }
+    return w;
+}
+
+DLLEXPORT jl_work_t *jl_threadpool_spawn(void (*fptr)(void*), void *arg)
+{
+    jl_work_t *w = new_work(fptr, arg, NULL);
+    if (w == NULL)
+        jl_error("threadcall: out of memory");
+    return queue_work(w);
+}
+
+// like jl_threadpool_spawn, keeping root alive until the item is released
+DLLEXPORT jl_work_t *jl_threadcall(void (*fptr)(void*), void *arg,
+                                   jl_value_t *root)
+{
+    jl_work_t *w = new_work(fptr, arg, root);
+    if (w == NULL)
+        jl_error("threadcall: out of memory");
+    return queue_work(w);
+}
+
+DLLEXPORT int jl_work_done(jl_work_t *w)
+{
+    return w->done;
+}
+
+// wait for w to finish, running other queued work in the meantime
+DLLEXPORT void jl_threadpool_wait(jl_work_t *w)
+{
+    int tid = thread_id();
+    while (!w->done) {
+        jl_work_t *other = next_work(tid);
+        if (other != NULL)
+            run_work(other);
+        else
+            sched_yield();
+    }
+    __sync_synchronize();
+}
+
+DLLEXPORT void jl_work_release(jl_work_t *w)
+{
+    release_work(w);
+}
+
+// --- parallel loops ---
+
+// a loop over iterations [lo, hi) is run as one work item per pool thread
+// (a "part"), each calling body(arg, from, to, acc) on the pieces it gets.
+// static scheduling gives part p the p'th contiguous block of the range,
+// or every n_parts'th block of chunk iterations if chunk > 0. dynamic
+// scheduling has parts claim chunk iterations at a time from a shared
+// counter; guided scheduling claims a share of what remains, shrinking
+// down to chunk. each part has its own accumulator, acc bytes apart, for
+// the caller to combine, so parts never write to shared state.
+
+typedef struct {
+    void (*body)(void*, int64_t, int64_t, void*);
+    void *arg;
+    int64_t lo, hi;
+    int sched;
+    int64_t chunk;
+    int n_parts;
+    volatile int64_t next;   // first unclaimed iteration
+    char *acc;
+    size_t accsize;
+} jl_pfor_t;
+
+typedef struct {
+    jl_pfor_t *loop;
+    int part;
+} jl_pfor_part_t;
+
+// claim the next piece of a dynamic or guided loop into [*from, *to)
+static int pfor_claim(jl_pfor_t *l, int64_t *from, int64_t *to)
+{
+    while (1) {
+        int64_t start = l->next;
+        if (start >= l->hi)
+            return 0;
+        int64_t n = l->chunk;
+        if (l->sched == JL_SCHED_GUIDED) {
+            int64_t share = (l->hi - start) / (2*l->n_parts);
+            if (share > n)
+                n = share;
+        }
+        int64_t end = start + n < l->hi ? start + n : l->hi;
+        if (__sync_bool_compare_and_swap(&l->next, start, end)) {
+            *from = start;
+            *to = end;
+            return 1;
+        }
+    }
+}
+
+static void run_pfor_part(void *a)
+{
+    jl_pfor_part_t *pp = (jl_pfor_part_t*)a;
+    jl_pfor_t *l = pp->loop;
+    void *acc = l->acc ? l->acc + pp->part*l->accsize : NULL;
+    int64_t from, to;
+    if (l->sched == JL_SCHED_STATIC) {
+        int64_t n = l->hi - l->lo;
+        if (l->chunk <= 0) {
+            from = l->lo + n*pp->part/l->n_parts;
+            to = l->lo + n*(pp->part+1)/l->n_parts;
+            if (from < to)
+                l->body(l->arg, from, to, acc);
+            return;
+        }
+        for(from = l->lo + pp->part*l->chunk; from < l->hi;
+            from += l->n_parts*l->chunk) {
+            to = from + l->chunk < l->hi ? from + l->chunk : l->hi;
+            l->body(l->arg, from, to, acc);
+        }
+        return;
+    }
+    while (pfor_claim(l, &from, &to))
+        l->body(l->arg, from, to, acc);
+}
+
+// run body over [lo, hi) in the pool and wait for it. acc, if not NULL,
+// has jl_threadpool_size() accumulators of accsize bytes.
+DLLEXPORT void jl_threadpool_for(void (*body)(void*, int64_t, int64_t, void*),
+                                 void *arg, int64_t lo, int64_t hi, int sched,
+                                 int64_t chunk, char *acc, size_t accsize)
+{
+    pthread_once(&pool_once, init_pool);
+    if (hi <= lo)
+        return;
+    jl_pfor_t l;
+    l.body = body;
+    l.arg = arg;
+    l.lo = lo;
+    l.hi = hi;
+    l.sched = sched;
+    l.chunk = chunk > 0 ? chunk : (sched == JL_SCHED_STATIC ? 0 : 1);
+    l.n_parts = n_threads;
+    l.next = lo;
+    l.acc = acc;
+    l.accsize = accsize;
+    jl_pfor_part_t parts[JL_MAX_THREADS];
+    jl_work_t *work[JL_MAX_THREADS];
+    for(int i=0; i < n_threads; i++) {
+        parts[i].loop = &l;
+        parts[i].part = i;
+        work[i] = jl_threadpool_spawn(run_pfor_part, &parts[i]);
+    }
+    for(int i=0; i < n_threads; i++) {
+        jl_threadpool_wait(work[i]);
+        jl_work_release(work[i]);
+    }
+}
+
+// a loop body for testing the schedules: counts each iteration i in
+// ((int64_t*)arg)[i-1] and adds i to the int64 accumulator, if any
+DLLEXPORT void jl_pfor_count_body(void *arg, int64_t lo, int64_t hi,
+                                  void *acc)
+{
+    int64_t sum = 0;
+    for(int64_t i=lo; i < hi; i++) {
+        __sync_add_and_fetch(&((int64_t*)arg)[i-1], 1);
+        sum += i;
+    }
+    if (acc != NULL)
+        *(int64_t*)acc += sum;
+}
+
+// --- bounded multi-producer multi-consumer queue ---
+
+// the ring behind Base.Channel, after Dmitry Vyukov's bounded MPMC queue.
+// pos[0] is the next position to put and pos[JL_MPMC_HEAD] the next to
+// take, a cache line apart; seq has a sequence number per slot saying
+// whether the slot is ready for the put or the take at a given position.
+// a producer claims a position with a compare-and-swap, fills the slot,
+// then publishes it by advancing the slot's sequence number, and likewise
+// for consumers, so no locks are needed between threads.
+// julia code claims and publishes slots separately and stores the item
+// itself (so any element type works); native code uses jl_mpmc_put and
+// jl_mpmc_take, which copy elsize bytes and suit bits types only.
+#define JL_MPMC_HEAD 8
+
+static int64_t mpmc_claim(volatile size_t *posp, volatile size_t *seq,
+                          size_t mask, size_t ready)
+{
+    size_t pos = *posp;
+    while (1) {
+        size_t s = seq[pos & mask];
+        intptr_t dif = (intptr_t)s - (intptr_t)(pos + ready);
+        if (dif == 0) {
+            if (__sync_bool_compare_and_swap(posp, pos, pos+1))
+                return (int64_t)pos;
+            pos = *posp;
+        }
+        else if (dif < 0) {
+            return -1;
+        }
+        else {
+            pos = *posp;
+        }
+    }
+}
+
+// claim a slot to put into; returns its position, or -1 if the queue is full
+DLLEXPORT int64_t jl_mpmc_reserve_put(size_t *pos, size_t *seq, size_t mask)
+{
+    return mpmc_claim(&pos[0], seq, mask, 0);
+}
+
+DLLEXPORT void jl_mpmc_commit_put(size_t *seq, int64_t p, size_t mask)
+{
+    __sync_synchronize();
+    seq[p & mask] = p+1;
+}
+
+// claim a slot to take from; returns its position, or -1 if empty
+DLLEXPORT int64_t jl_mpmc_reserve_take(size_t *pos, size_t *seq, size_t mask)
+{
+    return mpmc_claim(&pos[JL_MPMC_HEAD], seq, mask, 1);
+}
+
+DLLEXPORT void jl_mpmc_commit_take(size_t *seq, int64_t p, size_t mask)
+{
+    __sync_synchronize();
+    seq[p & mask] = p+mask+1;
+}
+
+DLLEXPORT size_t jl_mpmc_length(size_t *pos)
+{
+    size_t tail = ((volatile size_t*)pos)[0];
+    size_t head = ((volatile size_t*)pos)[JL_MPMC_HEAD];
+    return tail > head ? tail-head : 0;
+}
+
+DLLEXPORT int jl_mpmc_put(size_t *pos, size_t *seq, char *data, size_t elsize,
+                          size_t mask, const void *x)
+{
+    int64_t p = jl_mpmc_reserve_put(pos, seq, mask);
+    if (p < 0)
+        return 0;
+    memcpy(data + (p & mask)*elsize, x, elsize);
+    jl_mpmc_commit_put(seq, p, mask);
+    return 1;
+}
+
+DLLEXPORT int jl_mpmc_take(size_t *pos, size_t *seq, char *data, size_t elsize,
+                           size_t mask, void *x)
+{
+    int64_t p = jl_mpmc_reserve_take(pos, seq, mask);
+    if (p < 0)
+        return 0;
+    memcpy(x, data + (p & mask)*elsize, elsize);
+    jl_mpmc_commit_take(seq, p, mask);
+    return 1;
+}
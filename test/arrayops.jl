@@ -208,6 +208,16 @@ d = drand(10,10)
 @assert isequal(d'', d)
 @assert isequal(convert(Array,d), d)
 
+## block-cyclic matrices ##
+
+let a = rand(13, 9), b = rand(9, 7)
+    A = bcdistribute(a, (4, 3))
+    B = bcdistribute(b, (3, 2))
+    @assert isequal(convert(Array, A), a)
+    @assert A[5, 8] == a[5, 8]
+    @assert max(abs(convert(Array, A*B) - a*b)) < 1e-12
+end
+
 ## cumsum
 
 begin
@@ -300,3 +300,141 @@ begin
     @assert my_func(c,c)==0
     @assert_fails my_func(a,c)
 end
+
+# calls between methods with native argument and return types
+begin
+    local sq, hyp, fib, bothpos, halfu
+    sq(x::Float64) = x*x
+    hyp(x::Float64, y::Float64) = sqrt(sq(x)+sq(y))
+    fib(n::Int) = n < 2 ? n : fib(n-1) + fib(n-2)
+    bothpos(a::Int, b::Int) = a > 0 && b > 0
+    halfu(x::Uint8) = x >> 1
+    @assert hyp(3.0, 4.0) == 5.0
+    @assert fib(20) == 6765
+    @assert bothpos(1, 2) && !bothpos(1, -2)
+    @assert halfu(0xff) === 0x7f
+end
+
+# locals with disjoint lifetimes may share gc frame slots
+begin
+    local joinparts, maybeundef
+    function joinparts(n)
+        a = string("a", n)
+        b = string(a, "b")
+        c = [b, b]
+        d = string(c[1], c[2])
+        e = strlen(d)
+        s = ""
+        for i=1:e
+            t = string(s, i)
+            s = t
+        end
+        s
+    end
+    function maybeundef(x)
+        if x > 0
+            y = string(x)
+        end
+        z = string("z")
+        y
+    end
+    @assert joinparts(1) == "123456"
+    @assert maybeundef(1) == "1"
+    @assert_fails maybeundef(-1)
+end
+
+# passing values to C by reference
+begin
+    local setref, setany
+    function setref(a::Array{Float64,1}, x::Float64)
+        ccall(:memcpy, Ptr{Void}, (Ptr{Float64}, Ptr{Float64}, Uint), a, &x, 8)
+        a[1]
+    end
+    function setany(a::Array{Float64,1}, x)
+        ccall(:memcpy, Ptr{Void}, (Ptr{Float64}, Ptr{Float64}, Uint), a, &x, 8)
+        a[1]
+    end
+    @assert setref([0.0], 1.5) == 1.5
+    @assert setany([0.0], 2.5) == 2.5
+    @assert_fails setany([0.0], "x")
+    @assert setany([0.0], 3.5) == 3.5
+end
+
+# tasks suspended deep in recursion keep their stacks. in the default
+# COPY_STACKS build the size given to Task is ignored and this covers the
+# copying of large stacks on each switch; the dedicated stacks the sizes are
+# for are only exercised by a USE_COPY_STACKS=0 build.
+begin
+    local deep_produce, nested
+    function deep_produce(depth, n)
+        if depth == 0
+            for i = 1:n
+                produce(i)
+            end
+            return 0
+        end
+        deep_produce(depth-1, n) + 1
+    end
+    a = Task(()->deep_produce(200, 10))
+    b = Task(()->deep_produce(5000, 10), 16*1024*1024)
+    for i = 1:10
+        @assert consume(a) == i
+        @assert consume(b) == i
+    end
+    @assert consume(a) == 200
+    @assert consume(b) == 5000
+    @assert istaskdone(a) && istaskdone(b)
+
+    # a task switching to another from inside its own recursion
+    function nested(depth)
+        if depth == 0
+            return consume(Task(()->deep_produce(100, 1)))
+        end
+        nested(depth-1) + 1
+    end
+    @assert consume(Task(()->nested(1000), 16*1024*1024)) == 1001
+end
+
+# task stack pool: (mapped, reused, unmapped, trimmed, pooled, pooled_bytes)
+begin
+    # the pool itself, which is built whether or not tasks use it. 64k
+    # stacks are a size class tasks do not use by default.
+    s0 = Base.stack_pool_stats()
+    p = ccall(:jl_pool_stack_alloc, Ptr{Void}, (Uint,), 65536)
+    ccall(:jl_pool_stack_free, Void, (Ptr{Void}, Uint), p, 65536)
+    s1 = Base.stack_pool_stats()
+    @assert s1[5] == s0[5]+1 && s1[6] == s0[6]+65536
+    q = ccall(:jl_pool_stack_alloc, Ptr{Void}, (Uint,), 65536)
+    @assert q == p
+    @assert Base.stack_pool_stats()[2] == s1[2]+1
+    ccall(:jl_pool_stack_free, Void, (Ptr{Void}, Uint), q, 65536)
+    # a stack idle for a whole collection is trimmed but stays pooled
+    gc()
+    gc()
+    s2 = Base.stack_pool_stats()
+    @assert s2[4] > s1[4]
+    @assert s2[5] >= s1[5] && s2[6] < s1[6]
+
+    # tasks only draw on the pool when they have their own stacks
+    s0 = Base.stack_pool_stats()
+    for i = 1:20
+        @assert consume(Task(()->i)) == i
+    end
+    s1 = Base.stack_pool_stats()
+    if s1[1] == s0[1] && s1[2] == s0[2]
+        # COPY_STACKS build: tasks run on copied stacks
+        @assert s1[5] == s0[5]
+    else
+        # finished tasks give their stacks back, so most are reused
+        @assert s1[1]+s1[2] >= s0[1]+s0[2]+20
+        @assert s1[2] > s0[2]
+        @assert s1[5] > 0 && s1[6] > 0
+        # stacks idle for a whole collection are trimmed
+        gc()
+        gc()
+        s2 = Base.stack_pool_stats()
+        @assert s2[4] > s1[4]
+        @assert s2[6] < s1[6]
+        @assert s2[5] == s1[5]
+    end
+end
@@ -98,3 +98,372 @@ end
 
 _d = {"a"=>0}
 @assert isa([k for k in filter(x->length(x)==1, keys(_d))], Vector{Any})
+
+# channels
+let
+    c = Channel{Int}(3)
+    @assert capacity(c) == 4
+    put(c, 1); put(c, 2); put(c, 3)
+    @assert length(c) == 3
+    @assert take(c) == 1
+    @assert take_n(c, 5) == [2, 3]
+    @assert !isready(c)
+
+    # the producer waits while the channel is full, the consumer while
+    # it is empty
+    d = Channel{Int}(2)
+    @spawnlocal for i = 1:100
+        put(d, i)
+    end
+    s = 0
+    for i = 1:100
+        s += take(d)
+    end
+    @assert s == 5050
+    @assert isempty(d)
+end
+
+# timers
+let
+    c = Channel{Int}(4)
+    @spawnlocal (sleep(0.2); put(c, 2))
+    @spawnlocal (sleep(0.1); put(c, 1))
+    @assert take(c) == 1
+    @assert take(c) == 2
+
+    n = 0
+    t = Timer(t->(n += 1; n == 3 && (stop_timer(t); put(c, n))))
+    start_timer(t, 0.01, 0.01)
+    @assert take(c) == 3
+
+    timedout = false
+    try
+        take(c, 0.05)
+    catch e
+        timedout = isa(e, TimeoutException)
+    end
+    @assert timedout
+end
+
+# preemption, in a julia started with --preempt: a spinning task yields
+# so another can set the flag it waits for, except under @nopreempt
+let code = "preempt_interval(0.01)
+            seen = false
+            setseen() = (global seen; seen = true)
+            function spin(limit)
+                t0 = time()
+                while !seen && time()-t0 < limit
+                end
+                seen
+            end
+            function race(f)
+                global seen
+                seen = false
+                r = @spawnlocal f()
+                @spawnlocal setseen()
+                fetch(r)
+            end
+            print(race(()->spin(10)), ' ', race(()->@nopreempt spin(0.5)))"
+    @assert readall(`$JULIA_HOME/julia-release-basic --preempt -e $code`) ==
+        "true false"
+end
+
+# event loop readiness
+let fds = zeros(Int32, 2), ready = {}
+    @assert ccall(:pipe, Int32, (Ptr{Int32},), fds) == 0
+    add_fd_handler(fds[1], fd->push(ready, fd))
+    Base.process_events(0.0)
+    @assert isempty(ready)
+    ccall(:write, Int, (Int32, Ptr{Uint8}, Uint), fds[2], "x", 1)
+    @assert Base.process_events(1.0) >= 1
+    @assert ready == {fds[1]}
+    # still readable until the byte is read
+    Base.process_events(0.0)
+    @assert length(ready) == 2
+    ccall(:read, Int, (Int32, Ptr{Uint8}, Uint), fds[1], Array(Uint8, 1), 1)
+    Base.process_events(0.0)
+    @assert length(ready) == 2
+    del_fd_handler(fds[1])
+    ccall(:write, Int, (Int32, Ptr{Uint8}, Uint), fds[2], "x", 1)
+    Base.process_events(0.0)
+    @assert length(ready) == 2
+    ccall(:close, Int32, (Int32,), fds[1])
+    ccall(:close, Int32, (Int32,), fds[2])
+end
+
+# a task waiting on a non-blocking read lets other tasks run
+let fds = zeros(Int32, 2), order = {}
+    @assert ccall(:pipe, Int32, (Ptr{Int32},), fds) == 0
+    r = fdio(fds[1], true)
+    w = fdio(fds[2], true)
+    set_nonblocking(r, true)
+    reader = @spawnlocal begin
+        push(order, :reading)
+        l = readline(r)
+        push(order, :read)
+        l
+    end
+    writer = @spawnlocal begin
+        push(order, :writing)
+        write(w, "hello\n")
+        flush(w)
+        push(order, :written)
+    end
+    @assert fetch(reader) == "hello\n"
+    wait(writer)
+    @assert order == {:reading, :writing, :written, :read}
+    close(r)
+    close(w)
+end
+
+# serialization
+let
+    vals = {:some_symbol, [1.5, 2.5], int32([1 2; 3 4]), (1, 2, 3, 4, 5),
+            1:10, {:some_symbol, Range(1, 2, 9)}}
+    plain = memio()
+    s = Base._jl_open_ser_session(memio())
+    for k = 1:2
+        for v in vals
+            serialize(plain, v)
+            serialize(s, v)
+        end
+    end
+    # the second round of types and symbols is sent as table references
+    @assert position(s) < position(plain)
+    seek(plain, 0)
+    seek(s, 0)
+    for k = 1:2
+        for v in vals, io in (plain, s)
+            @assert isequal(force(deserialize(io)), v)
+        end
+    end
+    Base._jl_close_ser_session(s)
+
+    # the native serializer writes the same bytes and reads them back
+    a = Base._jl_open_ser_session(memio())
+    b = Base._jl_open_ser_session(memio())
+    for k = 1:2
+        for v in vals
+            serialize(a, v)
+            Base._jl_msg_serialize(b, v)
+        end
+    end
+    @assert takebuf_array(a) == takebuf_array(b)
+    Base._jl_open_ser_session(b)
+    for k = 1:2
+        for v in vals
+            Base._jl_msg_serialize(b, v)
+        end
+    end
+    seek(b, 0)
+    for k = 1:2
+        for v in vals
+            @assert isequal(force(Base._jl_msg_deserialize(b)), v)
+        end
+    end
+    Base._jl_close_ser_session(a)
+    Base._jl_close_ser_session(b)
+end
+
+# types defined outside Base
+type SerTestPoint
+    x::Int
+    y::Float64
+end
+type SerTestBox{T}
+    v::T
+end
+let s = memio()
+    Base._jl_msg_serialize(s, SerTestPoint(3, 1.5))
+    Base._jl_msg_serialize(s, SerTestBox{Int}(7))
+    seek(s, 0)
+    p = force(Base._jl_msg_deserialize(s))
+    @assert isa(p, SerTestPoint) && p.x == 3 && p.y == 1.5
+    b = force(Base._jl_msg_deserialize(s))
+    @assert isa(b, SerTestBox{Int}) && b.v == 7
+end
+
+# large bits arrays for processes on this host go through a shared segment
+let a = rand(div(Base._jl_shm_array_min, 8)), s = memio()
+    r = Base._jl_shm_wrap(a)
+    @assert isa(r, Base.ShmArrayRef) && isfile(r.path)
+    small = a[1:10]
+    @assert is(Base._jl_shm_wrap(small), small)
+    Base._jl_msg_serialize(s, r)
+    seek(s, 0)
+    @assert isequal(force(Base._jl_msg_deserialize(s)), a)
+    @assert !isfile(r.path)
+end
+
+# files of shared-memory arrays the peer never took are removed with the
+# link (the link itself is tested with a local worker below)
+let fd = int32(-1)
+    r = Base._jl_shm_wrap(zeros(div(Base._jl_shm_array_min, 8)))
+    @assert isa(r, Base.ShmArrayRef)
+    Base._jl_shm_track(fd, (1, r))
+    @assert isfile(r.path)
+    Base._jl_shm_close(fd)
+    @assert !isfile(r.path)
+end
+
+# shared arrays
+let S = SharedArray(Int, (4, 5)), b = memio()
+    @assert size(S) == (4, 5) && S[3, 2] == 0
+    S[3, 2] = 7
+    serialize(b, S)
+    seek(b, 0)
+    T = force(deserialize(b))
+    # the copy maps the same memory
+    @assert T[3, 2] == 7
+    T[20] = 9
+    @assert S[4, 5] == 9
+    @assert localindexes(S) == 1:20
+end
+
+# load-balanced pmap
+let
+    for s in (PmapSchedule(), PmapSchedule(7, 3, true), PmapSchedule(1, 1, false))
+        r = pmap_balanced(s, (x,y)->x*y, [1:100], [2:101])
+        @assert length(r) == 100 && r[1] == 2 && r[100] == 10100
+        @assert sum(map(t->t[2], pmap_stats())) == 100
+    end
+end
+
+# batched reference changes
+let rr = remote_call(1, ()->1), none = Array(Int, 0)
+    wait(rr)
+    id = rr2id(rr)
+    n = remote_ref_stats()[1][2]
+    @assert n >= 1
+    Base.gc_msgs([id[1], id[2], 5], none)
+    @assert has(Base.lookup_ref(id).clientset, 5)
+    Base.gc_msgs(none, [id[1], id[2], 5])
+    @assert !has(Base.lookup_ref(id).clientset, 5)
+    @assert remote_ref_stats()[1][2] == n
+end
+
+# worker failures
+let
+    @assert procs() == [1]
+    @assert fetch(remote_call_idempotent(1, x->x+1, 1)) == 2
+    failed = false
+    try
+        remote_call_fetch(Base.DeadWorker(2), ()->1)
+    catch e
+        failed = isa(e, ProcessFailedException) && e.pid == 2
+    end
+    @assert failed
+end
+
+# a local worker that is killed
+let
+    addprocs_local(1)
+    p = nprocs()
+    @assert procs() == [1, p]
+    fd = Base.worker_from_id(p).fd
+    waiting = remote_call(p, sleep, 60)
+    # blocks on the worker, returns at once when run again here
+    rerun = remote_call_idempotent(p, ()->(myid() == 1 || sleep(60); myid()))
+    run(`kill -9 $(remote_call_fetch(p, getpid))`)
+    failed = false
+    try
+        wait(waiting)
+    catch e
+        failed = isa(e, ProcessFailedException) && e.pid == p
+    end
+    @assert failed
+    @assert fetch(rerun) == 1
+    @assert procs() == [1]
+    # the connection is closed
+    @assert ccall(:fcntl, Int32, (Int32, Int32), fd, 1) == -1
+end
+
+# native threads: sem_post run on the pool, on a semaphore in an array
+let post = dlsym(ccall(:jl_load_dynamic_library, Ptr{Void}, (Ptr{Uint8},),
+                       C_NULL), :sem_post)
+    sem = zeros(Uint8, 64)   # room for a sem_t
+    @assert ccall(:sem_init, Int32, (Ptr{Uint8}, Int32, Uint32), sem, 0, 0) == 0
+    w = threadcall(post, sem)
+    wait(w)
+    @assert isready(w)
+    @assert ccall(:sem_trywait, Int32, (Ptr{Uint8},), sem) == 0
+    @assert ccall(:sem_trywait, Int32, (Ptr{Uint8},), sem) == -1
+    ws = [ threadcall(post, sem) for i=1:10 ]
+    for w in ws
+        wait(w)
+    end
+    for i = 1:10
+        @assert ccall(:sem_trywait, Int32, (Ptr{Uint8},), sem) == 0
+    end
+    @assert ccall(:sem_trywait, Int32, (Ptr{Uint8},), sem) == -1
+    ccall(:sem_destroy, Int32, (Ptr{Uint8},), sem)
+    # dropping the handles releases the work items without waiting
+    w = nothing
+    ws = nothing
+    gc()
+end
+
+# parallel loops, with a native body that counts each iteration and sums
+# the ones it ran into its accumulator
+let body = dlsym(ccall(:jl_load_dynamic_library, Ptr{Void}, (Ptr{Uint8},),
+                       C_NULL), :jl_pfor_count_body)
+    for s in ((:static, 0), (:static, 3), (:dynamic, 1), (:dynamic, 7),
+              (:guided, 2))
+        a = zeros(Int64, 1000)
+        threadfor(body, a, 1:1000, s[1], s[2])
+        @assert a == ones(Int64, 1000)
+        @assert threadreduce(+, int64(0), body, a, 1:1000, s[1], s[2]) == 500500
+        @assert a == fill(int64(2), 1000)
+    end
+    a = zeros(Int64, 10)
+    @assert threadreduce(+, int64(0), body, a, 5:4) == 0
+    @assert a == zeros(Int64, 10)
+end
+
+# every message of a burst is counted and its bytes are written. how many
+# writes it takes depends on timing, so that is not checked
+let
+    addprocs_local(1)
+    p = nprocs()
+    w = Base.worker_from_id(p)
+    s0 = Base.send_stats(w)
+    for i = 1:1000
+        remote_do(p, identity, i)
+    end
+    @assert remote_call_fetch(p, myid) == p
+    s = Base.send_stats(w)
+    @assert s[1]-s0[1] >= 1001
+    @assert s[2] > s0[2]
+    @assert s[3]-s0[3] >= 1001
+end
+
+# block-cyclic matrices over a 2x2 grid of processes, with sizes that do
+# not divide evenly into blocks
+let
+    if nprocs() < 4
+        addprocs_local(4-nprocs())
+    end
+    grid = procgrid(procs()[1:4])
+    @assert size(grid) == (2, 2)
+    a = rand(13, 9)
+    b = rand(9, 7)
+    A = bcdistribute(a, (4, 3), grid)
+    B = bcdistribute(b, (3, 2), grid)
+    @assert isequal(convert(Array, A), a)
+    @assert A[13, 8] == a[13, 8]
+    @assert max(abs(convert(Array, A*B) - a*b)) < 1e-10
+end
+
+# a local worker talks over a shared-memory link. a message larger than the
+# ring arrives in frames that are put back together, with the reader
+# waiting for the doorbell in between; a large bits array goes in a file
+# of its own
+if !has(ENV, "JULIA_NO_SHM")
+    let p = procs()[end]
+        @assert has(Base._jl_shm_links, Base.worker_from_id(p).fd)
+        x = {string(i) for i=1:200000}
+        @assert isequal(remote_call_fetch(p, identity, x), x)
+        a = ones(div(Base._jl_shm_array_min, 8)*2)
+        @assert remote_call_fetch(p, sum, a) == length(a)
+    end
+end
@@ -0,0 +1,57 @@
+function write_arrays(io::IOStream, a::Vector{Float64}, niter::Int)
+    for n = 1:niter
+        write(io, a)
+        seek(io, 0)
+    end
+end
+
+function write_strings(io::IOStream, s::ASCIIString, niter::Int)
+    for n = 1:niter
+        print(io, s)
+        seek(io, 0)
+    end
+end
+
+function write_subarrays(io::IOStream, a::Matrix{Float64}, niter::Int)
+    for n = 1:niter
+        write(io, sub(a, 1:size(a,1), 2:size(a,2)))
+        seek(io, 0)
+    end
+end
+
+function count_byte(a::Array{Uint8,1}, b::Uint8)
+    count = 0
+    i = memchr(a, b)
+    while i != 0
+        count += 1
+        i = i < length(a) ? memchr(a, b, i+1) : 0
+    end
+    count
+end
+
+function time_ccall_args(len::Int, niter::Int)
+    io = memio()
+    a = randn(len)
+    print("Bulk ios_write of a Vector{Float64}: ")
+    @time write_arrays(io, a, niter)
+    s = "x"^(8*len)
+    print("Bulk ios_write of an ASCIIString: ")
+    @time write_strings(io, s, niter)
+    m = randn(len, 4)
+    print("Bulk ios_write of a contiguous SubArray: ")
+    @time write_subarrays(io, m, niter)
+    close(io)
+
+    bytes = Array(Uint8, len)
+    for i = 1:len
+        bytes[i] = rand() < 0.5 ? uint8('a') : uint8('b')
+    end
+    print("memchr over a byte array: ")
+    @time begin
+        for n = 1:niter
+            count_byte(bytes, uint8('a'))
+        end
+    end
+end
+
+time_ccall_args(10000, 1000)
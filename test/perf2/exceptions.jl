@@ -0,0 +1,50 @@
+function try_no_throw(n::Int)
+    s = 0
+    for i = 1:n
+        try
+            s += i
+        catch
+            s -= 1
+        end
+    end
+    s
+end
+
+function try_throw(n::Int)
+    e = ErrorException("")
+    s = 0
+    for i = 1:n
+        try
+            throw(e)
+        catch
+            s += 1
+        end
+    end
+    s
+end
+
+# every call pushes and pops a gc frame, since the tuple is rooted across
+# the call to identity
+function gcframe_leaf(i::Int)
+    t = (i, i)
+    identity(t)[1]
+end
+
+function gcframe_calls(n::Int)
+    s = 0
+    for i = 1:n
+        s += gcframe_leaf(i)
+    end
+    s
+end
+
+function time_exceptions(n::Int)
+    print("try/catch, no exception: ")
+    @time try_no_throw(n)
+    print("throw and catch: ")
+    @time try_throw(div(n,10))
+    print("gc frame push/pop: ")
+    @time gcframe_calls(n)
+end
+
+time_exceptions(1000000)
@@ -0,0 +1,16 @@
+# many small tasks: one message per item against batched, pipelined requests
+if nprocs() < 2
+    addprocs_local(4)
+end
+
+function time_pmap(n::Int)
+    print("pmap, $n items: ")
+    @time pmap(x->x+1, 1:n)
+    print("pmap_balanced, $n items: ")
+    @time pmap_balanced(x->x+1, 1:n)
+    for (p, items, reqs, secs) in pmap_stats()
+        println("  worker $p: $items items in $reqs requests")
+    end
+end
+
+time_pmap(20000)
@@ -0,0 +1,36 @@
+# cost of encoding and decoding a typical remote call message
+function ser_msgs(ser::Function, n::Int)
+    s = Base._jl_open_ser_session(memio())
+    msg = (:call, (1, 1234), :ref, ([1.0, 2.0, 3.0], 5:10))
+    for i = 1:n
+        ser(s, msg)
+        takebuf_array(s)
+    end
+    Base._jl_close_ser_session(s)
+end
+
+function deser_msgs(deser::Function, n::Int)
+    s = Base._jl_open_ser_session(memio())
+    msg = (:call, (1, 1234), :ref, ([1.0, 2.0, 3.0], 5:10))
+    for i = 1:n
+        Base._jl_msg_serialize(s, msg)
+    end
+    seek(s, 0)
+    for i = 1:n
+        force(deser(s))
+    end
+    Base._jl_close_ser_session(s)
+end
+
+function time_serialize(n::Int)
+    print("serialize: ")
+    @time ser_msgs(serialize, n)
+    print("native serialize: ")
+    @time ser_msgs(Base._jl_msg_serialize, n)
+    print("deserialize: ")
+    @time deser_msgs(deserialize, n)
+    print("native deserialize: ")
+    @time deser_msgs(Base._jl_msg_deserialize, n)
+end
+
+time_serialize(100000)
@@ -0,0 +1,30 @@
+# distributed matrix product on 1 to N local processes: block-cyclic SUMMA
+# against the DArray product
+if nprocs() < 2
+    addprocs_local(max(CPU_CORES, 4) - 1)
+end
+
+function time_summa(n::Int, nb::Int)
+    a = rand(n, n)
+    b = rand(n, n)
+    print("local gemm, n=$n: ")
+    @time a*b
+    ps = procs()
+    for np = 1:length(ps)
+        grid = procgrid(ps[1:np])
+        A = bcdistribute(a, (nb, nb), grid)
+        B = bcdistribute(b, (nb, nb), grid)
+        A*B
+        print("summa, $np procs ($(size(grid,1))x$(size(grid,2)) grid): ")
+        @time A*B
+        dA = darray((T,lsz,da)->a[myindexes(da)...], Float64, size(a), 1,
+                    ps[1:np])
+        dB = darray((T,lsz,da)->b[myindexes(da)...], Float64, size(b), 2,
+                    ps[1:np])
+        dA*dB
+        print("darray, $np procs: ")
+        @time dA*dB
+    end
+end
+
+time_summa(2048, 128)
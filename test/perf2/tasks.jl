@@ -0,0 +1,53 @@
+function pingpong_producer(n::Int)
+    for i = 1:n
+        produce(i)
+    end
+end
+
+function pingpong(n::Int)
+    t = Task(()->pingpong_producer(n))
+    s = 0
+    for i = 1:n
+        s += consume(t)
+    end
+    s
+end
+
+function deep_produce(depth::Int, n::Int)
+    if depth == 0
+        for i = 1:n
+            produce(i)
+        end
+        return 0
+    end
+    deep_produce(depth-1, n) + 1
+end
+
+function deep_pingpong(depth::Int, n::Int)
+    t = Task(()->deep_produce(depth, n))
+    s = 0
+    for i = 1:n
+        s += consume(t)
+    end
+    s
+end
+
+function many_tasks(ntasks::Int)
+    for i = 1:ntasks
+        t = Task(()->produce(i))
+        consume(t)
+    end
+end
+
+function time_tasks(n::Int)
+    print("produce/consume ping-pong: ")
+    @time pingpong(n)
+    print("produce/consume from a deep stack: ")
+    @time deep_pingpong(1000, n)
+    print("create and run short-lived tasks: ")
+    @time many_tasks(div(n,10))
+    println("stack pool (mapped, reused, unmapped, trimmed, pooled, bytes): ",
+            Base.stack_pool_stats())
+end
+
+time_tasks(100000)
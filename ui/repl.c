@@ -21,7 +21,11 @@ static const char *opts =
     " -E --print=<expr>        Evaluate and show <expr>\n"
     " -P --post-boot=<expr>    Evaluate <expr> right after boot\n"
     " -L --load=file           Load <file> right after boot\n"
-    " -J --sysimage=file       Start up with the given system image file\n\n"
+    " -J --sysimage=file       Start up with the given system image file\n"
+    " -N --native=file         Also write native code to <file> when saving\n"
+    "                          the system image\n"
+    " --preempt                Compile safepoints so running tasks can be\n"
+    "                          preempted (see preempt_interval)\n\n"
 
     " -p n                     Run n local processes\n"
     " --machinefile file       Run processes on hosts listed in file\n\n"
@@ -29,7 +33,7 @@ static const char *opts =
     " -h --help                Print this message\n";
 
 void parse_opts(int *argcp, char ***argvp) {
-    static char* shortopts = "+H:T:bhJ:";
+    static char* shortopts = "+H:T:bhJ:N:";
     static struct option longopts[] = {
         { "home",        required_argument, 0, 'H' },
         { "tab",         required_argument, 0, 'T' },
@@ -37,6 +41,8 @@ void parse_opts(int *argcp, char ***argvp) {
         { "lisp",        no_argument,       &lisp_prompt, 1 },
         { "help",        no_argument,       0, 'h' },
         { "sysimage",    required_argument, 0, 'J' },
+        { "native",      required_argument, 0, 'N' },
+        { "preempt",     no_argument,       0, 'S' },
         { 0, 0, 0, 0 }
     };
     int c;
@@ -71,6 +77,14 @@ void parse_opts(int *argcp, char ***argvp) {
 #endif
             ind+=2;
             break;
+        case 'N':
+            jl_native_objfile = strdup(optarg);
+            ind+=2;
+            break;
+        case 'S':
+            jl_compile_safepoints = 1;
+            ind+=1;
+            break;
         case 'h':
             printf("%s%s", usage, opts);
             exit(0);